@@ -0,0 +1,158 @@
+#include "HotPathDispatch.hh"
+
+#include "G4Box.hh"
+#include "G4Cerenkov.hh"
+#include "G4DynamicParticle.hh"
+#include "G4LogicalVolume.hh"
+#include "G4NistManager.hh"
+#include "G4OpticalPhoton.hh"
+#include "G4Scintillation.hh"
+#include "G4SystemOfUnits.hh"
+#include "G4Track.hh"
+
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+
+// Micro-benchmark of the per-step/per-photon lookups of HodoSim (see include/HotPathDispatch.hh).
+// The lookups run on real Geant4 objects (logical volumes, tracks of optical photons created by the real
+// scintillation and Cerenkov processes), the new side calls the HotPathDispatch code of HodoSim itself:
+//  - volume:   SteppingAction, LV name comparison vs cached LV pointer comparison (every boundary step)
+//  - process:  creator process name comparisons (GetOpticalPhotonCreator before) vs GetOpticalPhotonOrigin (every photon, in several actions)
+// The hit collection IDs are not measured: the EventAction already cached them once per thread before HotPathDispatch,
+// HitCollectionIDs only shares the cache between the actions.
+//
+// Usage:
+//   Benchmark [iterations]
+
+
+#pragma region Utils
+
+void logMessage(const std::string& msg, bool skip = false) {
+
+	auto prefix = skip ? "" : "[Benchmark] ";
+	std::cout << prefix << msg << std::endl;
+}
+
+template <typename F>
+double nsPerCall(F&& f, std::size_t iterations)
+{
+	const auto start = std::chrono::steady_clock::now();
+	f();
+	const auto stop = std::chrono::steady_clock::now();
+	return std::chrono::duration<double, std::nano>(stop - start).count() / (double)iterations;
+}
+
+void report(const std::string& name, double before, double after)
+{
+	std::cout << "|  " << std::left << std::setw(10) << name
+		<< std::right << std::fixed << std::setprecision(2)
+		<< std::setw(10) << before << " ns  ->" << std::setw(8) << after << " ns"
+		<< "  (x" << std::setprecision(1) << before / after << ")" << std::endl;
+}
+
+#pragma endregion Utils
+
+
+int main(int argc, char** argv)
+{
+	const std::size_t iterations = (argc > 1) ? std::stoull(argv[1]) : 20000000;
+
+	std::mt19937 rng(12345);
+
+	// Sink for the results, so that the loops are not optimized away
+	volatile std::uint64_t sink = 0;
+
+
+	#pragma region Volume
+
+	// The logical volumes of HodoSim (same names), a muon boundary step can end in any of them
+	auto* air = G4NistManager::Instance()->FindOrBuildMaterial("G4_AIR");
+	auto* box = new G4Box("BenchmarkBox", 1 * mm, 1 * mm, 1 * mm);
+	std::vector<const G4LogicalVolume*> volumes;
+	for (const char* name : { "WorldLogic", "CoatLogic", "ScintLogic", "SiPMLogic" }) volumes.push_back(new G4LogicalVolume(box, air, name));
+
+	const G4String scintLVName = "ScintLogic";
+	const G4LogicalVolume* scintLV = volumes[2];
+
+	std::vector<const G4LogicalVolume*> steps(1 << 16);
+	for (auto& step : steps) step = volumes[rng() % volumes.size()];
+	const std::size_t mask = steps.size() - 1;
+
+	const double volumeByName = nsPerCall([&] {
+		std::uint64_t n = 0;
+		for (std::size_t i = 0; i < iterations; i++) n += (steps[i & mask]->GetName() == scintLVName);
+		sink = n;
+	}, iterations);
+
+	const double volumeByPointer = nsPerCall([&] {
+		std::uint64_t n = 0;
+		for (std::size_t i = 0; i < iterations; i++) n += (steps[i & mask] == scintLV);
+		sink = n;
+	}, iterations);
+
+	#pragma endregion Volume
+
+
+	#pragma region Process
+
+	// Scintillation dominates, a few percent of Cerenkov photons
+	G4Scintillation scintillation;
+	G4Cerenkov cerenkov;
+
+	std::vector<std::unique_ptr<G4Track>> photons(steps.size());
+	for (auto& photon : photons)
+	{
+		auto* particle = new G4DynamicParticle(G4OpticalPhoton::OpticalPhotonDefinition(), G4ThreeVector(0., 0., 1.), 3 * eV);
+		photon = std::make_unique<G4Track>(particle, 0., G4ThreeVector());
+		photon->SetCreatorProcess((rng() % 100) < 97 ? static_cast<const G4VProcess*>(&scintillation) : &cerenkov);
+	}
+
+	// The checks of the SD before: creator name != "none", == "Scintillation" / == "Cerenkov"
+	const G4String none = "none";
+	const double processByName = nsPerCall([&] {
+		std::uint64_t n = 0;
+		for (std::size_t i = 0; i < iterations; i++)
+		{
+			const G4VProcess* creator = photons[i & mask]->GetCreatorProcess();
+			const G4String& name = creator ? creator->GetProcessName() : none;
+			if (name != "none")
+			{
+				if (name == "Scintillation") n += 1;
+				else if (name == "Cerenkov") n += 2;
+			}
+		}
+		sink = n;
+	}, iterations);
+
+	const double processByTable = nsPerCall([&] {
+		std::uint64_t n = 0;
+		for (std::size_t i = 0; i < iterations; i++)
+		{
+			const OpticalPhotonOrigin o = GetOpticalPhotonOrigin(photons[i & mask].get());
+			if (o == OpticalPhotonOrigin::Scintillation) n += 1;
+			else if (o == OpticalPhotonOrigin::Cerenkov) n += 2;
+		}
+		sink = n;
+	}, iterations);
+
+	#pragma endregion Process
+
+
+	logMessage(std::to_string(iterations) + " iterations, time per lookup (name -> pointer/enum)");
+	report("volume", volumeByName, volumeByPointer);
+	report("process", processByName, processByTable);
+
+	// A detected photon goes through ~3 creator lookups (stacking, tracking, SD), a muon boundary step through 1 volume lookup
+	std::cout << std::setprecision(1)
+		<< "|  saving per muon boundary step: ~" << volumeByName - volumeByPointer << " ns" << std::endl
+		<< "|  saving per detected photon:    ~" << 3 * (processByName - processByTable) << " ns" << std::endl;
+
+	return 0;
+}
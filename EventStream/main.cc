@@ -0,0 +1,168 @@
+#include "EventStreamFormat.hh"
+
+#include <TFile.h>
+#include <TTree.h>
+#ifdef HODOSIM_WITH_ZLIB
+#include <zlib.h>
+#endif
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+
+// Conversion of the event stream written by the async output backend (output.backend: async in config.yaml)
+// to the PerEventCollectedData tree of a regular run, with the same column names and types
+// (EventID, ScintOPs/CerOPs per-SiPM vectors, float muon truth), so PlotPredict and the other tools work unchanged.
+//
+// Usage:
+//   EventStream <input.hodoevt> [output.root]
+// The output defaults to the input path with the .root extension.
+
+
+#pragma region Utils
+
+void logMessage(const std::string& msg, bool skip = false) {
+
+	auto prefix = skip ? "" : "[EventStream] ";
+	std::cout << prefix << msg << std::endl;
+}
+
+#pragma endregion Utils
+
+
+int main(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		logMessage("Usage: EventStream <input.hodoevt> [output.root]");
+		return 1;
+	}
+
+	const std::string input = argv[1];
+	const std::string output = (argc > 2) ? argv[2] : std::filesystem::path(input).replace_extension(".root").string();
+
+	std::ifstream in(input, std::ios::binary);
+	if (!in)
+	{
+		logMessage("Error: could not open '" + input + "'.");
+		return 1;
+	}
+
+	EventStreamHeader header{};
+	in.read(reinterpret_cast<char*>(&header), sizeof(header));
+	if (!in || std::strncmp(header.magic, "HODOEVT", 8) != 0 || header.version != kEventStreamVersion)
+	{
+		logMessage("Error: '" + input + "' is not a HodoSim event stream (or has a different version).");
+		return 1;
+	}
+	if (header.recordSize != EventRecordSize(header.nSiPMs))
+	{
+		logMessage("Error: unexpected record size " + std::to_string(header.recordSize) + " for " + std::to_string(header.nSiPMs) + " SiPMs.");
+		return 1;
+	}
+#ifndef HODOSIM_WITH_ZLIB
+	if (header.compression == 1)
+	{
+		logMessage("Error: '" + input + "' has compressed batches, EventStream was built without zlib.");
+		return 1;
+	}
+#endif
+
+	TFile file(output.c_str(), "RECREATE");
+	TTree tree("PerEventCollectedData", "Per-Event Collected Data");
+
+	EventRecordTruth truth{};
+	std::vector<int> scintOPs(header.nSiPMs), cerOPs(header.nSiPMs);
+	tree.Branch("EventID", &truth.eventID);
+	tree.Branch("ScintOPs", &scintOPs);
+	tree.Branch("CerOPs", &cerOPs);
+	tree.Branch("ScintTotalEdep", &truth.scintEdep);
+	tree.Branch("CoatingTotalEdep", &truth.coatingEdep);
+	tree.Branch("MuPathLength", &truth.muPathLength);
+	tree.Branch("MuonHitX", &truth.muonHitX);
+	tree.Branch("MuonHitY", &truth.muonHitY);
+	tree.Branch("MuonExitX", &truth.muonExitX);
+	tree.Branch("MuonExitY", &truth.muonExitY);
+	tree.Branch("MuonExitZ", &truth.muonExitZ);
+	tree.Branch("MuonExitDirX", &truth.muonExitDirX);
+	tree.Branch("MuonExitDirY", &truth.muonExitDirY);
+	tree.Branch("MuonExitDirZ", &truth.muonExitDirZ);
+	tree.Branch("MuonExitEnergy", &truth.muonExitEnergy);
+
+	std::vector<char> stored, raw;
+	std::uint64_t nEvents = 0;
+	EventStreamBatchHeader batch{};
+
+	while (in.read(reinterpret_cast<char*>(&batch), sizeof(batch)))
+	{
+		// The record loop reads exactly nRecords records from the raw batch, a corrupted header must not send it past the end
+		// (checked before anything is allocated or read with the sizes of the header)
+		if ((std::uint64_t)batch.rawSize != (std::uint64_t)batch.nRecords * header.recordSize || batch.storedSize > batch.rawSize)
+		{
+			logMessage("Error: corrupted batch header after " + std::to_string(nEvents) + " events (" + std::to_string(batch.nRecords)
+				+ " records, " + std::to_string(batch.rawSize) + " raw bytes, " + std::to_string(batch.storedSize) + " stored bytes).");
+			return 1;
+		}
+
+		stored.resize(batch.storedSize);
+		raw.resize(batch.rawSize);
+		if (!in.read(stored.data(), batch.storedSize))
+		{
+			logMessage("Warning: truncated batch, the stream ends here.");
+			break;
+		}
+
+		if (batch.storedSize < batch.rawSize)
+		{
+#ifdef HODOSIM_WITH_ZLIB
+			uLongf rawSize = batch.rawSize;
+			if (uncompress(reinterpret_cast<Bytef*>(raw.data()), &rawSize, reinterpret_cast<const Bytef*>(stored.data()), batch.storedSize) != Z_OK
+				|| rawSize != batch.rawSize)
+			{
+				logMessage("Error: corrupted batch after " + std::to_string(nEvents) + " events.");
+				return 1;
+			}
+#else
+			logMessage("Error: compressed batch after " + std::to_string(nEvents) + " events, EventStream was built without zlib.");
+			return 1;
+#endif
+		}
+		else
+		{
+			raw.swap(stored);
+		}
+
+		for (std::uint32_t r = 0; r < batch.nRecords; r++)
+		{
+			const char* record = raw.data() + (size_t)r * header.recordSize;
+			std::memcpy(&truth, record, sizeof(truth));
+
+			const char* counts = record + sizeof(truth);
+			for (std::uint32_t i = 0; i < header.nSiPMs; i++)
+			{
+				std::uint16_t scint, cer;
+				std::memcpy(&scint, counts + i * sizeof(std::uint16_t), sizeof(scint));
+				std::memcpy(&cer, counts + (header.nSiPMs + i) * sizeof(std::uint16_t), sizeof(cer));
+				scintOPs[i] = scint;
+				cerOPs[i] = cer;
+			}
+			tree.Fill();
+			nEvents++;
+		}
+	}
+
+	if (nEvents != header.nEvents)
+	{
+		logMessage("Warning: the header reports " + std::to_string(header.nEvents) + " events, " + std::to_string(nEvents) + " were read.");
+	}
+
+	tree.Write();
+	file.Close();
+
+	logMessage("Written " + output + " (" + std::to_string(nEvents) + " events, " + std::to_string(header.nSiPMs) + " SiPMs)");
+	return 0;
+}
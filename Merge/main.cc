@@ -0,0 +1,193 @@
+#include <TFileMerger.h>
+#include <TROOT.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+// Merging of HodoSim outputs: the per-thread files of a run (output.per_thread_files in config.yaml),
+// the chunks of a rolling run (output.rolling) or the outputs of separate processes and nodes.
+// The histograms are summed and the ntuples concatenated (TTree and RNTuple, not mixed in the same set of inputs).
+// The inputs are split into one group per job, every job merges its group into a partial file on its own thread,
+// then the partial files are merged into the output (the same two levels of hadd -j, without the worker processes).
+//
+// Usage:
+//   Merge [-j N] <output.root> <input> [input ...]
+// An input is a ROOT file, a directory (all the .root files in it) or a rolling output manifest (the .root files it lists).
+// N defaults to the number of hardware threads.
+
+
+#pragma region Utils
+
+void logMessage(const std::string& msg, bool skip = false) {
+
+	auto prefix = skip ? "" : "[Merge] ";
+	std::cout << prefix << msg << std::endl;
+}
+
+// ROOT files listed in a <stem>_manifest.txt (tab separated: chunk, first event, events, bytes, file), relative to it
+std::vector<std::string> readManifest(const std::filesystem::path& manifest)
+{
+	std::vector<std::string> files;
+	std::ifstream in(manifest);
+	std::string line;
+	while (std::getline(in, line))
+	{
+		if (line.empty() || line[0] == '#') continue;
+
+		std::istringstream fields(line);
+		std::string chunk, firstEvent, events, bytes, file;
+		if (!std::getline(fields, chunk, '\t') || !std::getline(fields, firstEvent, '\t') || !std::getline(fields, events, '\t')
+			|| !std::getline(fields, bytes, '\t') || !std::getline(fields, file)) continue;
+
+		if (std::filesystem::path(file).extension() == ".root") files.push_back((manifest.parent_path() / file).string());
+	}
+	return files;
+}
+
+std::vector<std::string> expandInput(const std::string& input)
+{
+	const std::filesystem::path path(input);
+	std::vector<std::string> files;
+
+	if (std::filesystem::is_directory(path))
+	{
+		for (const auto& entry : std::filesystem::directory_iterator(path))
+		{
+			if (entry.path().extension() == ".root") files.push_back(entry.path().string());
+		}
+		std::sort(files.begin(), files.end());
+	}
+	else if (path.extension() == ".txt")
+	{
+		files = readManifest(path);
+	}
+	else
+	{
+		files.push_back(input);
+	}
+	return files;
+}
+
+// Fast method: the baskets are copied as they are, without decompressing and compressing them again
+bool mergeFiles(const std::vector<std::string>& inputs, const std::string& output)
+{
+	TFileMerger merger(false, false);
+	merger.SetFastMethod(true);
+	merger.SetNotrees(false);
+	if (!merger.OutputFile(output.c_str(), "RECREATE")) return false;
+
+	for (const auto& input : inputs)
+	{
+		if (!merger.AddFile(input.c_str(), false)) return false;
+	}
+	return merger.Merge();
+}
+
+#pragma endregion Utils
+
+
+int main(int argc, char** argv)
+{
+	int jobs = (int)std::max(1u, std::thread::hardware_concurrency());
+	std::vector<std::string> args;
+	for (int i = 1; i < argc; i++)
+	{
+		const std::string arg = argv[i];
+		if (arg == "-j" && i + 1 < argc) jobs = std::max(1, std::atoi(argv[++i]));
+		else args.push_back(arg);
+	}
+
+	if (args.size() < 2)
+	{
+		logMessage("Usage: Merge [-j N] <output.root> <input> [input ...]");
+		return 1;
+	}
+
+	const std::string output = args[0];
+	std::vector<std::string> inputs;
+	for (size_t i = 1; i < args.size(); i++)
+	{
+		const auto files = expandInput(args[i]);
+		inputs.insert(inputs.end(), files.begin(), files.end());
+	}
+
+	// The output could be found again in a directory given as input
+	const auto outputPath = std::filesystem::absolute(output);
+	inputs.erase(std::remove_if(inputs.begin(), inputs.end(), [&](const std::string& input) {
+		return std::filesystem::absolute(input) == outputPath;
+	}), inputs.end());
+
+	for (const auto& input : inputs)
+	{
+		if (!std::filesystem::exists(input))
+		{
+			logMessage("Error: input file '" + input + "' does not exist.");
+			return 1;
+		}
+	}
+	if (inputs.empty())
+	{
+		logMessage("Error: no input files.");
+		return 1;
+	}
+
+	// Every job needs at least two files to have something to merge
+	jobs = std::min(jobs, (int)inputs.size() / 2);
+	logMessage("Merging " + std::to_string(inputs.size()) + " files into " + output + " (" + std::to_string(std::max(jobs, 1)) + " jobs)");
+
+	if (jobs <= 1)
+	{
+		if (!mergeFiles(inputs, output))
+		{
+			logMessage("Error: the merge failed.");
+			return 1;
+		}
+		logMessage("Written " + output);
+		return 0;
+	}
+
+	ROOT::EnableThreadSafety();
+
+	// Contiguous groups, so the partial files (and the output) keep the order of the inputs
+	std::vector<std::string> partials(jobs);
+	std::vector<std::thread> threads;
+	std::atomic<bool> failed{ false };
+	for (int j = 0; j < jobs; j++)
+	{
+		const size_t begin = inputs.size() * j / jobs;
+		const size_t end = inputs.size() * (j + 1) / jobs;
+		partials[j] = (outputPath.parent_path() / (outputPath.stem().string() + "_partial" + std::to_string(j) + ".root")).string();
+
+		threads.emplace_back([&, begin, end, j]() {
+			const std::vector<std::string> group(inputs.begin() + begin, inputs.begin() + end);
+			if (!mergeFiles(group, partials[j])) failed = true;
+		});
+	}
+	for (auto& thread : threads) thread.join();
+
+	const bool merged = !failed && mergeFiles(partials, output);
+
+	for (const auto& partial : partials)
+	{
+		std::error_code ec;
+		std::filesystem::remove(partial, ec);
+	}
+
+	if (!merged)
+	{
+		logMessage("Error: the merge failed.");
+		return 1;
+	}
+
+	logMessage("Written " + output);
+	return 0;
+}
@@ -8,13 +8,29 @@
 #include <TPaveText.h>
 #include <TMarker.h>
 #include <TBox.h>
+#include <TFile.h>
+#include <TKey.h>
 
 #include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
 #include <string>
 #include <filesystem>
 #include <iostream>
 #include <onnxruntime_cxx_api.h>
 
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 
 #pragma region Utils
 
@@ -112,19 +128,176 @@ void PlotGraph(TCanvas* c1, TGraph* g1, TGraph* g2, std::string title, std::stri
 
 }
 
+// The per-event data is either a TTree (the G4 ntuple) or an RNTuple (output.backend: rntuple in the HodoSim config),
+// RDataFrame reads both through the same constructor. With the RNTuple backend the G4 file only holds the histograms.
+enum class EventDataFormat { None, TTree, RNTuple };
+
+EventDataFormat DetectFormat(const std::string& filename)
+{
+    std::unique_ptr<TFile> file(TFile::Open(filename.c_str(), "READ"));
+    if (!file || file->IsZombie()) return EventDataFormat::None;
+
+    auto* key = file->GetKey("PerEventCollectedData");
+    if (!key) return EventDataFormat::None;
+
+    const std::string className = key->GetClassName();
+    if (className == "TTree") return EventDataFormat::TTree;
+    if (className == "ROOT::RNTuple" || className == "ROOT::Experimental::RNTuple") return EventDataFormat::RNTuple;
+    return EventDataFormat::None;
+}
+
+// Sparse per-SiPM columns (output.sparse in the HodoSim config): <Group>Channels lists the SiPMs with a hit and
+// <Quantity>Values their values, or Channels is empty and Values holds every SiPM (dense event).
+// The SiPMs not listed get the default value (0 photons, -1 ns for the SiPMTime and SiPMFirstPhotonTime).
+template <typename T>
+ROOT::RVecF DecodeSparse(const ROOT::RVecI& channels, const ROOT::RVec<T>& values, const size_t nsipm, const float fill = 0.f)
+{
+    ROOT::RVecF dense(nsipm, fill);
+    if (channels.empty())
+    {
+        for (size_t i = 0; i < values.size() && i < nsipm; i++) dense[i] = values[i];
+        return dense;
+    }
+    for (size_t k = 0; k < channels.size() && k < values.size(); k++)
+    {
+        if (channels[k] >= 0 && (size_t)channels[k] < nsipm) dense[channels[k]] = values[k];
+    }
+    return dense;
+}
+
+// Dense float features of a per-SiPM group, whatever its storage (dense vector or sparse channels + values).
+// The counts are integers, floats in the weighted yield mode (sums of the weights).
+ROOT::RDF::RNode DefineDenseFeatures(ROOT::RDF::RNode df, const std::string& name, const std::string& group, const size_t nsipm)
+{
+    const std::string channels = group + "Channels";
+    const std::string values = group + "Values";
+
+    if (!df.HasColumn(channels))
+    {
+        return df.Define(name, "ROOT::VecOps::RVec<float>(" + group + ".begin(), " + group + ".end())");
+    }
+    if (df.GetColumnType(values).find("float") != std::string::npos)
+    {
+        return df.Define(name, [nsipm](const ROOT::RVecI& c, const ROOT::RVecF& v) { return DecodeSparse(c, v, nsipm); }, { channels, values });
+    }
+    return df.Define(name, [nsipm](const ROOT::RVecI& c, const ROOT::RVecI& v) { return DecodeSparse(c, v, nsipm); }, { channels, values });
+}
+
 #pragma endregion Utils
 
 
+#pragma region Tensor Shards
+
+// Read-only memory mapping of a whole file, the pages are loaded by the OS on first access
+class MappedFile
+{
+public:
+    explicit MappedFile(const std::string& filename)
+    {
+#ifdef _WIN32
+        file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) return;
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) return;
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping) return;
+        data = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        if (data) size = (size_t)fileSize.QuadPart;
+#else
+        fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) return;
+        void* address = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (address == MAP_FAILED) return;
+        data = static_cast<const char*>(address);
+        size = (size_t)st.st_size;
+#endif
+    }
+
+    ~MappedFile()
+    {
+#ifdef _WIN32
+        if (data) UnmapViewOfFile(data);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+        if (data) munmap(const_cast<char*>(data), size);
+        if (fd >= 0) close(fd);
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data = nullptr;
+    size_t size = 0;
+
+private:
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#else
+    int fd = -1;
+#endif
+};
+
+// 2D float32 array of a mapped .npy file (the shards written by HodoSim with output.tensor_shards enabled).
+// Only what HodoSim writes is accepted: little-endian float32, C order, two dimensions.
+struct NpyMatrix
+{
+    const float* data = nullptr;
+    size_t rows = 0;
+    size_t cols = 0;
+};
+
+bool ParseNpy(const MappedFile& file, NpyMatrix& matrix)
+{
+    if (!file.data || file.size < 10 || std::memcmp(file.data, "\x93NUMPY", 6) != 0) return false;
+
+    const unsigned char major = (unsigned char)file.data[6];
+    size_t headerLength = 0, offset = 0;
+    if (major == 1)
+    {
+        headerLength = (unsigned char)file.data[8] | ((size_t)(unsigned char)file.data[9] << 8);
+        offset = 10;
+    }
+    else
+    {
+        if (file.size < 12) return false;
+        for (int i = 0; i < 4; i++) headerLength |= (size_t)(unsigned char)file.data[8 + i] << (8 * i);
+        offset = 12;
+    }
+    if (offset + headerLength > file.size) return false;
+
+    const std::string header(file.data + offset, headerLength);
+    if (header.find("'descr': '<f4'") == std::string::npos) return false;
+    if (header.find("'fortran_order': False") == std::string::npos) return false;
+
+    unsigned long long rows = 0, cols = 0;
+    const size_t shape = header.find("'shape': (");
+    if (shape == std::string::npos || std::sscanf(header.c_str() + shape, "'shape': (%llu, %llu)", &rows, &cols) != 2) return false;
+
+    matrix.data = reinterpret_cast<const float*>(file.data + offset + headerLength);
+    matrix.rows = (size_t)rows;
+    matrix.cols = (size_t)cols;
+    return offset + headerLength + matrix.rows * matrix.cols * sizeof(float) <= file.size;
+}
+
+#pragma endregion Tensor Shards
+
+
 // This function performs predictions using ONNX Runtime to load a small NN that i created and trained outside of this project.
 // # On the model
 // The NN model is trained to work with 64 SiPMs and is very lightweight (approx 30k parameters).
 // It can predict x,y positions from the SiPM light collection features and it was trained assuming a single particle hit per event.
 // The model is stored in the file "model.onnx" inside the working directory (this app wont run without it, you have to manually put it there).
 
-void Predict(const char* output_path, std::vector<std::vector<float>> X, const size_t N, const size_t F, const size_t B)
+void Predict(const char* output_path, const float* X, const size_t N, const size_t F, const size_t B)
 {
 	// This function performs predictions using ONNX Runtime,
-	// given the input features X (size F x N), where F is the number of features (64 SiPMs) and N is the number of samples (events).
+	// given the input features X (row-major, N x F), where F is the number of features (64 SiPMs) and N is the number of samples (events).
+	// The features must already be preprocessed like in the training (np.log1p of the counts).
 	// The predictions are done in batches of size B to optimize memory usage and performance.
 	// The predicted x and y positions are saved in a ROOT file specified by output_path (so that they can be used for analysis).
 
@@ -146,23 +319,14 @@ void Predict(const char* output_path, std::vector<std::vector<float>> X, const s
     tout.Branch("x_pred", &x_pred);
     tout.Branch("y_pred", &y_pred);
 
-    std::vector<float> batch(B * F);
-    std::vector<float> outbuf(B * 2);
-
     for (size_t i = 0; i < N; i += B)
     {
         const size_t bsize = std::min(B, N - i);
 
-        for (size_t j = 0; j < bsize; j++)
-        {
-            for (size_t f = 0; f < F; f++)
-            {
-                // Remember that i took np.log1p(X) in python!!!
-                batch[j * F + f] = log(1 + X[f][i + j]);
-            }
-        }
+        // The batch is a view over the rows i..i+bsize of X (a mapped shard or the buffer of the caller), no copy.
+        // ONNX Runtime doesn't write its inputs, the const_cast is only needed by the CreateTensor signature.
         std::array<int64_t, 2> ishape{ (int64_t)bsize, (int64_t)F };
-        Ort::Value in = Ort::Value::CreateTensor<float>(mem, batch.data(), bsize * F, ishape.data(), 2);
+        Ort::Value in = Ort::Value::CreateTensor<float>(mem, const_cast<float*>(X + i * F), bsize * F, ishape.data(), 2);
         auto out = sess.Run({}, &IN, &in, 1, &OUT, 1);
         float* p = out.front().GetTensorMutableData<float>(); // shape: [n,2]
 
@@ -184,7 +348,8 @@ void Predict(const char* output_path, std::vector<std::vector<float>> X, const s
 //
 // To use it, just compile and run it in a directory where you have:
 // - a file named "model.onnx" containing the NN model for predictions
-// - a directory named "inputs" containing the input ROOT files with the data to process
+// - a directory named "inputs" containing the input ROOT files with the data to process,
+//   and/or the .npy shards of HodoSim (<name>_X.npy with the matching <name>_Y.npy, searched in the subdirectories too)
 // The app will create two directories if they don't exist:
 // - "plots": where the output plots will be saved
 // - "predictions": where the prediction ROOT files will be saved
@@ -260,39 +425,47 @@ int main(int argc, char** argv)
 
 		logMessage("Processing file: " + filename);
 
+        const EventDataFormat format = DetectFormat(filename);
+        if (format == EventDataFormat::None)
+        {
+            logMessage("No per-event data in " + filename + ", skipping it.");
+            logMessage("-------------------------------------------------", true);
+            continue;
+        }
+        logMessage(std::string("Per-event data format: ") + (format == EventDataFormat::RNTuple ? "RNTuple" : "TTree"));
+
 		std::string prediction_filename = "/pred_" + std::filesystem::path(filename).filename().string();
 
         ROOT::RDataFrame df("PerEventCollectedData", filename);
     
         #pragma region Predictions Using ONNX Runtime & NN Model
     
-        std::vector<std::string> cols(nsipm);
-        for (int i = 0; i < nsipm; i++)
-        {
-            cols[i] = "ScintOPsCollected" + std::to_string(i);
-        }
+        // The counts are one vector column per species, dense or sparse, read as float vectors:
+        // the features of SiPM i are the i-th element of every event.
+        auto counts = DefineDenseFeatures(df, "ScintFeatures", "ScintOPs", nsipm)
+            .Take<ROOT::RVecF>("ScintFeatures");
 
-        // Materialize features as float
-        std::vector<std::vector<float>> X(64);
-        for (int i = 0; i < nsipm; i++)
-        {
-            auto v = df.Take<double>(cols[i]);
-            X[i].assign(v->begin(), v->end());
-        }
-    
-        const size_t N = X[0].size();
+        const size_t N = counts->size();
         const size_t F = nsipm;
         const size_t B = N;
+
+        // Row-major features, remember that i took np.log1p(X) in python!!!
+        std::vector<float> X(N * F);
+        for (size_t j = 0; j < N; j++)
+        {
+            const auto& event = (*counts)[j];
+            for (size_t f = 0; f < F; f++) X[j * F + f] = std::log1p(f < event.size() ? event[f] : 0.f);
+        }
     
-	    Predict((pred_dir + prediction_filename).c_str(), X, N, F, B);
+	    Predict((pred_dir + prediction_filename).c_str(), X.data(), N, F, B);
 
         #pragma endregion Predictions Using ONNX Runtime & NN Model
 	
         ROOT::RDataFrame pdf("Prediction", (pred_dir + prediction_filename).c_str());
 
 
-	    auto muPosX = df.Take<double>("MuonHitX");
-	    auto muPosY = df.Take<double>("MuonHitY");
+	    auto muPosX = df.Take<float>("MuonHitX");
+	    auto muPosY = df.Take<float>("MuonHitY");
 
 	    auto predX = pdf.Take<float>("x_pred");
 	    auto predY = pdf.Take<float>("y_pred");
@@ -322,5 +495,68 @@ int main(int argc, char** argv)
         logMessage("-------------------------------------------------", true);
     }
 
+    // The shards are already preprocessed and row-major, they are mapped and fed to the model as they are
+    std::vector<std::string> shardnames;
+    for (const auto& entry : std::filesystem::recursive_directory_iterator(indir)) {
+        const std::string name = entry.path().filename().string();
+        if (name.size() > 6 && name.compare(name.size() - 6, 6, "_X.npy") == 0) {
+            shardnames.push_back(entry.path().string());
+            logMessage("Input shard found at " + entry.path().string());
+        }
+    }
+
+    for (const auto& xname : shardnames)
+    {
+        logMessage("Processing shard: " + xname);
+
+        const std::string yname = xname.substr(0, xname.size() - 6) + "_Y.npy";
+        MappedFile xfile(xname), yfile(yname);
+        NpyMatrix X, Y;
+        if (!ParseNpy(xfile, X) || !ParseNpy(yfile, Y) || X.rows != Y.rows || X.cols != (size_t)nsipm || Y.cols != 2)
+        {
+            logMessage("Invalid shard " + xname + " (or missing/mismatched " + yname + "), skipping it.");
+            logMessage("-------------------------------------------------", true);
+            continue;
+        }
+        if (X.rows == 0)
+        {
+            logMessage("Empty shard, skipping it.");
+            logMessage("-------------------------------------------------", true);
+            continue;
+        }
+
+        const std::string stem = std::filesystem::path(xname).stem().string();
+        const std::string prediction_path = pred_dir + "/pred_" + stem.substr(0, stem.size() - 2) + ".root";
+
+        Predict(prediction_path.c_str(), X.data, X.rows, X.cols, X.rows);
+
+        ROOT::RDataFrame pdf("Prediction", prediction_path.c_str());
+        auto predX = pdf.Take<float>("x_pred");
+        auto predY = pdf.Take<float>("y_pred");
+
+        logMessage("Predicted " + std::to_string(predX->size()) + " points");
+
+        // The truth is interleaved (MuonHitX, MuonHitY), the graph wants two arrays
+        std::vector<double> muPosX(Y.rows), muPosY(Y.rows);
+        for (size_t j = 0; j < Y.rows; j++)
+        {
+            muPosX[j] = Y.data[j * 2 + 0];
+            muPosY[j] = Y.data[j * 2 + 1];
+        }
+
+        TGraph* g1 = new TGraph(Y.rows, muPosX.data(), muPosY.data());
+        TGraph* g2 = new TGraph(predX->size(), predX->data(), predY->data());
+
+        PlotGraph(
+            c1,
+            g1, g2,
+            "Beam Reconstruction",
+            outdir,
+            stem.substr(0, stem.size() - 2)
+        );
+
+        logMessage("-------------------------------------------------", true);
+    }
+
     return 0;
 }
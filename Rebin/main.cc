@@ -0,0 +1,163 @@
+#include <ROOT/RDataFrame.hxx>
+#include <ROOT/RVec.hxx>
+
+#include <cmath>
+#include <filesystem>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+// Rebinning of the strip mode output (sipm.strip_mode in config.yaml) to any number of SiPMs per side.
+// In strip mode HodoSim stores the edge (ScintEdgeID/CerEdgeID) and the position along the edge as a fraction of its length
+// (ScintEdgePos/CerEdgePos) of every detected photon, so the per-SiPM counts of any segmentation can be derived here
+// without running the simulation again. The output has the same ScintOPs/CerOPs per-SiPM vector columns
+// (and event truth) of a regular run with that number of SiPMs per side, so PlotPredict and the other tools work unchanged.
+// A weighted yield run also stores the weight of every scintillation photon (ScintEdgeWeight): its ScintOPs are sums of weights,
+// like the ScintOPs of the run.
+//
+// Usage:
+//   Rebin <input.root> <n1,n2,...> [output_dir]
+// One file <input>_N<n>.root is written for each number of SiPMs per side.
+
+
+using ROOT::RVecF;
+using ROOT::RVecI;
+
+
+#pragma region Utils
+
+void logMessage(const std::string& msg, bool skip = false) {
+
+	auto prefix = skip ? "" : "[Rebin] ";
+	std::cout << prefix << msg << std::endl;
+}
+
+std::vector<int> parseList(const std::string& arg)
+{
+	std::vector<int> values;
+	std::stringstream ss(arg);
+	std::string item;
+	while (std::getline(ss, item, ','))
+	{
+		if (!item.empty()) values.push_back(std::stoi(item));
+	}
+	return values;
+}
+
+// Counts per virtual SiPM, numbered like the rows placed in DetectorConstruction::BuildGeometry
+RVecI CountPerSiPM(const RVecI& edge, const RVecF& position, int sipmsPerSide)
+{
+	RVecI counts(4 * sipmsPerSide, 0);
+	const auto index = edge * sipmsPerSide + ROOT::VecOps::Map(position, [sipmsPerSide](double u) {
+		return std::min((int)(u * sipmsPerSide), sipmsPerSide - 1);
+	});
+	for (auto i : index)
+	{
+		if (i >= 0 && i < (int)counts.size()) counts[i] += 1;
+	}
+	return counts;
+}
+
+// Sums of the photon weights per virtual SiPM (weighted yield mode)
+RVecF SumPerSiPM(const RVecI& edge, const RVecF& position, const RVecF& weight, int sipmsPerSide)
+{
+	RVecF sums(4 * sipmsPerSide, 0.f);
+	for (size_t p = 0; p < edge.size() && p < position.size() && p < weight.size(); p++)
+	{
+		const int i = edge[p] * sipmsPerSide + std::min((int)(position[p] * sipmsPerSide), sipmsPerSide - 1);
+		if (i >= 0 && i < (int)sums.size()) sums[i] += weight[p];
+	}
+	return sums;
+}
+
+#pragma endregion Utils
+
+
+int main(int argc, char** argv)
+{
+	if (argc < 3)
+	{
+		logMessage("Usage: Rebin <input.root> <n1,n2,...> [output_dir]");
+		return 1;
+	}
+
+	const std::string input = argv[1];
+	const std::vector<int> segmentations = parseList(argv[2]);
+	const std::string outdir = (argc > 3) ? argv[3] : ".";
+
+	if (!std::filesystem::exists(input))
+	{
+		logMessage("Error: input file '" + input + "' does not exist.");
+		return 1;
+	}
+	std::filesystem::create_directories(outdir);
+
+	ROOT::EnableImplicitMT();
+
+	ROOT::RDataFrame df("PerEventCollectedData", input);
+
+	if (!df.HasColumn("ScintEdgeID"))
+	{
+		logMessage("Error: '" + input + "' was not produced in strip mode (no ScintEdgeID column).");
+		return 1;
+	}
+
+	// Weighted yield run: the ScintOPs are sums of the photon weights
+	const bool weighted = df.HasColumn("ScintEdgeWeight");
+	if (weighted) logMessage("Weighted yield output, the ScintOPs are sums of the photon weights (ScintEdgeWeight).");
+	else if (df.HasColumn("ScintEffectiveSampleSize"))
+	{
+		logMessage("Warning: weighted yield output without ScintEdgeWeight (older HodoSim), the ScintOPs count the photons without their weights.");
+	}
+
+	// Event truth copied as is (the muon exit columns are missing in older outputs)
+	std::vector<std::string> truthColumns = { "EventID", "ScintTotalEdep", "CoatingTotalEdep", "MuPathLength", "MuonHitX", "MuonHitY" };
+	for (const std::string column : { "MuonExitX", "MuonExitY", "MuonExitZ", "MuonExitDirX", "MuonExitDirY", "MuonExitDirZ", "MuonExitEnergy" })
+	{
+		if (df.HasColumn(column)) truthColumns.push_back(column);
+	}
+
+	for (int sipmsPerSide : segmentations)
+	{
+		if (sipmsPerSide <= 0)
+		{
+			logMessage("Warning: skipping invalid number of SiPMs per side " + std::to_string(sipmsPerSide));
+			continue;
+		}
+
+		auto count = [sipmsPerSide](const RVecI& edge, const RVecF& position) { return CountPerSiPM(edge, position, sipmsPerSide); };
+		auto sum = [sipmsPerSide](const RVecI& edge, const RVecF& position, const RVecF& weight) { return SumPerSiPM(edge, position, weight, sipmsPerSide); };
+
+		// The counts of the segmentation used in the run are replaced (photons per SiPM, or sums of their weights),
+		// a run with the sparse columns (output.sparse) has no dense counts to replace and gets them defined
+		ROOT::RDF::RNode node = df;
+		const bool redefine = df.HasColumn("ScintOPs");
+		if (weighted)
+		{
+			node = redefine ? node.Redefine("ScintOPs", sum, { "ScintEdgeID", "ScintEdgePos", "ScintEdgeWeight" })
+				: node.Define("ScintOPs", sum, { "ScintEdgeID", "ScintEdgePos", "ScintEdgeWeight" });
+		}
+		else
+		{
+			node = redefine ? node.Redefine("ScintOPs", count, { "ScintEdgeID", "ScintEdgePos" })
+				: node.Define("ScintOPs", count, { "ScintEdgeID", "ScintEdgePos" });
+		}
+		node = redefine ? node.Redefine("CerOPs", count, { "CerEdgeID", "CerEdgePos" })
+			: node.Define("CerOPs", count, { "CerEdgeID", "CerEdgePos" });
+
+		std::vector<std::string> columns = truthColumns;
+		columns.push_back("ScintOPs");
+		columns.push_back("CerOPs");
+
+		const std::string output = (std::filesystem::path(outdir)
+			/ (std::filesystem::path(input).stem().string() + "_N" + std::to_string(sipmsPerSide) + ".root")).string();
+
+		node.Snapshot("PerEventCollectedData", output, columns);
+
+		logMessage("Written " + output + " (" + std::to_string(sipmsPerSide) + " SiPMs per side)");
+	}
+
+	return 0;
+}
@@ -0,0 +1,253 @@
+#include "PhotonRecordFormat.hh"
+
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+
+// Post-hoc optical reweighting of the detected photon records written by HodoSim (optics.photon_records).
+//
+// A detected photon has been reflected n times by the coating and has travelled a path L in the scintillator,
+// so its detection probability scales as R^n * exp(-L / lambda). Changing the coating reflectivity R -> R'
+// or the absorption length lambda -> lambda' is therefore a per-photon weight
+//     (R' / R)^n * exp(-L * (1 / lambda' - 1 / lambda))
+// while a different yield factor Y -> Y' is a binomial thinning of the scintillation photons,
+// i.e. a weight Y' / Y on the expected counts (Cerenkov photons are not affected).
+// Only the detected photons are needed, no Geant4 run is required for each configuration.
+//
+// Approximations: R and lambda are taken as constant over the emission spectrum (as they are in DetectorConstruction),
+// the weights are only exact for reflectivities/yields not larger than the reference ones (the photons lost in the
+// reference run can't be recovered, larger values extrapolate the expected counts linearly).
+//
+// Usage:
+//   Reweight <records.bin> [--reflectivity r1,r2,...] [--abs-length l1,l2,... (mm)] [--yield-factor y1,y2,...] [--output scan.csv]
+// Every combination of the values is evaluated, a missing option keeps the reference value of the run.
+
+
+#pragma region Utils
+
+void logMessage(const std::string& msg, bool skip = false) {
+
+	auto prefix = skip ? "" : "[Reweight] ";
+	std::cout << prefix << msg << std::endl;
+}
+
+std::vector<double> parseList(const std::string& arg)
+{
+	std::vector<double> values;
+	std::stringstream ss(arg);
+	std::string item;
+	while (std::getline(ss, item, ','))
+	{
+		if (!item.empty()) values.push_back(std::stod(item));
+	}
+	return values;
+}
+
+#pragma endregion Utils
+
+
+struct Configuration {
+	double reflectivity;
+	double absLength;		// mm
+	double yieldFactor;
+
+	// Precomputed per-photon factors
+	double reflectivityRatio;
+	double deltaInverseAbsLength;
+	double yieldRatio;
+};
+
+int main(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		logMessage("Usage: Reweight <records.bin> [--reflectivity r1,r2,...] [--abs-length l1,l2,...] [--yield-factor y1,y2,...] [--output scan.csv]");
+		return 1;
+	}
+
+	const std::string input = argv[1];
+	std::string output = "reweight.csv";
+	std::vector<double> reflectivities, absLengths, yieldFactors;
+
+	for (int i = 2; i + 1 < argc; i += 2)
+	{
+		const std::string option = argv[i];
+		const std::string value = argv[i + 1];
+
+		if (option == "--reflectivity") reflectivities = parseList(value);
+		else if (option == "--abs-length") absLengths = parseList(value);
+		else if (option == "--yield-factor") yieldFactors = parseList(value);
+		else if (option == "--output") output = value;
+		else
+		{
+			logMessage("Error: unknown option '" + option + "'.");
+			return 1;
+		}
+	}
+
+	#pragma region Header
+
+	std::ifstream in(input, std::ios::binary);
+	if (!in)
+	{
+		logMessage("Error: could not open '" + input + "'.");
+		return 1;
+	}
+
+	PhotonRecordHeader header{};
+	in.read(reinterpret_cast<char*>(&header), sizeof(header));
+	if (!in || std::strncmp(header.magic, "HODOPHR", 8) != 0 || header.version != kPhotonRecordVersion)
+	{
+		logMessage("Error: '" + input + "' is not a valid photon record file.");
+		return 1;
+	}
+	if (header.nEvents == 0 || header.coatingReflectivity <= 0 || header.absLength <= 0 || header.yieldFactor <= 0)
+	{
+		logMessage("Error: the reference run has no events or incomplete reference optics.");
+		return 1;
+	}
+
+	const int nSiPMs = (int)header.nSiPMs;
+
+	logMessage("Reference run: " + std::to_string(header.nEvents) + " events, " + std::to_string(nSiPMs) + " SiPMs, "
+		+ "R = " + std::to_string(header.coatingReflectivity) + ", abs length = " + std::to_string(header.absLength) + " mm, "
+		+ "yield factor = " + std::to_string(header.yieldFactor));
+
+	#pragma endregion Header
+
+
+	#pragma region Configurations
+
+	if (reflectivities.empty()) reflectivities.push_back(header.coatingReflectivity);
+	if (absLengths.empty()) absLengths.push_back(header.absLength);
+	if (yieldFactors.empty()) yieldFactors.push_back(header.yieldFactor);
+
+	std::vector<Configuration> configurations;
+	for (double r : reflectivities)
+	{
+		for (double l : absLengths)
+		{
+			for (double y : yieldFactors)
+			{
+				if (r < 0 || l <= 0 || y < 0)
+				{
+					logMessage("Error: reflectivity and yield factor must be >= 0, abs length > 0.");
+					return 1;
+				}
+				// (the reference values are stored as float)
+				if (r > header.coatingReflectivity * (1 + 1e-6) || y > header.yieldFactor * (1 + 1e-6))
+				{
+					logMessage("Warning: R = " + std::to_string(r) + ", yield factor = " + std::to_string(y)
+						+ " exceed the reference values, the expected counts are extrapolated.");
+				}
+				configurations.push_back({
+					r, l, y,
+					r / header.coatingReflectivity,
+					1. / l - 1. / header.absLength,
+					y / header.yieldFactor
+				});
+			}
+		}
+	}
+
+	const size_t nConfigurations = configurations.size();
+	logMessage(std::to_string(nConfigurations) + " configurations to evaluate");
+
+	#pragma endregion Configurations
+
+
+	#pragma region Reweighting
+
+	// Weighted sums per configuration and SiPM
+	std::vector<double> scintSum(nConfigurations * nSiPMs, 0.);
+	std::vector<double> scintSumW2(nConfigurations * nSiPMs, 0.);
+	std::vector<double> cerSum(nConfigurations * nSiPMs, 0.);
+
+	std::vector<DetectedPhotonRecord> chunk(1 << 16);
+	size_t nPhotons = 0;
+
+	while (in)
+	{
+		in.read(reinterpret_cast<char*>(chunk.data()), chunk.size() * sizeof(DetectedPhotonRecord));
+		const size_t nRead = (size_t)in.gcount() / sizeof(DetectedPhotonRecord);
+
+		for (size_t k = 0; k < nRead; k++)
+		{
+			const auto& photon = chunk[k];
+			if (photon.siPMID >= nSiPMs) continue;
+
+			for (size_t c = 0; c < nConfigurations; c++)
+			{
+				const auto& config = configurations[c];
+				const double w = photon.weight
+					* std::pow(config.reflectivityRatio, photon.nReflectionsAtCoating)
+					* std::exp(-photon.pathLength * config.deltaInverseAbsLength);
+
+				const size_t index = c * nSiPMs + photon.siPMID;
+				if (photon.isCerenkov)
+				{
+					cerSum[index] += w;
+				}
+				else
+				{
+					const double ws = w * config.yieldRatio;
+					scintSum[index] += ws;
+					scintSumW2[index] += ws * ws;
+				}
+			}
+		}
+		nPhotons += nRead;
+	}
+
+	logMessage("Reweighted " + std::to_string(nPhotons) + " detected photons");
+
+	#pragma endregion Reweighting
+
+
+	#pragma region Output
+
+	// One row per configuration: expected counts per event and SiPM (and the statistical error on the total)
+	std::ofstream out(output);
+	if (!out)
+	{
+		logMessage("Error: could not open '" + output + "'.");
+		return 1;
+	}
+
+	out << "Reflectivity,AbsLength,YieldFactor";
+	for (int i = 0; i < nSiPMs; i++) out << ",ScintOPsExpected" << i;
+	for (int i = 0; i < nSiPMs; i++) out << ",CerOPsExpected" << i;
+	out << ",ScintTotalExpected,ScintTotalError\n";
+
+	const double nEvents = (double)header.nEvents;
+
+	for (size_t c = 0; c < nConfigurations; c++)
+	{
+		const auto& config = configurations[c];
+		out << config.reflectivity << "," << config.absLength << "," << config.yieldFactor;
+
+		double total = 0., totalW2 = 0.;
+		for (int i = 0; i < nSiPMs; i++)
+		{
+			out << "," << scintSum[c * nSiPMs + i] / nEvents;
+			total += scintSum[c * nSiPMs + i];
+			totalW2 += scintSumW2[c * nSiPMs + i];
+		}
+		for (int i = 0; i < nSiPMs; i++)
+		{
+			out << "," << cerSum[c * nSiPMs + i] / nEvents;
+		}
+		out << "," << total / nEvents << "," << std::sqrt(totalW2) / nEvents << "\n";
+	}
+
+	logMessage("Expected counts written to " + output);
+
+	#pragma endregion Output
+
+	return 0;
+}
@@ -6,6 +6,7 @@
 #include "EventAction.hh"
 #include "TrackingAction.hh"
 #include "SteppingAction.hh"
+#include "StackingAction.hh"
 
 
 // I defined the following structs in the relative header file to make it easier to pass parameters 
@@ -15,6 +16,7 @@
 // struct EventActionParameters
 // struct TrackingActionParameters
 // struct SteppingActionParameters
+// struct StackingActionParameters
 
 
 class ActionInitialization : public G4VUserActionInitialization 
@@ -26,7 +28,8 @@ public:
         RunActionParameters runActionParameters,
         EventActionParameters eventActionParameters,
         TrackingActionParameters trackingActionParameters,
-        SteppingActionParameters steppingActionParameters
+        SteppingActionParameters steppingActionParameters,
+        StackingActionParameters stackingActionParameters
     );
     
     ~ActionInitialization();
@@ -41,5 +44,6 @@ private:
     EventActionParameters _eventActionParameters;
 	TrackingActionParameters _trackingActionParameters;
 	SteppingActionParameters _steppingActionParameters;
+	StackingActionParameters _stackingActionParameters;
 
 };
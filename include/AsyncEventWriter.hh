@@ -0,0 +1,104 @@
+#pragma once
+
+#include "globals.hh"
+
+#include "EventStreamFormat.hh"
+#include "RunAction.hh"
+
+#include <atomic>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+
+// Asynchronous output backend (output.backend: async in config.yaml).
+// The workers don't fill any ntuple: at the end of the event they pack the row into a fixed-size record,
+// push it into a bounded lock-free queue and go back to tracking. A dedicated writer thread drains the queue,
+// packs the records in batches, compresses them (zlib, when HodoSim is built with it) and writes the event stream
+// <output file stem>.hodoevt (layout in EventStreamFormat.hh, converted to ROOT by the EventStream tool).
+// Only the fixed-size part of the row is stored: counts and muon truth, no per-photon or per-muon vectors.
+struct AsyncOutputSettings {
+	G4bool enabled;
+	G4int queueCapacity;		// records, rounded up to a power of 2
+	G4int batchSize;			// records compressed and written together
+	G4int compressionLevel;		// zlib level, 0 stores the batches uncompressed
+};
+
+
+// Bounded multi-producer single-consumer queue of fixed-size records (sequence numbered cells, no locks).
+// A producer claims a cell with a CAS on the enqueue position and publishes it through the cell sequence,
+// the single consumer reads the cells in order.
+class EventRecordQueue
+{
+public:
+	EventRecordQueue(size_t capacity, size_t recordSize);
+
+	G4bool TryPush(const char* record);
+	G4bool TryPop(char* record);
+
+	size_t Depth() const;
+	size_t Capacity() const { return _mask + 1; }
+
+private:
+	struct alignas(64) Cell {
+		std::atomic<size_t> sequence;
+	};
+
+	std::unique_ptr<Cell[]> _cells;
+	std::vector<char> _storage;
+	size_t _mask;
+	size_t _recordSize;
+
+	alignas(64) std::atomic<size_t> _enqueuePosition{ 0 };
+	alignas(64) std::atomic<size_t> _dequeuePosition{ 0 };
+};
+
+
+// Shared by all the threads: the master starts and stops it, the workers push through their RunAction
+class AsyncEventWriter
+{
+public:
+	AsyncEventWriter(const AsyncOutputSettings& settings, G4int nSiPMs);
+	~AsyncEventWriter();
+
+	static G4bool IsCompressionAvailable();	// false if HodoSim was built without zlib
+
+	// Master only, once per run: opens the stream and starts the writer thread
+	G4bool Open(const G4String& filename);
+	// Master only, after the workers: drains the queue, stops the thread and prints the counters
+	void Close();
+
+	// Worker only, blocks (spinning) only when the queue is full
+	void Push(const NtupleRow& row);
+
+private:
+	void WriterLoop();
+	void WriteBatch();
+	void PrintSummary() const;
+
+	AsyncOutputSettings _settings;
+	G4int _nSiPMs;
+	std::uint32_t _recordSize;
+
+	std::unique_ptr<EventRecordQueue> _queue;
+	std::thread _writerThread;
+	std::atomic<G4bool> _stop{ false };
+
+	// Writer thread only
+	std::ofstream _out;
+	EventStreamHeader _header{};
+	std::vector<char> _batch;
+	std::vector<unsigned char> _compressed;
+	std::uint32_t _batchRecords = 0;
+
+	// Back-pressure and I/O counters of the run
+	std::atomic<std::uint64_t> _nPushed{ 0 };
+	std::atomic<std::uint64_t> _nBlockedPushes{ 0 };	// pushes that found the queue full
+	std::atomic<std::uint64_t> _blockedNanoseconds{ 0 };	// time spent by the workers waiting for a free slot
+	std::atomic<size_t> _maxDepth{ 0 };
+	std::uint64_t _nBatches = 0;
+	std::uint64_t _rawBytes = 0;
+	std::uint64_t _storedBytes = 0;
+};
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "G4VFastSimulationModel.hh"
+#include "G4MaterialPropertyVector.hh"
+#include "G4Region.hh"
+
+#include <vector>
+
+
+// Forward declaration
+class SiliconPMSD;
+
+
+struct AnalyticOpticsSettings {
+	G4bool enabled;			// take over the optical photons born in the scintillator with the analytic propagator
+	G4int batchSize;		// photons buffered before being propagated together
+};
+
+// The optical properties the propagator needs, taken from the same tables used by G4OpBoundaryProcess
+struct BoxOpticsProperties {
+	G4double halfX;
+	G4double halfY;
+	G4double halfZ;
+	G4int sipmsPerSide;
+	G4MaterialPropertyVector* scintRIndex;
+	G4MaterialPropertyVector* scintAbsLength;
+	G4MaterialPropertyVector* sipmRIndex;
+	G4MaterialPropertyVector* coatingReflectivity;
+};
+
+
+// Analytic photon propagator for the single plate geometry.
+// The plate is a polished box: the front and back faces are Al coated (dielectric_metal, polished)
+// and the four lateral faces are fully covered by the SiPMs (dielectric_dielectric, polished).
+// Instead of stepping each photon through G4Navigator and G4OpBoundaryProcess, photons are killed
+// at birth, buffered and propagated in batches with a structure-of-arrays ray tracer covering
+// bulk absorption, Fresnel reflection/refraction (TIR included) at the SiPM faces and the coating reflectivity.
+// Detected photons are handed to the SiliconPMSD, so the event action sees the usual hits collection.
+//
+// Approximations: the Fresnel coefficients are averaged over the two polarizations
+// and the photon is considered detected as soon as it is refracted into the SiPM
+// (with a 100 nm absorption length this is what happens in the full simulation too).
+class BoxOpticsModel : public G4VFastSimulationModel
+{
+public:
+	BoxOpticsModel(const G4String& name, G4Region* region, BoxOpticsProperties properties, G4int batchSize, SiliconPMSD* siliconPMSD);
+	~BoxOpticsModel();
+
+	G4bool IsApplicable(const G4ParticleDefinition& particle) override;
+	G4bool ModelTrigger(const G4FastTrack& fastTrack) override;
+	void DoIt(const G4FastTrack& fastTrack, G4FastStep& fastStep) override;
+
+	// Called by the fast simulation manager when the stack is empty
+	void Flush() override { FlushBatch(); }
+
+	// Propagates the photons left in the batch
+	void FlushBatch();
+
+private:
+	void Resize(G4int capacity);
+	void Propagate();
+
+	BoxOpticsProperties _properties;
+	G4int _batchSize;
+	SiliconPMSD* _siliconPMSD;
+
+	G4double _sipmWidth;
+
+	// Photon batch (structure of arrays, so that the geometric loops vectorize)
+	G4int _nPhotons = 0;
+	std::vector<G4double> _x, _y, _z;
+	std::vector<G4double> _dx, _dy, _dz;
+	std::vector<G4double> _time;
+	std::vector<G4double> _absPath;			// path left before bulk absorption
+	std::vector<G4double> _pathLength;		// path travelled so far
+	std::vector<G4double> _energy;
+	std::vector<G4double> _n1, _n2;			// scintillator and SiPM refractive indices at the photon energy
+	std::vector<G4double> _reflectivity;	// coating reflectivity at the photon energy
+	std::vector<G4double> _x0, _y0, _z0;	// emission position
+	std::vector<G4double> _weight;			// statistical weight of the photon
+	std::vector<G4int> _isCerenkov;
+	std::vector<G4int> _nReflections;
+	std::vector<G4int> _nReflectionsAtCoating;
+	std::vector<G4int> _alive;
+
+	// Scratch buffers
+	std::vector<G4double> _stepLength;
+	std::vector<G4int> _face;
+	std::vector<G4double> _random;
+};
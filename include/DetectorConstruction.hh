@@ -10,6 +10,11 @@
 #include "G4OpticalSurface.hh"
 #include "G4LogicalBorderSurface.hh"
 
+#include "LightResponseTable.hh"
+#include "BoxOpticsModel.hh"
+#include "PhotonRecord.hh"
+#include "ReflectionCounting.hh"
+
 
 struct ReferenceFrame {
 	// -- Still Not Implemented --
@@ -36,6 +41,7 @@ struct ScintillatorProperties {
 	G4double decayTime;				// time constant for the decay of the scintillation light (in ns)
 	G4double refractiveIndex;		// 
 	G4double absorptionLength;		// 
+	G4double generationFraction;	// fraction of the scintillation photons actually generated (< 1 only in the weighted yield mode)
 
 };
 
@@ -52,7 +58,14 @@ public:
 		G4String scintLVName,
 		G4String opCName,
 		G4bool enableCuts,
-		G4int sipmsPerSide
+		G4int sipmsPerSide,
+		G4bool stripMode,
+		G4bool storeHits,
+		G4bool storeArrivalTimes,
+		AnalyticOpticsSettings analyticOpticsSettings,
+		LightResponseTableBuilder* lightResponseTableBuilder = nullptr,
+		PhotonRecordWriter* photonRecordWriter = nullptr,
+		ReflectionSurfaces* reflectionSurfaces = nullptr
 	);
 	~DetectorConstruction();
 
@@ -72,6 +85,9 @@ private:
 	G4double _siPMThickness;
 	G4double _gap;
 	G4int _sipmsPerSide;
+	G4bool _stripMode;		// one continuous sensitive strip per edge instead of _sipmsPerSide SiPMs
+	G4bool _storeHits;		// debug: the SD also stores one OpticalPhotonHit per detected photon
+	G4bool _storeArrivalTimes;	// the SD keeps the photon arrival times for the SiPM digitizer
 
 	G4String _scintLVName;
 	G4String _siliconPMSDName;
@@ -79,6 +95,11 @@ private:
 
 	G4bool _enableCuts;
 
+	AnalyticOpticsSettings _analyticOpticsSettings;
+	LightResponseTableBuilder* _lightResponseTableBuilder; // only set when building the fast optics table
+	PhotonRecordWriter* _photonRecordWriter;				// only set when the detected photons are recorded
+	ReflectionSurfaces* _reflectionSurfaces;				// only set when the reflections are counted
+
 	G4NistManager* nist;
 
 	G4Material* vacuum;
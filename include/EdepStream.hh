@@ -0,0 +1,93 @@
+#pragma once
+
+#include "G4ThreeVector.hh"
+#include "globals.hh"
+
+#include <cstdint>
+#include <fstream>
+#include <vector>
+
+
+// Two-stage simulation.
+// Most sweeps only change the optical parameters, so the muon transport (with its delta rays) doesn't need to be redone every time.
+// Stage 1 ("record") runs without optical photons and writes every charged/energy-depositing step in the scintillator to a binary stream.
+// Stage 2 ("replay") reads the stream back and regenerates only the scintillation/Cerenkov photons from those steps,
+// using the optical properties of the current configuration.
+struct TwoStageSettings {
+	G4bool record;			// stage 1: write the scintillator steps, the optical photons are not generated
+	G4bool replay;			// stage 2: the primaries are the optical photons regenerated from the stream
+	G4String streamFile;
+};
+
+
+// On-disk layout (native endianness, the stream is meant to be replayed on the same machine/cluster)
+#pragma pack(push, 1)
+
+struct EdepStreamHeader {
+	char magic[8];				// "HODOEDS"
+	std::uint32_t version;
+};
+static constexpr std::uint32_t kEdepStreamVersion = 2;
+
+// One per event, followed by nSteps EdepStepRecord
+struct EdepEventRecord {
+	std::int32_t eventID;
+	std::uint32_t nSteps;
+	// Event truth, the muon scorer and the muon tracking don't see anything in stage 2
+	float scintEdep;			// eV
+	float coatingEdep;			// eV
+	float muPathLength;			// mm
+	float muonHitX;				// mm
+	float muonHitY;				// mm
+	float muonExitX, muonExitY, muonExitZ;	// mm
+	float muonExitDirX, muonExitDirY, muonExitDirZ;
+	float muonExitEnergy;		// MeV
+};
+
+struct EdepStepRecord {
+	float preX, preY, preZ;		// mm
+	float postX, postY, postZ;	// mm
+	float preTime, postTime;	// ns
+	float edep;					// eV
+	float preBeta, postBeta;	// velocity at the step ends, needed to regenerate the Cerenkov photons
+	float charge;				// units of eplus
+	std::int32_t pdg;
+};
+
+#pragma pack(pop)
+
+
+// Stage 1 writer, shared by all the worker threads (each event is written as a whole block under a lock)
+class EdepStreamWriter
+{
+public:
+	EdepStreamWriter(const G4String& filename);
+	~EdepStreamWriter();
+
+	G4bool IsOpen() const { return _out.is_open(); }
+
+	void WriteEvent(const EdepEventRecord& event, const std::vector<EdepStepRecord>& steps);
+
+private:
+	std::ofstream _out;
+	std::uint64_t _nEvents = 0;
+	std::uint64_t _nSteps = 0;
+};
+
+
+// Stage 2 reader, shared by all the worker threads (events are handed out in file order, one at a time)
+class EdepStreamReader
+{
+public:
+	EdepStreamReader(const G4String& filename);
+	~EdepStreamReader();
+
+	G4bool IsOpen() const { return _isValid; }
+
+	// Returns false once the stream is exhausted
+	G4bool ReadEvent(EdepEventRecord& event, std::vector<EdepStepRecord>& steps);
+
+private:
+	std::ifstream _in;
+	G4bool _isValid = false;
+};
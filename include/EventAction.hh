@@ -2,37 +2,76 @@
 
 #include "G4UserEventAction.hh"
 #include "G4Event.hh"
-#include "G4THitsMap.hh"
 #include "G4SDManager.hh"
 #include "G4AnalysisManager.hh"
 
+#include "LightResponseTable.hh"
+#include "EdepStream.hh"
+#include "Trigger.hh"
+#include "MuonScorer.hh"
+#include "SiPMDigitizer.hh"
+#include "SiPMCounters.hh"
+#include "SparseEncoding.hh"
+
 
 struct EventActionParameters {
 	G4String scintLVName;
+	G4String coatingLVName;
 	G4String siliconPMSDName;
 	G4String opCName;
 	G4int sipmsPerSide;
+	const LightResponseTable* lightResponseTable;	// only set in fast optics mode
+	G4double scintYield;							// photons per unit of deposited energy (yield factor included)
+	G4bool enableWeightedYield;						// store the variance of the weighted counts and the effective sample size
+	EdepStreamWriter* edepStreamWriter;				// only set in the two-stage record (stage 1)
+	G4bool enableReplay;							// two-stage replay (stage 2), the event truth comes from the stream
+	G4bool enableStripMode;							// store the edge position of every detected photon
+	G4bool enableSubEvents;							// the optical photons are tracked in sub-events by the other threads
+	TriggerSettings triggerSettings;
+	SiPMDigitizerSettings digitizerSettings;
+	G4bool enableSpill;								// several muons per event, fill the per-muon truth columns
+	SparseEncodingSettings sparseEncoding;			// zero-suppressed per-SiPM columns
 };
 
+// Forward declaration
+class RunAction;
+class SiliconPMSD;
+struct SpillColumns;
+
 class EventAction : public G4UserEventAction {
 public:
-	EventAction(EventActionParameters eventActionParameters);
+	EventAction(EventActionParameters eventActionParameters, RunAction* runAction);
 	~EventAction();
 
 	void BeginOfEventAction(const G4Event* event) override;
 	void EndOfEventAction(const G4Event* event) override;
 
+	// Sub-event mode: adds the detected photons of a finished sub-event to the muon event
+	void MergeSubEvent(G4Event* masterEvent, const G4Event* subEvent) override;
+
 	// I defined this method that will be called from the TrackingAction
 	// to register the position of the muon when it enters the scintillator.
 	// It can be expanded later to include other information if needed.
-	void RegisterMuonHit(G4ThreeVector localPos, G4ThreeVector globalPos, G4double tGlob);
+	// In spill mode every muon is stored, the scalar columns keep the first one.
+	void RegisterMuonHit(G4int trackID, G4ThreeVector localPos, G4ThreeVector globalPos, G4double tGlob);
+
+	// Called from the SteppingAction in fast optics mode for every step depositing energy in the scintillator
+	void AddScintDeposit(const G4ThreeVector& prePos, const G4ThreeVector& postPos, G4double edep);
+
+	// Called from the SteppingAction in the two-stage record for every charged or energy depositing step in the scintillator
+	void RecordScintStep(const G4Step* step);
+
+	// The SteppingAction scores the primary muon steps into it, the StackingAction reads the edep for the trigger
+	MuonScorer& GetMuonScorer() { return muonScorer; }
 
 private:
 
-	static G4double SumOverHC(const G4THitsMap<G4double>* hm);
+	void FillSpillColumns(const G4Event* event, SiPMCounts& counts, const MuonScore& muonScore, SpillColumns& spill);
+	SiliconPMSD* GetSiliconPMSD();
 
 	EventActionParameters _eventActionParameters;
 	G4AnalysisManager* analysisManager;
+	RunAction* _runAction;
 
 	// Muon data for the current event
 	// For starting I will assume that only one muon is present per event.
@@ -42,10 +81,27 @@ private:
 	G4ThreeVector muonGlobalEntryPosition = G4ThreeVector(0., 0., 0.);
 	G4double muonGlobalTime = 0.;
 
-	// Cache hit collections IDs to improve performances
-	G4int siliconPM_op_HCID			= -1;
-	G4int scint_edep_HCID			= -1;
-	G4int scint_muPathLength_HCID	= -1;
-	G4int coating_edep_HCID			= -1;
-	G4int siliconPM_edep_HCID		= -1;
+	// Spill mode: entry position (scintillator frame) and time of every muon, indexed by track ID - 1
+	std::vector<G4bool> spillEntered;
+	std::vector<G4ThreeVector> spillEntryPositions;
+	std::vector<G4double> spillEntryTimes;
+
+	// Edep, path length and exit state of the primary muon (plain per-thread sums, no scorer hits maps)
+	MuonScorer muonScorer;
+
+	// SiPM digitizer of this thread (owned by the G4DigiManager), nullptr if disabled
+	SiPMDigitizer* digitizer = nullptr;
+	G4int digiCollectionID = -1;
+
+	// SD of this thread, it holds the photon records until the trigger decision
+	SiliconPMSD* siliconPMSD = nullptr;
+
+	// Set when the geometric trigger aborted the event before tracking
+	G4bool vetoedByGeometry = false;
+
+	// Expected number of detected scintillation photons per SiPM (fast optics mode only)
+	std::vector<G4double> expectedScintHits;
+
+	// Scintillator steps of the current event (two-stage record only)
+	std::vector<EdepStepRecord> edepSteps;
 };
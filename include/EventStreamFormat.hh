@@ -0,0 +1,50 @@
+#pragma once
+
+// On-disk layout of the event stream written by the asynchronous output backend (output.backend: async).
+// This header doesn't depend on Geant4, it is shared with the EventStream tool.
+//
+// The file is a header followed by batches, each batch is a BatchHeader followed by storedSize bytes:
+// nRecords fixed-size event records, zlib compressed if the header says so (and storedSize < rawSize).
+// The records are written in the order the writer thread receives them, not sorted by EventID.
+
+#include <cstdint>
+
+
+#pragma pack(push, 1)
+
+struct EventStreamHeader {
+	char magic[8];					// "HODOEVT"
+	std::uint32_t version;
+	std::uint32_t nSiPMs;
+	std::uint32_t recordSize;		// bytes of an event record
+	std::uint32_t compression;		// 0 = none, 1 = zlib
+	std::uint64_t nEvents;			// filled when the stream is closed
+};
+
+struct EventStreamBatchHeader {
+	std::uint32_t nRecords;
+	std::uint32_t rawSize;
+	std::uint32_t storedSize;		// equal to rawSize if the batch is stored uncompressed
+};
+
+// Fixed part of an event record, followed by nSiPMs uint16 scintillation counts and nSiPMs uint16 Cerenkov counts
+// (saturated at 65535). Same quantities and units of the PerEventCollectedData columns.
+struct EventRecordTruth {
+	std::int32_t eventID;
+	float scintEdep;				// eV
+	float coatingEdep;				// eV
+	float muPathLength;				// mm
+	float muonHitX, muonHitY;		// mm
+	float muonExitX, muonExitY, muonExitZ;	// mm, scintillator frame
+	float muonExitDirX, muonExitDirY, muonExitDirZ;
+	float muonExitEnergy;			// MeV
+};
+
+#pragma pack(pop)
+
+static constexpr std::uint32_t kEventStreamVersion = 1;
+
+inline std::uint32_t EventRecordSize(std::uint32_t nSiPMs)
+{
+	return (std::uint32_t)sizeof(EventRecordTruth) + 2 * nSiPMs * (std::uint32_t)sizeof(std::uint16_t);
+}
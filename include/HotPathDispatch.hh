@@ -0,0 +1,29 @@
+#pragma once
+
+#include "G4Track.hh"
+#include "globals.hh"
+
+
+// Lookups used on every step/photon, resolved once per thread instead of comparing names each time.
+// (the Benchmark tool measures the saving of each of them)
+
+
+// Process that created an optical photon
+enum class OpticalPhotonOrigin { None, Scintillation, Cerenkov, Other };
+
+// The creator process pointer is mapped to the enum through a per-thread table, filled the first time each process is seen
+// (the process objects are thread-local, and in sub-event mode a photon can come from the processes of another thread).
+// Replayed photons report the process they were regenerated for, so the rest of the code doesn't need to know about stage 2.
+OpticalPhotonOrigin GetOpticalPhotonOrigin(const G4Track* track);
+
+// "Scintillation", "Cerenkov", ... for printouts and the debug hits
+const G4String& GetOpticalPhotonOriginName(OpticalPhotonOrigin origin);
+
+
+// Hit collection IDs of the SiPM counters, shared by the user actions (the muon truth doesn't go through collections, see MuonScorer).
+// They are looked up by name on the first call of each thread (the SDs must already be constructed).
+struct HitCollectionIDs {
+	G4int siPMCounters;
+
+	static const HitCollectionIDs& Get();
+};
@@ -0,0 +1,112 @@
+#pragma once
+
+#include "G4ThreeVector.hh"
+#include "globals.hh"
+
+#include <cstdint>
+#include <vector>
+
+
+// I use these settings to switch between the full optical simulation and the "fast optics" surrogate.
+// The surrogate replaces the tracking of scintillation photons with per-SiPM detection probabilities
+// (the light response function, LRF) tabulated on a grid of emission positions inside the plate.
+// The table is built once from a full run ("build" mode) and then reused in every "use" run.
+struct FastOpticsSettings {
+	G4bool buildTable;		// full optical simulation, the detected/emitted photons are recorded to build the table
+	G4bool useTable;		// scintillation photons are not generated, the SiPM counts are sampled from the table
+	G4String tableFile;
+	G4int gridX;			// number of cells along each axis of the plate
+	G4int gridY;
+	G4int gridZ;
+};
+
+
+// Read-only light response table.
+// The file is memory-mapped, so a single copy is shared by all the worker threads
+// (and by the page cache between different processes reading the same file).
+// The probabilities are stored cell-major, i.e. the nSiPMs values of a cell are contiguous.
+class LightResponseTable
+{
+public:
+	LightResponseTable(const G4String& filename);
+	~LightResponseTable();
+
+	LightResponseTable(const LightResponseTable&) = delete;
+	LightResponseTable& operator=(const LightResponseTable&) = delete;
+
+	G4bool IsLoaded() const { return _probabilities != nullptr; }
+	G4int GetNumberOfSiPMs() const { return _header ? (G4int)_header->nSiPMs : 0; }
+
+	// Returns -1 if the position is outside of the tabulated volume
+	G4int GetCellIndex(const G4ThreeVector& position) const;
+	const float* GetCellResponse(G4int cell) const { return _probabilities + (size_t)cell * _header->nSiPMs; }
+
+	// Spreads nPhotons uniformly along the segment pre -> post (the same way G4Scintillation does)
+	// and adds the expected number of detected photons of each SiPM to expected[0..nSiPMs-1].
+	void AccumulateStep(const G4ThreeVector& pre, const G4ThreeVector& post, G4double nPhotons, G4double* expected) const;
+
+	// On-disk layout, shared with LightResponseTableBuilder
+	struct Header {
+		char magic[8];			// "HODOLRF"
+		std::uint32_t version;
+		std::uint32_t nSiPMs;
+		std::uint32_t nx, ny, nz;
+		double halfX, halfY, halfZ;	// mm, the plate is centered in the origin
+	};
+	static constexpr std::uint32_t kVersion = 1;
+
+private:
+	void Unmap();
+
+	const Header* _header = nullptr;
+	const float* _probabilities = nullptr;
+
+	void* _mappedData = nullptr;
+	size_t _mappedSize = 0;
+#ifdef _WIN32
+	void* _fileHandle = nullptr;
+	void* _mappingHandle = nullptr;
+#endif
+
+	G4double _cellSizeX = 0., _cellSizeY = 0., _cellSizeZ = 0.;
+};
+
+
+// Accumulates emitted and detected scintillation photons per emission cell during a full run.
+// Each thread fills its own buffers (no locks in the hot path), which are merged into the
+// shared ones at the end of the run by the workers; the master then writes the table to disk.
+class LightResponseTableBuilder
+{
+public:
+	LightResponseTableBuilder(FastOpticsSettings settings, G4double halfX, G4double halfY, G4double halfZ, G4int nSiPMs);
+	~LightResponseTableBuilder();
+
+	// The weights keep the table unbiased when the photons are generated in the weighted yield mode
+	void RecordEmission(const G4ThreeVector& position, G4double weight = 1.);
+	void RecordDetection(const G4ThreeVector& emissionPosition, G4int siPMID, G4double weight = 1.);
+
+	// Called by each worker at the end of the run
+	void MergeThreadData();
+
+	// Called by the master at the end of the run
+	G4bool WriteTable() const;
+
+private:
+	struct ThreadData {
+		std::vector<G4double> emitted;
+		std::vector<G4double> detected;
+	};
+
+	G4int GetCellIndex(const G4ThreeVector& position) const;
+	ThreadData* GetThreadData();
+
+	FastOpticsSettings _settings;
+	G4double _halfX, _halfY, _halfZ;
+	G4int _nSiPMs;
+	G4int _nCells;
+
+	std::vector<G4double> _emitted;
+	std::vector<G4double> _detected;
+
+	static G4ThreadLocal ThreadData* fThreadData;
+};
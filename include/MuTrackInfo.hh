@@ -2,6 +2,7 @@
 
 #include "G4VUserTrackInformation.hh"
 #include "G4ThreeVector.hh"
+#include "G4Allocator.hh"
 
 // I'll use this class to track the position of muons once they reach the scintillator.
 // This way I'll be able to evaluate the efficiency of the beam reconstruction algorithm 
@@ -11,9 +12,25 @@ class MuTrackInfo : public G4VUserTrackInformation
 public:
 	MuTrackInfo() = default;
 
+	inline void* operator new(size_t);
+	inline void operator delete(void* info);
+
 	G4bool enteredScint = false;
 	G4ThreeVector globalEntryPosition;	// global and local refers to the scintillator frame of reference
 	G4ThreeVector localEntryPosition;
 	G4double globalTime = 0.;
 };
 
+// Memory allocation handler, one thread-local pool like the photon track info
+extern G4ThreadLocal G4Allocator<MuTrackInfo>* MuTrackInfoAllocator;
+
+inline void* MuTrackInfo::operator new(size_t)
+{
+	if (!MuTrackInfoAllocator) MuTrackInfoAllocator = new G4Allocator<MuTrackInfo>;
+	return (void*)MuTrackInfoAllocator->MallocSingle();
+}
+
+inline void MuTrackInfo::operator delete(void* info)
+{
+	MuTrackInfoAllocator->FreeSingle((MuTrackInfo*)info);
+}
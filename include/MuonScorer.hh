@@ -0,0 +1,53 @@
+#pragma once
+
+#include "G4Step.hh"
+#include "G4LogicalVolume.hh"
+#include "G4ThreeVector.hh"
+
+#include <vector>
+
+
+// Truth of the primary muon in the current event
+struct MuonScore {
+	G4double scintEdep = 0.;
+	G4double coatingEdep = 0.;
+	G4double scintPathLength = 0.;		// only complete passages through the scintillator (like G4PSPassageTrackLength)
+
+	// State of the muon when it leaves the scintillator (transparency studies)
+	G4bool exitedScint = false;
+	G4ThreeVector exitLocalPosition;	// scintillator frame of reference
+	G4ThreeVector exitDirection;
+	G4double exitKineticEnergy = 0.;
+
+	// Scintillator edep of every primary muon, indexed by track ID - 1 (spill mode, the sums above are over all the muons)
+	std::vector<G4double> muonScintEdep;
+};
+
+// Per-thread scoring of the primary muon, it replaces the ScintillatorMFD/CoatingMFD primitive scorers.
+// The SteppingAction hands it the steps of the primary muon and the quantities are summed into plain doubles,
+// so there is no G4THitsMap to allocate and no hit collection to look up at the end of the event.
+// It is owned by the EventAction, which resets it at the beginning of every event.
+// With several muons per event (spill mode) the exit state is the one of the last muon leaving the scintillator.
+class MuonScorer
+{
+public:
+	MuonScorer(const G4String& scintLVName, const G4String& coatingLVName);
+
+	void Reset();
+	void ProcessStep(const G4Step* step);
+
+	const MuonScore& GetScore() const { return _score; }
+
+private:
+	void ResolveVolumes();
+
+	G4String _scintLVName;
+	G4String _coatingLVName;
+	const G4LogicalVolume* scintLV = nullptr;	// looked up once per thread, on the first step
+	const G4LogicalVolume* coatingLV = nullptr;
+
+	G4bool inPassage = false;		// the muon entered the scintillator through its boundary
+	G4double passageLength = 0.;
+
+	MuonScore _score;
+};
@@ -22,6 +22,8 @@ public:
 	void SetNReflections(G4int nReflections);
 	void SetNReflectionsAtCoating(G4int nReflectionsAtCoating);
 	void SetSiPMID(G4int siPMID);
+	void SetWeight(G4double weight);
+	void SetEdgePosition(G4double edgePosition);
 
 
 	G4double GetEdep() const { return _edep; }
@@ -31,6 +33,8 @@ public:
 	G4int GetNReflections() const { return _nReflections; }
 	G4int GetNReflectionsAtCoating() const { return _nReflectionsAtCoating; }
 	G4int GetSiPMID() const { return _siPMID; }
+	G4double GetWeight() const { return _weight; }
+	G4double GetEdgePosition() const { return _edgePosition; }
 
 private:
 	G4int _eventID;
@@ -41,6 +45,8 @@ private:
 	G4int _nReflections;
 	G4int _nReflectionsAtCoating;
 	G4int _siPMID;
+	G4double _weight;		// statistical weight of the photon (1 unless the weighted yield mode is on)
+	G4double _edgePosition;	// position along the plate edge as a fraction of its length, -1 if not available
 };
 
 // Memory allocation handler (required for hits collections)
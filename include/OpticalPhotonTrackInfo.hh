@@ -1,6 +1,15 @@
 #pragma once
 
 #include "G4VUserTrackInformation.hh"
+#include "G4Allocator.hh"
+#include "G4Track.hh"
+
+
+// Where the per-photon counters live (optics.photon_track_info in config.yaml)
+enum class PhotonTrackInfoMode {
+	Pooled,		// an OpticalPhotonTrackInfo attached to every photon, allocated from a thread-local pool
+	SideTable	// no user information at all, the counters of the photon being tracked are kept by the thread
+};
 
 // I'll use this class to keep track of the number of reflections each optical photon undergoes in its lifetime.
 // This is not strictly necessary but i think it's a powerful metric for an optimization study of the detector geometry.
@@ -9,9 +18,37 @@ class OpticalPhotonTrackInfo : public G4VUserTrackInformation
 public:
 	OpticalPhotonTrackInfo() = default;
 
+	inline void* operator new(size_t);
+	inline void operator delete(void* info);
+
+	// Counters of the photon, either attached to the track or in the side table of the current thread
+	// (nullptr if the photon has none, e.g. a photon that was never handed to the TrackingAction)
+	static OpticalPhotonTrackInfo* Get(const G4Track* track);
+
+	// Side table mode: resets the counters for a new photon (called by the TrackingAction).
+	// A thread tracks one photon at a time and photons have no secondaries, so the table only holds the current one.
+	static void BeginSideTableTrack(G4int trackID);
+
 	// In theory the OP reflects only at coatings
 	// I made this distinction to account for an eventual future scenario in which optical grease or an optical guide is used.
 	int nReflections = 0;
 	int nReflectionsAtCoating = 0;
+
+	// Path travelled inside the scintillator, the only medium where the photons are absorbed in the bulk
+	// (only accumulated when the detected photons are recorded)
+	double scintPathLength = 0.;
 };
 
+// Memory allocation handler, a photon track info is created for every optical photon in pooled mode
+extern G4ThreadLocal G4Allocator<OpticalPhotonTrackInfo>* OpticalPhotonTrackInfoAllocator;
+
+inline void* OpticalPhotonTrackInfo::operator new(size_t)
+{
+	if (!OpticalPhotonTrackInfoAllocator) OpticalPhotonTrackInfoAllocator = new G4Allocator<OpticalPhotonTrackInfo>;
+	return (void*)OpticalPhotonTrackInfoAllocator->MallocSingle();
+}
+
+inline void OpticalPhotonTrackInfo::operator delete(void* info)
+{
+	OpticalPhotonTrackInfoAllocator->FreeSingle((OpticalPhotonTrackInfo*)info);
+}
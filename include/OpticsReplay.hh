@@ -0,0 +1,81 @@
+#pragma once
+
+#include "G4VUserPrimaryParticleInformation.hh"
+#include "G4VUserEventInformation.hh"
+#include "G4PrimaryParticle.hh"
+#include "G4DynamicParticle.hh"
+#include "G4VProcess.hh"
+#include "G4Track.hh"
+#include "G4Event.hh"
+#include "G4MaterialPropertyVector.hh"
+
+#include "EdepStream.hh"
+#include "HotPathDispatch.hh"
+
+#include <vector>
+
+
+// The replayed photons are primaries, so they have no creator process.
+// I tag each of them with the process it stands for.
+class ReplayPhotonInfo : public G4VUserPrimaryParticleInformation
+{
+public:
+	ReplayPhotonInfo(G4bool isCerenkov) : _isCerenkov(isCerenkov) {}
+
+	OpticalPhotonOrigin GetOrigin() const { return _isCerenkov ? OpticalPhotonOrigin::Cerenkov : OpticalPhotonOrigin::Scintillation; }
+	void Print() const override;
+
+private:
+	G4bool _isCerenkov;
+};
+
+// Stage 1 event truth, handed to the EventAction in stage 2
+class ReplayEventInfo : public G4VUserEventInformation
+{
+public:
+	ReplayEventInfo(const EdepEventRecord& record) : _record(record) {}
+
+	const EdepEventRecord& GetRecord() const { return _record; }
+	void Print() const override;
+
+private:
+	EdepEventRecord _record;
+};
+
+
+// Regenerates the optical photons of the recorded steps the same way G4Scintillation and G4Cerenkov do
+// (uniformly along the step, Poisson-distributed number of photons), as primaries of the current event.
+// The optical properties are read from the scintillator material, i.e. from the current configuration.
+// Approximations: a single scintillation component, and the Cerenkov yield uses the mean velocity of the step.
+class OpticalPhotonReplayer
+{
+public:
+	OpticalPhotonReplayer(const G4String& scintLVName);
+	~OpticalPhotonReplayer();
+
+	// Returns the number of photons added to the event
+	G4int GeneratePhotons(G4Event* event, const std::vector<EdepStepRecord>& steps);
+
+private:
+	void Initialize();
+	void AddScintillationPhotons(G4Event* event, const EdepStepRecord& step);
+	void AddCerenkovPhotons(G4Event* event, const EdepStepRecord& step);
+	void AddPhoton(G4Event* event, const G4ThreeVector& position, G4double time, G4double energy,
+		const G4ThreeVector& direction, const G4ThreeVector& polarization, G4bool isCerenkov);
+
+	G4double SampleScintillationEnergy() const;
+	G4double CerenkovPhotonsPerLength(G4double beta, G4double charge) const;
+
+	G4String _scintLVName;
+	G4bool _isInitialized = false;
+
+	// Scintillation
+	G4double _scintYield = 0.;			// photons per unit of deposited energy (yield factor and generation fraction included)
+	G4double _decayTime = 0.;
+	std::vector<G4double> _emissionEnergy;	// inverse cumulative of SCINTILLATIONCOMPONENT1
+	std::vector<G4double> _emissionCDF;
+
+	// Cerenkov
+	G4MaterialPropertyVector* _rIndex = nullptr;
+	G4double _maxRIndex = 0.;
+};
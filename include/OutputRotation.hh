@@ -0,0 +1,65 @@
+#pragma once
+
+#include "globals.hh"
+#include "G4MTRunManager.hh"
+
+#include <string>
+#include <vector>
+
+
+// Rolling output (output.rolling in config.yaml).
+// A long run is split into chunks, every chunk is a G4 run of its own with its own files
+// (<stem>_0000.root, <stem>_0001.root, ... and the same for the RNTuple/async backends), closed as soon as the chunk ends:
+// a crash loses at most the chunk in progress and the memory held for the output never grows past one chunk.
+// A chunk holds at most eventsPerFile events, fewer when maxFileSize is set: the bytes per event of the last chunk
+// predict how many events fit in a file. The event IDs keep counting across the chunks.
+// Every closed chunk is appended to <stem>_manifest.txt (tab separated: chunk, first event, events, bytes, file),
+// so a downstream tool can consume the listed files while the run goes on.
+// The histograms and the run summaries (photon limits, weighted yield, trigger) cover one chunk, they are reset
+// between the chunks: the totals of the /run/beamOn are the sum over the chunks (the Merge tool adds the histograms).
+struct OutputRotationSettings {
+	G4bool enabled;
+	G4int eventsPerFile;
+	G4double maxFileSize;	// bytes, 0 = only the event count
+	G4int basketSize;		// bytes, ntuple buffer of every column of every thread (flushed to the file when full)
+};
+
+
+// Shared by the RollingRunManager and the run actions of all the threads.
+// The master updates it between the chunks, the workers only read it at the start of a chunk.
+class OutputRotation
+{
+public:
+	OutputRotation(const OutputRotationSettings& settings);
+
+	const OutputRotationSettings& GetSettings() const { return _settings; }
+
+	// Events of the next chunk, out of the remaining ones of the /run/beamOn
+	G4int NextChunkEvents(G4int remaining) const;
+
+	// <stem>_<chunk>.<ext> of the output file
+	static std::string GetChunkFileName(const std::string& outputFile, G4int chunk);
+	G4int GetEventIDOffset() const { return _eventIDOffset; }
+
+	// Master only, once the files of the chunk are closed: lists them in the manifest and moves the event IDs on
+	void ChunkClosed(const std::string& outputDir, const std::string& outputFile, G4int chunk, G4int nEvents, const std::vector<std::string>& files);
+
+private:
+	OutputRotationSettings _settings;
+
+	G4int _eventIDOffset = 0;
+	G4double _bytesPerEvent = 0.;	// largest file of the last chunk
+};
+
+
+// MT run manager splitting every /run/beamOn into the chunks of the OutputRotation
+class RollingRunManager : public G4MTRunManager
+{
+public:
+	RollingRunManager(const OutputRotation* rotation) : _rotation(rotation) {}
+
+	void BeamOn(G4int nEvents, const char* macroFile = nullptr, G4int nSelect = -1) override;
+
+private:
+	const OutputRotation* _rotation;
+};
@@ -0,0 +1,118 @@
+#pragma once
+
+#include "globals.hh"
+
+#include <vector>
+
+
+// Per-photon diagnostic histograms (ScintOpticalPhotonsEnergy/Time/Spread).
+// Filling the G4 histograms through the analysis manager for every detected photon costs tens of millions of calls per run,
+// so each thread keeps its own plain bin arrays: the SD only buffers the values of the photon, the buffers are binned
+// in one pass at the end of the event and the bins are handed to the G4 histograms once, at the end of the run
+// (one weighted fill per non-empty bin, the analysis manager then merges the threads as usual).
+// With a prescale N only one detected photon in N is histogrammed, with weight N (times the photon weight in the weighted yield mode).
+
+
+// Binning shared with the G4 histograms booked by the RunAction
+struct FixedBinAxis {
+	G4int nBins;
+	G4double min;
+	G4double max;
+};
+
+// Contiguous bins, [0] is the underflow and [nBins + 1] the overflow
+class FixedBinH1
+{
+public:
+	FixedBinH1(const FixedBinAxis& axis);
+
+	// Every value with its own weight, times scale
+	void FillBatch(const std::vector<G4double>& values, const std::vector<G4double>& weights, G4double scale);
+	void MergeInto(G4int h1ID) const;
+	void Reset();
+
+	// Index of the bin of value, under/overflow included (precomputed inverse width, no division)
+	inline G4int Index(G4double value) const
+	{
+		G4double u = (value - _axis.min) * _invWidth + 1.;
+		u = (u < 0.) ? 0. : ((u > _axis.nBins + 1.) ? _axis.nBins + 1. : u);
+		return (G4int)u;
+	}
+
+	// Center of the bin (for the under/overflow, a value just outside the axis)
+	G4double Center(G4int index) const { return _axis.min + (index - 0.5) / _invWidth; }
+
+private:
+	FixedBinAxis _axis;
+	G4double _invWidth;
+	std::vector<G4double> _bins;
+	std::vector<G4int> _indices;	// scratch buffer of FillBatch
+};
+
+class FixedBinH2
+{
+public:
+	FixedBinH2(const FixedBinAxis& xAxis, const FixedBinAxis& yAxis);
+
+	void FillBatch(const std::vector<G4double>& xs, const std::vector<G4double>& ys, const std::vector<G4double>& weights, G4double scale);
+	void MergeInto(G4int h2ID) const;
+	void Reset();
+
+private:
+	FixedBinH1 _x;		// only used for the bin indices
+	FixedBinH1 _y;
+	G4int _nx;			// bins per row, under/overflow included
+	std::vector<G4double> _bins;
+	std::vector<G4int> _indices;
+};
+
+
+class PhotonHistograms
+{
+public:
+	// One instance per thread
+	static PhotonHistograms& Get();
+
+	// Called at the beginning of the run, a prescale of 0 disables the histograms
+	void Configure(G4int prescale);
+	G4bool IsEnabled() const { return _prescale > 0; }
+
+	// Called by the SD for every detected scintillation photon (energy in eV, time in ns, position in mm, weight of the photon)
+	inline void Add(G4double energy, G4double time, G4double x, G4double y, G4double weight = 1.)
+	{
+		if (_prescale <= 0 || ++_skipped < _prescale) return;
+		_skipped = 0;
+		energies.push_back(energy);
+		times.push_back(time);
+		xs.push_back(x);
+		ys.push_back(y);
+		weights.push_back(weight);
+	}
+
+	// End of event: bins the buffered photons
+	void Flush();
+
+	// End of run: fills the G4 histograms of the thread and resets the bins
+	void MergeIntoAnalysis();
+
+	// Same binning of the G4 histograms (H1 0, H1 1 and H2 0 of the RunAction)
+	static constexpr FixedBinAxis kEnergyAxis{ 1000, 2.2, 3.3 };	// eV
+	static constexpr FixedBinAxis kTimeAxis{ 1000, 0., 30. };		// ns
+	static constexpr FixedBinAxis kSpreadAxis{ 100, -40., 40. };	// mm, both X and Y
+
+private:
+	PhotonHistograms();
+
+	G4int _prescale = 1;
+	G4int _skipped = 0;
+
+	std::vector<G4double> energies;
+	std::vector<G4double> times;
+	std::vector<G4double> xs;
+	std::vector<G4double> ys;
+	std::vector<G4double> weights;
+
+	FixedBinH1 energyH1;
+	FixedBinH1 timeH1;
+	FixedBinH2 spreadH2;
+};
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "globals.hh"
+
+#include "PhotonRecordFormat.hh"
+
+#include <fstream>
+#include <vector>
+
+
+// Optional compact record of every detected photon.
+// The number of reflections at the coating and the optical path length are all that is needed to reweight
+// a detected photon to a different coating reflectivity, absorption length or yield factor (see the Reweight tool),
+// so a single full simulation can answer a whole design scan.
+struct PhotonRecordSettings {
+	G4bool enabled;
+	G4String file;
+};
+
+
+// Shared by all the worker threads, each event is written as a whole block under a lock
+class PhotonRecordWriter
+{
+public:
+	PhotonRecordWriter(const G4String& filename, G4int nSiPMs);
+	~PhotonRecordWriter();
+
+	G4bool IsOpen() const { return _out.is_open(); }
+
+	// Called by the DetectorConstruction once the materials are defined
+	void SetReferenceOptics(G4double coatingReflectivity, G4double absLength, G4double yieldFactor);
+
+	void WriteEvent(const std::vector<DetectedPhotonRecord>& photons);
+
+private:
+	void WriteHeader();
+
+	std::ofstream _out;
+	PhotonRecordHeader _header{};
+	std::uint64_t _nPhotons = 0;
+};
@@ -0,0 +1,38 @@
+#pragma once
+
+// On-disk layout of the detected photon records.
+// This header doesn't depend on Geant4, it is shared with the Reweight tool.
+
+#include <cstdint>
+
+
+#pragma pack(push, 1)
+
+struct PhotonRecordHeader {
+	char magic[8];					// "HODOPHR"
+	std::uint32_t version;
+	std::uint32_t nSiPMs;
+	std::uint64_t nEvents;			// events simulated, including the ones without detected photons
+	// Reference optics of the run, the reweighting is relative to these values
+	float coatingReflectivity;		// REFLECTIVITY of the coating surface at the scintillation peak
+	float absLength;				// ABSLENGTH of the scintillator at the scintillation peak (mm)
+	float yieldFactor;				// scint_data.yield_factor
+};
+
+// One per detected photon (24 bytes)
+struct DetectedPhotonRecord {
+	std::int32_t eventID;
+	std::uint16_t siPMID;
+	std::uint8_t isCerenkov;
+	std::uint8_t reserved;
+	std::uint16_t nReflections;
+	std::uint16_t nReflectionsAtCoating;
+	float pathLength;				// optical path in the scintillator (mm)
+	float energy;					// eV
+	float time;						// ns
+	float weight;					// statistical weight (weighted yield mode), 1 otherwise
+};
+
+#pragma pack(pop)
+
+static constexpr std::uint32_t kPhotonRecordVersion = 1;
@@ -6,6 +6,11 @@
 #include "G4ThreeVector.hh"
 #include "globals.hh"
 
+#include "EdepStream.hh"
+#include "OpticsReplay.hh"
+#include "Trigger.hh"
+#include "Spill.hh"
+
 
 struct ParticleGunSettings {
     G4bool isActive;
@@ -32,6 +37,11 @@ struct PrimaryGeneratorActionParameters {
     G4String particleName;
     ParticleGunSettings particleGunSettings;
     GPSSettings gpsSettings;
+    G4String scintLVName;
+    EdepStreamReader* edepStreamReader; // only set in the two-stage replay, the primaries are then the regenerated optical photons
+    TriggerSettings triggerSettings;
+    G4ThreeVector scintHalfSize;        // the scintillator is centered in the origin, used by the geometric trigger
+    SpillSettings spillSettings;        // several muons per event, each with its own arrival time
 };
 
 class PrimaryGeneratorAction : public G4VUserPrimaryGeneratorAction {
@@ -45,8 +55,14 @@ private:
 
     void BuildParticleGun();
     void BuildGPS();
+    void GenerateReplayPrimaries(G4Event* anEvent);
+    G4double SampleSpillTime() const;
+    G4bool PrimariesCrossScintillator(const G4Event* anEvent) const;
     
 	PrimaryGeneratorActionParameters _primaryGeneratorActionParameters;
     G4ParticleGun* particleGun;
     G4GeneralParticleSource* gps;
+
+    OpticalPhotonReplayer* replayer = nullptr;
+    std::vector<EdepStepRecord> replaySteps; // reused from event to event
 };
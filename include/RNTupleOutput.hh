@@ -0,0 +1,47 @@
+#pragma once
+
+#include "globals.hh"
+
+#include "RunAction.hh"
+
+#include <memory>
+
+
+// RNTuple output backend (output.backend: rntuple in config.yaml).
+// The per-event rows (NtupleRow) are written to ROOT's RNTuple columnar format instead of the G4 ntuple,
+// in their own file <output file stem>_rntuple.root (the G4 file keeps the histograms).
+// Every worker thread gets its own fill context of a shared RNTupleParallelWriter, so the threads compress and
+// write their clusters independently and there is no ntuple merging at the end of the run.
+// It needs ROOT >= 6.36, HodoSim is built with it only when CMake finds it (HODOSIM_WITH_RNTUPLE).
+struct RNTupleSettings {
+	G4bool enabled;
+	G4String compression;		// zstd | lz4 | zlib | none
+	G4int compressionLevel;
+	G4int clusterSize;			// approximate compressed size of a cluster (MB)
+};
+
+// Shared by all the threads: the master opens and closes it, the workers fill it through their RunAction
+class RNTupleOutput
+{
+public:
+	// The optional fields follow the same flags of the G4 ntuple columns
+	RNTupleOutput(const RNTupleSettings& settings, const RunActionParameters& layout);
+	~RNTupleOutput();
+
+	static G4bool IsAvailable();	// false if HodoSim was built without ROOT
+
+	// Master only, once per run (the file is recreated like the G4 output file)
+	G4bool Open(const G4String& filename);
+	void Close();
+
+	// Worker only, the thread's fill context is created on the first row and bound to it
+	void Fill(NtupleRow& row);
+	void CloseThread();				// at the end of the run of every worker, before the master Close
+
+private:
+	struct Writer;
+	std::unique_ptr<Writer> _writer;
+
+	RNTupleSettings _settings;
+	RunActionParameters _layout;
+};
@@ -0,0 +1,52 @@
+#pragma once
+
+#include "G4OpBoundaryProcess.hh"
+#include "G4VPhysicsConstructor.hh"
+#include "G4LogicalBorderSurface.hh"
+
+#include <vector>
+
+
+// Reflection bookkeeping of the optical photons (optics.count_reflections in config.yaml).
+// The counters are incremented by the boundary process itself right after it has handled the step,
+// so nothing runs for the steps of the other particles and the SteppingAction doesn't need to look up the process.
+// When the counting is switched off the plain G4OpBoundaryProcess is left in place and the counters stay at 0.
+
+
+// Border surfaces the reflections are attributed to, filled by the DetectorConstruction when the geometry is built
+// (read-only afterwards, shared by all the threads)
+struct ReflectionSurfaces {
+	std::vector<const G4LogicalBorderSurface*> coating;		// scintillator <-> front/back coating
+
+	G4bool IsCoating(const G4LogicalBorderSurface* surface) const;
+};
+
+
+// G4OpBoundaryProcess counting the reflections in the OpticalPhotonTrackInfo of the photon.
+// nReflections counts every reflection (coating, SiPM faces, TIR at the uncoated faces),
+// nReflectionsAtCoating only the ones on a coating border surface.
+class ReflectionCountingBoundaryProcess : public G4OpBoundaryProcess
+{
+public:
+	ReflectionCountingBoundaryProcess(const ReflectionSurfaces* surfaces);
+
+	G4VParticleChange* PostStepDoIt(const G4Track& track, const G4Step& step) override;
+
+private:
+	const ReflectionSurfaces* _surfaces;
+};
+
+
+// Swaps the G4OpBoundaryProcess registered by G4OpticalPhysics with the counting one,
+// it must be registered after G4OpticalPhysics (ConstructProcess runs on every thread, in registration order)
+class ReflectionCountingPhysics : public G4VPhysicsConstructor
+{
+public:
+	ReflectionCountingPhysics(const ReflectionSurfaces* surfaces);
+
+	void ConstructParticle() override {}
+	void ConstructProcess() override;
+
+private:
+	const ReflectionSurfaces* _surfaces;
+};
@@ -3,12 +3,98 @@
 #include "G4UserRunAction.hh"
 #include "G4AnalysisManager.hh"
 #include "G4Timer.hh"
+#include "G4Accumulable.hh"
+
+#include "LightResponseTable.hh"
+#include "Trigger.hh"
+#include "TensorShards.hh"
+#include "SparseEncoding.hh"
+
+#include <vector>
+
+// Forward declaration
+class RNTupleOutput;
+class AsyncEventWriter;
+class OutputRotation;
+
+enum class PhotonLimit { GlobalTime, Reflections, PathLength };
 
 struct RunActionParameters {
 	G4bool enableCuts;
 	G4int sipmsPerSide;
 	G4String outputDir;
 	G4String outputFile;
+	LightResponseTableBuilder* lightResponseTableBuilder; // only set when building the fast optics table
+	G4bool enableWeightedYield;							// add the variance and effective sample size columns
+	G4bool enableStripMode;								// add the per-photon edge position columns
+	G4bool enableTrigger;								// print the trigger summary
+	G4int photonHistogramsPrescale;						// one detected photon in N goes to the per-photon histograms, 0 disables them
+	G4bool enableDigitizer;								// add the SiPM charge, time and time over threshold columns
+	G4bool storeWaveforms;								// add the digitized waveforms vector column
+	G4bool enableSpill;									// add the per-muon truth vector columns
+	G4bool enableSparse;								// zero-suppressed per-SiPM columns instead of the dense vectors
+	G4bool enablePerThreadFiles;						// every worker writes its ntuple to <file stem>_t<thread ID>, no merging through the master
+	RNTupleOutput* rntupleOutput;						// only set with the rntuple output backend, it replaces the G4 ntuple
+	AsyncEventWriter* asyncEventWriter;					// only set with the async output backend, it replaces the G4 ntuple
+	TensorShardSettings tensorShardSettings;			// .npy shards written by every worker next to the regular output
+	OutputRotation* outputRotation;						// only set with the rolling output, every run is a chunk with its own files
+};
+
+// Strip mode: edge (0-3) and position along the edge (fraction of its length) of every detected photon
+struct EdgeHitColumns {
+	std::vector<G4int> scintEdge;
+	std::vector<G4float> scintPosition;
+	std::vector<G4float> scintWeight;		// weighted yield mode, the Rebin tool sums the weights instead of counting the photons
+	std::vector<G4int> cerEdge;
+	std::vector<G4float> cerPosition;
+};
+
+// Spill mode: truth of every muon of the spill, in the order of the primaries (muon i has track ID i + 1).
+// The entry position and time are -1 for the muons that never entered the scintillator (the spill times are positive).
+struct SpillColumns {
+	std::vector<G4float> time;			// arrival time of the muon (vertex time, beam time structure)
+	std::vector<G4float> entryX;
+	std::vector<G4float> entryY;
+	std::vector<G4float> entryTime;
+	std::vector<G4float> scintEdep;
+	std::vector<G4float> scintOPs;		// detected photons summed over the SiPMs
+	std::vector<G4int> cerOPs;
+};
+
+// One row of the PerEventCollectedData ntuple, filled by the EventAction and written at once by RunAction::AddNtupleRow.
+// The per-SiPM quantities are vector columns bound to these members (one column per species instead of one per SiPM),
+// so a row costs a handful of fill calls whatever the number of SiPMs. Counts are integers, the kinematics floats.
+struct NtupleRow {
+	G4int eventID = 0;
+
+	// Detected photons per SiPM
+	std::vector<G4int> scintOPs;
+	std::vector<G4float> scintOPsWeighted;	// weighted yield mode, sum of the weights (bound as ScintOPs instead of the integer counts)
+	std::vector<G4float> scintOPsVariance;	// weighted yield mode, sum of the squared weights
+	std::vector<G4int> cerOPs;
+
+	// Muon truth (eV, mm, MeV, the exit position in the scintillator frame)
+	G4float scintEdep = 0.f;
+	G4float coatingEdep = 0.f;
+	G4float muPathLength = 0.f;
+	G4float muonHitX = 0.f;
+	G4float muonHitY = 0.f;
+	G4float muonExit[3] = {};
+	G4float muonExitDir[3] = {};
+	G4float muonExitEnergy = 0.f;
+
+	G4float effectiveSampleSize = 0.f;		// weighted yield mode
+
+	// SiPM digitizer (photoelectrons, ns with -1 below threshold, ns, ns with -1 without photons)
+	std::vector<G4float> siPMCharge;
+	std::vector<G4float> siPMTime;
+	std::vector<G4float> siPMToT;
+	std::vector<G4float> siPMFirstPhotonTime;
+	std::vector<G4float> waveforms;			// nSamples per SiPM
+
+	EdgeHitColumns edgeHits;
+	SpillColumns spill;
+	SparseColumns sparse;					// encoded from the dense vectors above when the sparse columns are enabled
 };
 
 class RunAction : public G4UserRunAction 
@@ -20,9 +106,52 @@ public:
 	void BeginOfRunAction(const G4Run* run) override;
 	void EndOfRunAction(const G4Run* run) override;
 
+	// Optical photon limits bookkeeping (called from the SteppingAction)
+	void CountOpticalPhoton() { nOpticalPhotons += 1; }
+	void CountKilledPhoton(PhotonLimit limit);
+
+	// Weighted yield bookkeeping (called from the EventAction)
+	void AddWeightedScintHits(G4double sumW, G4double sumW2) { scintHitsSumW += sumW; scintHitsSumW2 += sumW2; }
+
+	// Trigger bookkeeping (called from the EventAction)
+	void CountVetoedEvent(TriggerVeto veto);
+
+	// Per-thread row of the ntuple, the EventAction fills it and then adds it
+	NtupleRow& GetNtupleRow() { return ntupleRow; }
+	void AddNtupleRow();
+
+	// Rolling output: events of the previous chunks, the event IDs keep counting across them
+	G4int GetEventIDOffset() const { return eventIDOffset; }
+
 private:
+	void BookNtuple();
+	void PrintPhotonLimitsSummary();
+	void PrintWeightedYieldSummary();
+	void PrintTriggerSummary(const G4Run* run);
+
 	RunActionParameters _runActionParameters;
 
+	// Merged over the workers at the end of the run
+	G4Accumulable<G4double> nOpticalPhotons = 0.;
+	G4Accumulable<G4double> nKilledByTime = 0.;
+	G4Accumulable<G4double> nKilledByReflections = 0.;
+	G4Accumulable<G4double> nKilledByPathLength = 0.;
+	G4Accumulable<G4double> scintHitsSumW = 0.;
+	G4Accumulable<G4double> scintHitsSumW2 = 0.;
+	G4Accumulable<G4double> nVetoedByGeometry = 0.;
+	G4Accumulable<G4double> nVetoedByEdep = 0.;
+	G4Accumulable<G4double> nVetoedByMuonHit = 0.;
+
+	// The vector columns are bound to the row, the scalar ones are filled from it by ID
+	NtupleRow ntupleRow;
+	TensorShardWriter* tensorShards = nullptr;	// threads filling rows only, from the first row to the end of the run
+	std::string tensorShardDir;
+	std::string tensorShardPrefix;
+	G4int eventIDOffset = 0;
+	G4int eventIDColumn = -1;
+	G4int truthColumn = -1;					// first of the 12 consecutive float truth columns
+	G4int effectiveSampleSizeColumn = -1;
+
 	G4AnalysisManager* analysisManager;
 	G4Timer* timer;
 };
\ No newline at end of file
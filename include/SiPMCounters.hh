@@ -0,0 +1,79 @@
+#pragma once
+
+#include "G4VHitsCollection.hh"
+#include "globals.hh"
+
+#include <vector>
+
+
+// Detected photons of an event summed per SiPM.
+// This is all the EventAction needs to fill the ntuple, so the SD increments these counters directly
+// instead of allocating an OpticalPhotonHit per photon (the hits collection is kept as a debug option).
+struct SiPMCounts {
+	SiPMCounts(G4int nSiPMs = 0) : scintHits(nSiPMs, 0.), scintHitsW2(nSiPMs, 0.), cerHits(nSiPMs, 0) {}
+
+	std::vector<G4double> scintHits;		// sum of the weights
+	std::vector<G4double> scintHitsW2;		// sum of the squared weights
+	std::vector<G4int> cerHits;
+
+	// Strip mode only, edge and position along the edge of every detected photon (see RunAction::EdgeHitColumns)
+	std::vector<G4int> scintEdge;
+	std::vector<G4double> scintPosition;
+	std::vector<G4double> scintWeight;		// written in the weighted yield mode only
+	std::vector<G4int> cerEdge;
+	std::vector<G4double> cerPosition;
+
+	// Digitizer only, SiPM, arrival time and weight of every detected photon (scintillation and Cerenkov)
+	std::vector<G4int> photonSiPM;
+	std::vector<G4double> photonTime;
+	std::vector<G4double> photonWeight;
+
+	// Spill mode only, detected photons summed over the SiPMs per muon (indexed like the primaries, track ID - 1)
+	std::vector<G4double> muonScintHits;
+	std::vector<G4int> muonCerHits;
+
+	void ResizeMuons(size_t nMuons)
+	{
+		if (muonScintHits.size() >= nMuons) return;
+		muonScintHits.resize(nMuons, 0.);
+		muonCerHits.resize(nMuons, 0);
+	}
+
+	void Add(const SiPMCounts& other)
+	{
+		for (size_t i = 0; i < scintHits.size() && i < other.scintHits.size(); i++)
+		{
+			scintHits[i] += other.scintHits[i];
+			scintHitsW2[i] += other.scintHitsW2[i];
+			cerHits[i] += other.cerHits[i];
+		}
+		scintEdge.insert(scintEdge.end(), other.scintEdge.begin(), other.scintEdge.end());
+		scintPosition.insert(scintPosition.end(), other.scintPosition.begin(), other.scintPosition.end());
+		scintWeight.insert(scintWeight.end(), other.scintWeight.begin(), other.scintWeight.end());
+		cerEdge.insert(cerEdge.end(), other.cerEdge.begin(), other.cerEdge.end());
+		cerPosition.insert(cerPosition.end(), other.cerPosition.begin(), other.cerPosition.end());
+		photonSiPM.insert(photonSiPM.end(), other.photonSiPM.begin(), other.photonSiPM.end());
+		photonTime.insert(photonTime.end(), other.photonTime.begin(), other.photonTime.end());
+		photonWeight.insert(photonWeight.end(), other.photonWeight.begin(), other.photonWeight.end());
+		ResizeMuons(other.muonScintHits.size());
+		for (size_t m = 0; m < other.muonScintHits.size(); m++)
+		{
+			muonScintHits[m] += other.muonScintHits[m];
+			muonCerHits[m] += other.muonCerHits[m];
+		}
+	}
+};
+
+
+// The counters travel in the G4HCofThisEvent like any other collection (one allocation per event)
+class SiPMCountersCollection : public G4VHitsCollection
+{
+public:
+	SiPMCountersCollection(const G4String& sdName, const G4String& collectionName, G4int nSiPMs)
+		: G4VHitsCollection(sdName, collectionName), counts(nSiPMs) {}
+
+	SiPMCounts counts;
+};
+
+// Name of the counters collection registered by the SiliconPMSD
+static const G4String kSiPMCountersName = "SiPMCounters";
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "G4VDigi.hh"
+#include "G4TDigiCollection.hh"
+#include "G4Allocator.hh"
+
+
+// Digitized response of one SiPM in an event (see SiPMDigitizer)
+class SiPMDigi : public G4VDigi
+{
+public:
+	SiPMDigi();
+	~SiPMDigi();
+
+	inline void* operator new(size_t);
+	inline void operator delete(void* digi);
+
+	void SetSiPMID(G4int siPMID) { _siPMID = siPMID; }
+	void SetCharge(G4double charge) { _charge = charge; }
+	void SetTime(G4double time) { _time = time; }
+	void SetTimeOverThreshold(G4double timeOverThreshold) { _timeOverThreshold = timeOverThreshold; }
+	void SetFirstPhotonTime(G4double firstPhotonTime) { _firstPhotonTime = firstPhotonTime; }
+	void SetNAvalanches(G4int nAvalanches) { _nAvalanches = nAvalanches; }
+
+	G4int GetSiPMID() const { return _siPMID; }
+	G4double GetCharge() const { return _charge; }
+	G4double GetTime() const { return _time; }
+	G4double GetTimeOverThreshold() const { return _timeOverThreshold; }
+	G4double GetFirstPhotonTime() const { return _firstPhotonTime; }
+	G4int GetNAvalanches() const { return _nAvalanches; }
+
+private:
+	G4int _siPMID = -1;
+	G4double _charge = 0.;				// integral of the waveform, in photoelectrons
+	G4double _time = -1.;				// leading edge threshold crossing, -1 if the threshold is never crossed
+	G4double _timeOverThreshold = 0.;
+	G4double _firstPhotonTime = -1.;	// earliest detected photon (true arrival time, no dark counts), -1 without photons
+	G4int _nAvalanches = 0;				// photons, crosstalk, afterpulses and dark counts in the window
+};
+
+typedef G4TDigiCollection<SiPMDigi> SiPMDigiCollection;
+
+// Memory allocation handler, one digi per SiPM per event
+extern G4ThreadLocal G4Allocator<SiPMDigi>* SiPMDigiAllocator;
+
+inline void* SiPMDigi::operator new(size_t)
+{
+	if (!SiPMDigiAllocator) SiPMDigiAllocator = new G4Allocator<SiPMDigi>;
+	return (void*)SiPMDigiAllocator->MallocSingle();
+}
+
+inline void SiPMDigi::operator delete(void* digi)
+{
+	SiPMDigiAllocator->FreeSingle((SiPMDigi*)digi);
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "G4VDigitizerModule.hh"
+#include "globals.hh"
+
+#include "SiPMCounters.hh"
+#include "SiPMDigi.hh"
+
+#include <vector>
+
+
+// SiPM response (sipm.digitizer in config.yaml).
+// The photon arrival times collected by the SiliconPMSD are turned into avalanches (crosstalk, afterpulses and dark counts
+// included), the avalanches are scaled for the microcell saturation and convolved with the single photoelectron pulse
+// into a sampled waveform per SiPM. The charge, the leading edge time and the time over threshold are taken from the waveform.
+// All the amplitudes are in photoelectrons (a single avalanche peaks at 1).
+struct SiPMDigitizerSettings {
+	G4bool enabled;
+	G4bool storeWaveforms;				// also write the waveforms (nSamples per SiPM) in a vector column
+	G4double windowStart;				// time of the first sample
+	G4double sampleWidth;
+	G4int nSamples;
+	G4double riseTime;					// single photoelectron pulse, difference of two exponentials
+	G4double fallTime;
+	G4int nCells;						// microcells per SiPM
+	G4double crosstalkProbability;		// each avalanche triggers a neighbour cell with this probability (chained)
+	G4double afterpulseProbability;
+	G4double afterpulseTimeConstant;
+	G4double recoveryTime;				// the afterpulse amplitude is 1 - exp(-delay / recoveryTime)
+	G4double darkCountRate;				// per SiPM
+	G4double noiseSigma;				// electronic noise per sample
+	G4double threshold;					// leading edge discriminator
+};
+
+
+// One module per thread, registered to the G4DigiManager by the EventAction.
+// The buffers are allocated once and reused by every event.
+class SiPMDigitizer : public G4VDigitizerModule
+{
+public:
+	SiPMDigitizer(const G4String& name, const SiPMDigitizerSettings& settings, G4int nSiPMs);
+	~SiPMDigitizer() override = default;
+
+	// The EventAction hands the counters of the event (sub-events already merged) before calling G4DigiManager::Digitize
+	void SetCounts(const SiPMCounts* counts) { _counts = counts; }
+
+	void Digitize() override;
+
+	// Waveforms of the last digitized event, nSamples per SiPM
+	const std::vector<G4float>& GetWaveforms() const { return waveforms; }
+
+	static const G4String kDigiCollectionName;
+
+private:
+	void BuildAvalanches(G4int siPMID);
+	void Convolve();
+	void Discriminate(SiPMDigi* digi) const;
+
+	SiPMDigitizerSettings _settings;
+	G4int _nSiPMs;
+	const SiPMCounts* _counts = nullptr;
+
+	std::vector<G4double> kernel;			// single photoelectron pulse, sampled
+	G4double kernelIntegral = 1.;
+
+	// Scratch buffers
+	std::vector<std::vector<G4double>> photonTimes;			// per SiPM
+	std::vector<std::vector<G4double>> photonAmplitudes;
+	std::vector<G4double> avalancheTimes;
+	std::vector<G4double> avalancheAmplitudes;
+	std::vector<G4double> binnedAmplitudes;		// avalanches per sample
+	std::vector<G4double> waveform;				// current SiPM
+
+	std::vector<G4float> waveforms;			// all the SiPMs
+};
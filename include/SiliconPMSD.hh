@@ -7,20 +7,82 @@
 #include "G4Step.hh"
 
 #include "OpticalPhotonHit.hh"
+#include "SiPMCounters.hh"
+#include "LightResponseTable.hh"
+#include "PhotonRecord.hh"
+#include "HotPathDispatch.hh"
+#include "PhotonHistograms.hh"
+
+#include <vector>
+
+
+// Forward declaration
+class BoxOpticsModel;
 
 
 class SiliconPMSD : public G4VSensitiveDetector
 {
 public:
-	SiliconPMSD(const G4String& name, G4String cName);
+	// The detected photons are summed in the per-SiPM counters collection (kSiPMCountersName),
+	// the OpticalPhotonHit collection (cName) is only filled when storeHits is set, for debugging.
+	SiliconPMSD(const G4String& name, G4String cName, G4int nSiPMs, G4bool storeHits, LightResponseTableBuilder* lightResponseTableBuilder = nullptr, PhotonRecordWriter* photonRecordWriter = nullptr);
 	~SiliconPMSD();
 
 	void Initialize(G4HCofThisEvent* hce) override;
 	G4bool ProcessHits(G4Step* step, G4TouchableHistory* history) override;
 	void EndOfEvent(G4HCofThisEvent* hce) override;
 
+	// Stores a detected photon in the counters (and the hits collection).
+	// It is used by ProcessHits and by the analytic optics model, which detects photons without tracking them into the SiPMs.
+	void RecordPhoton(
+		G4int eventID,
+		G4int siPMID,
+		OpticalPhotonOrigin origin,
+		G4double edep,
+		G4double time,
+		const G4ThreeVector& position,
+		const G4ThreeVector& emissionPosition,
+		G4int nReflections,
+		G4int nReflectionsAtCoating,
+		G4double pathLength,
+		G4double weight = 1.,
+		G4double edgePosition = -1.,
+		G4int muonIndex = -1		// spill mode only, muon the photon descends from
+	);
+
+	void SetBoxOpticsModel(BoxOpticsModel* model) { _boxOpticsModel = model; }
+
+	// Photon records mode: writes the records of the event (or drops them, for the events vetoed by the trigger).
+	// Called by the EventAction after the trigger decision, for every event the SD has seen.
+	void FlushPhotonRecords(G4bool write);
+
+	// Strip mode: the SiPM volumes are one continuous strip per edge (the copy number is the edge),
+	// each detected photon is assigned to one of sipmsPerSide virtual SiPMs from its position along the edge
+	void SetStripMode(G4int sipmsPerSide, G4double halfX, G4double halfY);
+
+	// Digitizer: the arrival time of every detected photon is kept in the counters
+	void SetStoreArrivalTimes(G4bool storeArrivalTimes) { _storeArrivalTimes = storeArrivalTimes; }
+
 private:
 	G4String _cName;
+	G4int _nSiPMs;
+	G4bool _storeHits;
 	G4THitsCollection<OpticalPhotonHit>* opHitsCollection;
-	G4int hcID; // cache the hit collection ID to improve performances
+	SiPMCountersCollection* countersCollection;
+	G4int hcID = -1; // cache the hit collection IDs to improve performances
+	G4int countersHCID = -1;
+	G4int _eventID = 0;
+
+	LightResponseTableBuilder* _lightResponseTableBuilder;
+	BoxOpticsModel* _boxOpticsModel = nullptr;
+	PhotonHistograms* _photonHistograms = nullptr;
+
+	G4int _stripSiPMsPerSide = 0; // 0 unless the strip mode is on
+	G4double _halfX = 0., _halfY = 0.;
+
+	G4bool _storeArrivalTimes = false;
+
+	// Detected photons of the current event, written at the end of the event
+	PhotonRecordWriter* _photonRecordWriter;
+	std::vector<DetectedPhotonRecord> photonRecords;
 };
\ No newline at end of file
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "globals.hh"
+
+#include <vector>
+
+// Forward declaration
+struct NtupleRow;
+
+
+// Zero-suppressed per-SiPM columns (output.sparse in config.yaml).
+// Most SiPMs see no photon in most events, so every group of per-SiPM quantities is written as a <Group>Channels
+// index column plus one <Quantity>Values column per quantity, chosen event by event:
+//  - sparse: Channels lists the SiPMs with a hit (increasing order), Values the matching values
+//  - dense: Channels is empty and Values holds every SiPM, used when more than maxOccupancy of the SiPMs have a hit
+//    (a (channel, value) pair costs two words, above half occupancy the plain vector is smaller)
+// An event with no hit has both empty, the SiPMs not listed keep their default (0 photons, -1 ns for the SiPMTime and SiPMFirstPhotonTime).
+// The groups are ScintOPs (ScintOPsValues and, in the weighted yield mode, ScintOPsVarianceValues), CerOPs (CerOPsValues)
+// and SiPM for the digitizer (SiPMChargeValues, SiPMTimeValues, SiPMToTValues, SiPMFirstPhotonTimeValues, a hit is a SiPM that fired
+// the discriminator or detected a photon).
+// The photon counts are lossless. The digitizer group is lossy: the charge of the SiPMs without a hit (electronic noise,
+// dark counts below threshold) is not stored and decodes to 0, a dense event keeps it.
+// The dense ScintOPs/CerOPs/SiPM* columns are not written, PlotPredict decodes both forms.
+struct SparseEncodingSettings {
+	G4bool enabled;
+	G4double maxOccupancy;	// fraction of the SiPMs with a hit above which the event is stored dense
+};
+
+struct SparseColumns {
+	std::vector<G4int> scintChannels;
+	std::vector<G4int> scintValues;
+	std::vector<G4float> scintValuesWeighted;	// weighted yield mode, instead of the integer values
+	std::vector<G4float> scintVariance;			// weighted yield mode
+	std::vector<G4int> cerChannels;
+	std::vector<G4int> cerValues;
+	std::vector<G4int> siPMChannels;				// digitizer
+	std::vector<G4float> siPMCharge;
+	std::vector<G4float> siPMTime;
+	std::vector<G4float> siPMToT;
+	std::vector<G4float> siPMFirstPhotonTime;
+};
+
+// Encodes the dense per-SiPM vectors of the row into row.sparse (called by the EventAction once the row is filled)
+void EncodeSparseColumns(NtupleRow& row, G4double maxOccupancy, G4bool weightedYield, G4bool digitizer);
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "globals.hh"
+
+#include <vector>
+
+
+// Spill mode.
+// Every G4Event is a beam spill holding a Poisson number of muons, each one with its own arrival time,
+// so intensity and pileup can be studied while the per-event overhead (SD/HC setup, ntuple row, digitization)
+// is paid once per spill instead of once per muon.
+// The muons are the primaries of the event, tracked in the order they were generated: muon i has track ID i + 1
+// (one primary per muon, main.cc rejects two active sources or a particle gun firing several particles).
+// The arrival times follow the beam time structure:
+//  - bunchSpacing == 0: uniform over the spill duration
+//  - bunchSpacing > 0: the muon picks one of the duration / bunchSpacing bunches (centered in their slot), gaussian smeared by bunchWidth
+struct SpillSettings {
+	G4bool enabled;
+	G4double meanMuons;		// mean number of muons per spill
+	G4double duration;
+	G4double bunchSpacing;	// 0 = no bunch structure
+	G4double bunchWidth;	// sigma of the arrival time in a bunch
+};
+
+
+// Primary muon each track descends from, so the detected photons can be attributed to their muon.
+// A parent is always tracked before its secondaries, so the TrackingAction registers every non-optical track
+// when it starts and the photon ancestry is resolved from its parent. The table is per thread and cleared every event.
+class SpillAncestry
+{
+public:
+	static void Reset();
+	static void Register(G4int trackID, G4int parentID);
+
+	// Index of the muon (track ID - 1) the track with this ID descends from, -1 if it is unknown (spill mode off)
+	static G4int GetMuonIndex(G4int trackID);
+
+private:
+	static std::vector<G4int>& Table();
+};
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "G4UserStackingAction.hh"
+#include "G4PhysicsFreeVector.hh"
+#include "G4Track.hh"
+
+#include "Trigger.hh"
+
+#include <vector>
+
+
+// Forward declaration
+class EventAction;
+
+
+// Reduced-yield optical mode: the scintillator only emits a fraction of its photons (see DetectorConstruction)
+// and every scintillation photon carries the statistical weight 1/fraction, so the weighted SiPM counts
+// are unbiased estimators of the full-yield counts.
+struct WeightedYieldSettings {
+	G4bool enabled;
+	G4double fraction;		// fraction of the scintillation photons actually generated, in (0, 1]
+};
+
+struct StackingActionParameters {
+	G4bool enablePDEThinning;			// kill at birth the optical photons that the SiPMs would not detect anyway
+	G4double fillFactor;				// fraction of the SiPM surface covered by active microcells
+	std::vector<G4double> pdeEnergies;	// photon energies of the PDE curve
+	std::vector<G4double> pdeValues;	// photon detection efficiency at pdeEnergies
+	WeightedYieldSettings weightedYieldSettings;
+	G4bool enableSubEvents;				// the optical photons are shipped to the other threads as sub-events
+	TriggerSettings triggerSettings;	// with an edep threshold the optical photons wait for the trigger decision
+};
+
+class StackingAction : public G4UserStackingAction
+{
+public:
+	StackingAction(StackingActionParameters stackingActionParameters, EventAction* eventAction);
+	~StackingAction();
+
+	G4ClassificationOfNewTrack ClassifyNewTrack(const G4Track* track) override;
+	void NewStage() override;
+
+private:
+	StackingActionParameters _stackingActionParameters;
+	EventAction* _eventAction = nullptr;
+	G4PhysicsFreeVector* pde = nullptr;
+	G4double scintPhotonWeight = 1.;
+	G4bool deferOptics = false;
+};
@@ -3,22 +3,50 @@
 #include "G4UserSteppingAction.hh"
 #include "G4Track.hh"
 #include "G4Step.hh"
+#include "G4LogicalVolume.hh"
+
+
+// Forward declaration
+class EventAction;
+class RunAction;
+
+
+// Per-photon limits, optical photons exceeding any of them are killed (a value of 0 disables the limit).
+// They cut the long tail of photons bouncing between the polished faces well after the SiPM integration window.
+struct PhotonLimits {
+	G4double maxGlobalTime;
+	G4int maxReflections;
+	G4double maxPathLength;
+};
 
 struct SteppingActionParameters {
 	G4String scintLVName;
+	G4bool enableFastOptics;	// forward the scintillator edep steps to the fast optics sampling
+	G4bool enableEdepRecording;	// forward the scintillator steps to the two-stage stream (stage 1)
+	G4bool enablePhotonRecords;	// accumulate the optical path in the scintillator for the detected photon records
+	PhotonLimits photonLimits;
 };
 
 class SteppingAction : public G4UserSteppingAction
 {
 public:
-	SteppingAction(SteppingActionParameters steppingActionParameters);
+	SteppingAction(SteppingActionParameters steppingActionParameters, EventAction* eventAction, RunAction* runAction);
 	~SteppingAction();
 	void UserSteppingAction(const G4Step* step) override;
 
 private:
 	
-	void ProcessOPReflections(const G4Track* track, const G4Step* step);
 	void ProcessMuPosition(const G4Track* track, const G4Step* step);
+	void ProcessMuScoring(const G4Track* track, const G4Step* step);
+	void ProcessScintDeposit(const G4Step* step);
+	void ProcessOPLimits(G4Track* track);
+	void ProcessOPPathLength(const G4Track* track, const G4Step* step);
+	const G4LogicalVolume* GetScintLV();
 
 	SteppingActionParameters _steppingActionParameters;
+	EventAction* _eventAction = nullptr;
+	RunAction* _runAction = nullptr;
+	G4bool enablePhotonLimits = false;
+
+	G4LogicalVolume* scintLV = nullptr; // looked up once per thread, on the first step
 };
\ No newline at end of file
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "G4VUserEventInformation.hh"
+#include "G4ClassificationOfNewTrack.hh"
+#include "globals.hh"
+
+#include "SiPMCounters.hh"
+
+
+// Sub-event parallel mode (G4SubEvtRunManager).
+// With a single muon per event all its optical photons are tracked by the thread that handles the muon,
+// so a long event keeps one thread busy while the others wait. In this mode the thread tracking the muon
+// ships the optical photons to the other threads in batches (sub-events), the detected photons are
+// merged back into the muon event before its EndOfEventAction.
+struct SubEventSettings {
+	G4bool enabled;
+	G4int photonsPerSubEvent;	// maximum number of optical photons in a sub-event
+};
+
+// The optical photons are the only sub-event type
+static constexpr G4int kOpticalPhotonSubEventType = 0;
+static constexpr G4ClassificationOfNewTrack kOpticalPhotonSubEvent = fSubEvent_0;
+
+
+// Detected photons of the sub-events, attached to the muon event and filled by EventAction::MergeSubEvent
+class SubEventHits : public G4VUserEventInformation
+{
+public:
+	SubEventHits(G4int nSiPMs) : counts(nSiPMs) {}
+	~SubEventHits() override = default;
+
+	void Print() const override {}
+
+	SiPMCounts counts;
+};
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "globals.hh"
+
+#include <cstdint>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Forward declaration
+struct NtupleRow;
+
+
+// ML-ready export of the per-event data (output.tensor_shards in config.yaml).
+// Besides the regular output, every worker writes row-major float32 .npy shards with what the training loop
+// and PlotPredict feed to the network, so they can be memory-mapped without any conversion:
+//  - <name>_X.npy, [N x nSiPMs] log1p of the scintillation counts (sums of the weights in the weighted yield mode)
+//  - <name>_Y.npy, [N x 2] muon hit position MuonHitX, MuonHitY (mm)
+// The events are split into train/val/test by a hash of the EventID (the same event always lands in the same split),
+// the shards are in <output dir>/<output file stem>_shards/<split>/ and hold at most eventsPerShard rows each.
+struct TensorShardSettings {
+	G4bool enabled;
+	G4int eventsPerShard;
+	G4double valFraction;
+	G4double testFraction;
+};
+
+
+// Per-thread writer, owned by the worker RunAction for the duration of a run (no locks, one set of files per thread)
+class TensorShardWriter
+{
+public:
+	TensorShardWriter(const TensorShardSettings& settings, G4int nFeatures, G4bool weightedCounts, const G4String& directory, const G4String& prefix);
+	~TensorShardWriter();
+
+	void Add(const NtupleRow& row);
+
+private:
+	enum Split { Train, Val, Test, nSplits };
+
+	struct Shard {
+		std::ofstream x;
+		std::ofstream y;
+		std::uint64_t nRows = 0;
+		G4int index = 0;
+	};
+
+	Split GetSplit(G4int eventID) const;
+	void OpenShard(Split split);
+	void CloseShard(Split split);
+
+	TensorShardSettings _settings;
+	G4int _nFeatures;
+	G4bool _weightedCounts;
+	std::string _directory;
+	std::string _prefix;
+
+	Shard shards[nSplits];
+	std::vector<float> features;	// row buffer
+};
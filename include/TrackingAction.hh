@@ -2,12 +2,19 @@
 
 #include "G4UserTrackingAction.hh"
 
+#include "LightResponseTable.hh"
+#include "OpticalPhotonTrackInfo.hh"
+
 
 // Forward declaration
 class EventAction; 
 
 
-struct TrackingActionParameters {};
+struct TrackingActionParameters {
+	LightResponseTableBuilder* lightResponseTableBuilder; // only set when building the fast optics table
+	PhotonTrackInfoMode photonTrackInfoMode;
+	G4bool enableSpill;									// register the muon ancestry of every track (see SpillAncestry)
+};
 
 class TrackingAction : public G4UserTrackingAction
 {
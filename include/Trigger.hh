@@ -0,0 +1,21 @@
+#pragma once
+
+#include "globals.hh"
+
+
+// Event-level trigger.
+// With beams near the plate edge many muons never enter the scintillator, those events would only produce
+// rows with no optical signal and a bogus muon hit position. A vetoed event is aborted as early as possible,
+// it is not written to any output and it is only counted in the run summary.
+//  - geometric check: the straight line of every primary is extrapolated onto the scintillator box
+//    before the event is tracked (PrimaryGeneratorAction), no particle is tracked at all if none crosses it
+//  - edep threshold: the optical photons wait until the charged particles are tracked, then the event is aborted
+//    (StackingAction::NewStage) if the primary muon deposited less than the threshold in the scintillator
+//  - finally, an event whose muon never entered the scintillator is vetoed in the EventAction
+struct TriggerSettings {
+	G4bool enabled;
+	G4bool geometricCheck;
+	G4double edepThreshold;		// 0 disables the threshold
+};
+
+enum class TriggerVeto { Geometry, Edep, NoMuonHit };
@@ -19,6 +19,7 @@ public:
 	static int as_int(ryml::NodeRef node);
 	static std::string as_string(ryml::NodeRef node);
 	static bool as_bool(ryml::NodeRef node);
+	static std::vector<double> as_double_vector(ryml::NodeRef node);
 
 	ryml::NodeRef getRoot() const { return root; };
 	bool isLoaded() const { return loaded; }
@@ -11,6 +11,16 @@
 #include "SteppingAction.hh"
 #include "ActionInitialization.hh"
 #include "YAMLParser.hh"
+#include "LightResponseTable.hh"
+#include "EdepStream.hh"
+#include "PhotonRecord.hh"
+#include "SubEventParallel.hh"
+#include "ReflectionCounting.hh"
+#include "SiPMDigitizer.hh"
+#include "RNTupleOutput.hh"
+#include "AsyncEventWriter.hh"
+#include "OutputRotation.hh"
+#include "PhotonHistograms.hh"
 
 // Physics 
 #include "G4PhysListFactory.hh"
@@ -18,6 +28,7 @@
 #include "G4OpticalPhysics.hh"
 #include "G4OpticalParameters.hh"
 #include "G4ParallelWorldPhysics.hh"
+#include "G4FastSimulationPhysics.hh"
 
 // Visualization and UI
 #include "G4VisExecutive.hh"
@@ -115,17 +126,39 @@ int main(int argc, char** argv) {
 
 	G4String siliconPMSDName = "/SiliconPM";
 	G4String scintLVName = "ScintLogic";
+	G4String coatingLVName = "CoatLogic";	// (the name is fixed in DetectorConstruction::BuildGeometry)
 	G4String opCName = "OpticalPhotonHitsCollection";
 	G4String particleName = "mu-";
 
 	// Forward declaration of simulation parameters
 	G4String outputDir, outputFile;
+	G4int photonHistogramsPrescale;
+	G4bool perThreadFiles;
+	RNTupleSettings rntupleSettings;
+	AsyncOutputSettings asyncOutputSettings;
+	TensorShardSettings tensorShardSettings;
+	SparseEncodingSettings sparseEncodingSettings;
+	OutputRotationSettings outputRotationSettings;
 	G4double worldSizeXYZ, gap, coatingThickness, siPMThickness;
 	BoxGeometry scintGeometry;
 	ScintillatorProperties scintData;
 	G4int sipmsPerSide;
+	G4bool sipmStripMode;
+	G4bool sipmStoreHits;
+	SiPMDigitizerSettings digitizerSettings;
 	ParticleGunSettings gunSettings;
 	GPSSettings gpsSettings;
+	FastOpticsSettings fastOpticsSettings;
+	AnalyticOpticsSettings analyticOpticsSettings;
+	StackingActionParameters stackingActionParameters;
+	PhotonLimits photonLimits;
+	TwoStageSettings twoStageSettings;
+	PhotonRecordSettings photonRecordSettings;
+	SubEventSettings subEventSettings;
+	PhotonTrackInfoMode photonTrackInfoMode;
+	G4bool countReflections;
+	TriggerSettings triggerSettings;
+	SpillSettings spillSettings;
 
 	if (enableParamsFromConfigFile) {
 		// Parameters are imported from an external YAML config file
@@ -171,11 +204,40 @@ int main(int argc, char** argv) {
 			parser.as_double(parser.require(scintDataNode, "wl_right")) * eV,
 			parser.as_double(parser.require(scintDataNode, "decay_time")) * ns,
 			parser.as_double(parser.require(scintDataNode, "r_index")),
-			parser.as_double(parser.require(scintDataNode, "abs_length")) * mm
+			parser.as_double(parser.require(scintDataNode, "abs_length")) * mm,
+			1.  // generationFraction, set below from optics.weighted_yield
 		};
 
 		siPMThickness = parser.as_double(parser.require(sipmNode, "thickness")) * mm;
 		sipmsPerSide = parser.as_int(parser.require(sipmNode, "sipms_per_side"));
+		sipmStripMode = parser.as_bool(parser.require(sipmNode, "strip_mode"));
+		sipmStoreHits = parser.as_bool(parser.require(sipmNode, "store_hits"));
+
+		auto digitizerNode = parser.require(sipmNode, "digitizer");
+
+		digitizerSettings = {
+			parser.as_bool(parser.require(digitizerNode, "enabled")),
+			parser.as_bool(parser.require(digitizerNode, "store_waveforms")),
+			parser.as_double(parser.require(digitizerNode, "window_start")) * ns,
+			parser.as_double(parser.require(digitizerNode, "sample_width")) * ns,
+			parser.as_int(parser.require(digitizerNode, "samples")),
+			parser.as_double(parser.require(digitizerNode, "rise_time")) * ns,
+			parser.as_double(parser.require(digitizerNode, "fall_time")) * ns,
+			parser.as_int(parser.require(digitizerNode, "cells")),
+			parser.as_double(parser.require(digitizerNode, "crosstalk_probability")),
+			parser.as_double(parser.require(digitizerNode, "afterpulse_probability")),
+			parser.as_double(parser.require(digitizerNode, "afterpulse_time_constant")) * ns,
+			parser.as_double(parser.require(digitizerNode, "recovery_time")) * ns,
+			parser.as_double(parser.require(digitizerNode, "dark_count_rate")) * megahertz,
+			parser.as_double(parser.require(digitizerNode, "noise_sigma")),
+			parser.as_double(parser.require(digitizerNode, "threshold"))
+		};
+
+		if (digitizerSettings.enabled && (digitizerSettings.nSamples <= 0 || digitizerSettings.sampleWidth <= 0 || digitizerSettings.fallTime <= 0))
+		{
+			G4cerr << "[HodoSim] Error: the SiPM digitizer needs samples, sample_width and fall_time > 0." << G4endl;
+			return 1;
+		}
 		coatingThickness = parser.as_double(parser.require(coatingNode, "thickness")) * mm;
 
 		// Primary Generator
@@ -226,10 +288,249 @@ int main(int argc, char** argv) {
 			parser.as_double(parser.require(gpsNode, "beam_aperture_y"))
 		};
 
+		auto spillNode = parser.require(primaryGenNode, "spill");
+
+		spillSettings = {
+			parser.as_bool(parser.require(spillNode, "enabled")),
+			parser.as_double(parser.require(spillNode, "mean_muons")),
+			parser.as_double(parser.require(spillNode, "duration")) * ns,
+			parser.as_double(parser.require(spillNode, "bunch_spacing")) * ns,
+			parser.as_double(parser.require(spillNode, "bunch_width")) * ns
+		};
+
+		if (spillSettings.enabled && (spillSettings.meanMuons <= 0 || spillSettings.duration <= 0))
+		{
+			G4cerr << "[HodoSim] Error: spill mean_muons and duration must be > 0." << G4endl;
+			return 1;
+		}
+
+		// Trigger
+		auto triggerNode = parser.require(root, "trigger");
+
+		triggerSettings = {
+			parser.as_bool(parser.require(triggerNode, "enabled")),
+			parser.as_bool(parser.require(triggerNode, "geometric_check")),
+			parser.as_double(parser.require(triggerNode, "edep_threshold")) * MeV
+		};
+
+		// Optics
+		auto opticsNode = parser.require(root, "optics");
+		auto fastOpticsNode = parser.require(opticsNode, "fast_optics");
+
+		G4String fastOpticsMode = parser.as_string(parser.require(fastOpticsNode, "mode"));
+		if (fastOpticsMode != "off" && fastOpticsMode != "build" && fastOpticsMode != "use")
+		{
+			G4cerr << "[HodoSim] Error: invalid fast_optics mode '" << fastOpticsMode << "' (expected off, build or use)." << G4endl;
+			return 1;
+		}
+
+		fastOpticsSettings = {
+			fastOpticsMode == "build",
+			fastOpticsMode == "use",
+			parser.as_string(parser.require(fastOpticsNode, "table_file")),
+			parser.as_int(parser.require(fastOpticsNode, "grid")[0]),
+			parser.as_int(parser.require(fastOpticsNode, "grid")[1]),
+			parser.as_int(parser.require(fastOpticsNode, "grid")[2])
+		};
+
+		auto analyticOpticsNode = parser.require(opticsNode, "analytic_optics");
+
+		analyticOpticsSettings = {
+			parser.as_bool(parser.require(analyticOpticsNode, "enabled")),
+			parser.as_int(parser.require(analyticOpticsNode, "batch_size"))
+		};
+
+		auto pdeThinningNode = parser.require(opticsNode, "pde_thinning");
+
+		std::vector<G4double> pdeEnergies = parser.as_double_vector(parser.require(pdeThinningNode, "pde_energies"));
+		for (auto& energy : pdeEnergies) energy *= eV;
+
+		stackingActionParameters = {
+			parser.as_bool(parser.require(pdeThinningNode, "enabled")),
+			parser.as_double(parser.require(pdeThinningNode, "fill_factor")),
+			pdeEnergies,
+			parser.as_double_vector(parser.require(pdeThinningNode, "pde_values")),
+			WeightedYieldSettings{}
+		};
+
+		if (stackingActionParameters.pdeEnergies.size() != stackingActionParameters.pdeValues.size() || stackingActionParameters.pdeEnergies.size() < 2)
+		{
+			G4cerr << "[HodoSim] Error: pde_energies and pde_values must have the same size (at least 2 points)." << G4endl;
+			return 1;
+		}
+
+		auto weightedYieldNode = parser.require(opticsNode, "weighted_yield");
+
+		stackingActionParameters.weightedYieldSettings = {
+			parser.as_bool(parser.require(weightedYieldNode, "enabled")),
+			parser.as_double(parser.require(weightedYieldNode, "fraction"))
+		};
+
+		if (stackingActionParameters.weightedYieldSettings.enabled
+			&& (stackingActionParameters.weightedYieldSettings.fraction <= 0 || stackingActionParameters.weightedYieldSettings.fraction > 1))
+		{
+			G4cerr << "[HodoSim] Error: weighted_yield fraction must be in (0, 1]." << G4endl;
+			return 1;
+		}
+
+		auto photonLimitsNode = parser.require(opticsNode, "photon_limits");
+
+		photonLimits = {
+			parser.as_double(parser.require(photonLimitsNode, "max_global_time")) * ns,
+			parser.as_int(parser.require(photonLimitsNode, "max_reflections")),
+			parser.as_double(parser.require(photonLimitsNode, "max_path_length")) * mm
+		};
+
+		auto twoStageNode = parser.require(opticsNode, "two_stage");
+
+		G4String twoStageMode = parser.as_string(parser.require(twoStageNode, "mode"));
+		if (twoStageMode != "off" && twoStageMode != "record" && twoStageMode != "replay")
+		{
+			G4cerr << "[HodoSim] Error: invalid two_stage mode '" << twoStageMode << "' (expected off, record or replay)." << G4endl;
+			return 1;
+		}
+
+		twoStageSettings = {
+			twoStageMode == "record",
+			twoStageMode == "replay",
+			parser.as_string(parser.require(twoStageNode, "stream_file"))
+		};
+
+		auto photonRecordsNode = parser.require(opticsNode, "photon_records");
+
+		photonRecordSettings = {
+			parser.as_bool(parser.require(photonRecordsNode, "enabled")),
+			parser.as_string(parser.require(photonRecordsNode, "file"))
+		};
+
+		auto subEventNode = parser.require(opticsNode, "sub_event");
+
+		subEventSettings = {
+			parser.as_bool(parser.require(subEventNode, "enabled")),
+			parser.as_int(parser.require(subEventNode, "photons_per_sub_event"))
+		};
+
+		if (subEventSettings.enabled && subEventSettings.photonsPerSubEvent <= 0)
+		{
+			G4cerr << "[HodoSim] Error: sub_event photons_per_sub_event must be > 0." << G4endl;
+			return 1;
+		}
+
+		G4String photonTrackInfo = parser.as_string(parser.require(opticsNode, "photon_track_info"));
+		if (photonTrackInfo != "pooled" && photonTrackInfo != "side_table")
+		{
+			G4cerr << "[HodoSim] Error: invalid photon_track_info '" << photonTrackInfo << "' (expected pooled or side_table)." << G4endl;
+			return 1;
+		}
+		photonTrackInfoMode = (photonTrackInfo == "pooled") ? PhotonTrackInfoMode::Pooled : PhotonTrackInfoMode::SideTable;
+
+		countReflections = parser.as_bool(parser.require(opticsNode, "count_reflections"));
+
 		auto outputNode = parser.require(root, "output");
 
 		outputDir = parser.as_string(parser.require(outputNode, "directory"));
 		outputFile = parser.as_string(parser.require(outputNode, "file"));
+		photonHistogramsPrescale = parser.as_int(parser.require(outputNode, "photon_histograms_prescale"));
+
+		if (photonHistogramsPrescale < 0)
+		{
+			G4cerr << "[HodoSim] Error: photon_histograms_prescale must be >= 0." << G4endl;
+			return 1;
+		}
+
+		G4String outputBackend = parser.as_string(parser.require(outputNode, "backend"));
+		if (outputBackend != "ttree" && outputBackend != "rntuple" && outputBackend != "async")
+		{
+			G4cerr << "[HodoSim] Error: invalid output backend '" << outputBackend << "' (expected ttree, rntuple or async)." << G4endl;
+			return 1;
+		}
+		perThreadFiles = parser.as_bool(parser.require(outputNode, "per_thread_files"));
+		if (perThreadFiles && outputBackend != "ttree")
+		{
+			G4cerr << "[HodoSim] Error: per_thread_files only applies to the ttree output backend." << G4endl;
+			return 1;
+		}
+
+		auto rntupleNode = parser.require(outputNode, "rntuple");
+
+		rntupleSettings = {
+			outputBackend == "rntuple",
+			parser.as_string(parser.require(rntupleNode, "compression")),
+			parser.as_int(parser.require(rntupleNode, "compression_level")),
+			parser.as_int(parser.require(rntupleNode, "cluster_size"))
+		};
+
+		const G4String& compression = rntupleSettings.compression;
+		if (compression != "zstd" && compression != "lz4" && compression != "zlib" && compression != "none")
+		{
+			G4cerr << "[HodoSim] Error: invalid rntuple compression '" << compression << "' (expected zstd, lz4, zlib or none)." << G4endl;
+			return 1;
+		}
+		if (rntupleSettings.clusterSize <= 0)
+		{
+			G4cerr << "[HodoSim] Error: rntuple cluster_size must be > 0." << G4endl;
+			return 1;
+		}
+
+		auto asyncNode = parser.require(outputNode, "async");
+
+		asyncOutputSettings = {
+			outputBackend == "async",
+			parser.as_int(parser.require(asyncNode, "queue_capacity")),
+			parser.as_int(parser.require(asyncNode, "batch_size")),
+			parser.as_int(parser.require(asyncNode, "compression_level"))
+		};
+
+		if (asyncOutputSettings.queueCapacity <= 0 || asyncOutputSettings.batchSize <= 0
+			|| asyncOutputSettings.compressionLevel < 0 || asyncOutputSettings.compressionLevel > 9)
+		{
+			G4cerr << "[HodoSim] Error: async queue_capacity and batch_size must be > 0, compression_level in [0, 9]." << G4endl;
+			return 1;
+		}
+
+		auto tensorShardsNode = parser.require(outputNode, "tensor_shards");
+
+		tensorShardSettings = {
+			parser.as_bool(parser.require(tensorShardsNode, "enabled")),
+			parser.as_int(parser.require(tensorShardsNode, "events_per_shard")),
+			parser.as_double(parser.require(tensorShardsNode, "val_fraction")),
+			parser.as_double(parser.require(tensorShardsNode, "test_fraction"))
+		};
+
+		if (tensorShardSettings.eventsPerShard <= 0 || tensorShardSettings.valFraction < 0 || tensorShardSettings.testFraction < 0
+			|| tensorShardSettings.valFraction + tensorShardSettings.testFraction >= 1)
+		{
+			G4cerr << "[HodoSim] Error: tensor_shards events_per_shard must be > 0, val_fraction and test_fraction >= 0 with a sum < 1." << G4endl;
+			return 1;
+		}
+
+		auto sparseNode = parser.require(outputNode, "sparse");
+
+		sparseEncodingSettings = {
+			parser.as_bool(parser.require(sparseNode, "enabled")),
+			parser.as_double(parser.require(sparseNode, "max_occupancy"))
+		};
+
+		if (sparseEncodingSettings.maxOccupancy < 0 || sparseEncodingSettings.maxOccupancy > 1)
+		{
+			G4cerr << "[HodoSim] Error: sparse max_occupancy must be in [0, 1]." << G4endl;
+			return 1;
+		}
+
+		auto rollingNode = parser.require(outputNode, "rolling");
+
+		outputRotationSettings = {
+			parser.as_bool(parser.require(rollingNode, "enabled")),
+			parser.as_int(parser.require(rollingNode, "events_per_file")),
+			parser.as_double(parser.require(rollingNode, "max_file_size_mb")) * 1024 * 1024,
+			parser.as_int(parser.require(rollingNode, "basket_size_kb")) * 1024
+		};
+
+		if (outputRotationSettings.eventsPerFile <= 0 || outputRotationSettings.maxFileSize < 0 || outputRotationSettings.basketSize <= 0)
+		{
+			G4cerr << "[HodoSim] Error: rolling events_per_file and basket_size_kb must be > 0, max_file_size_mb >= 0." << G4endl;
+			return 1;
+		}
 
 		#pragma endregion Imported Simulation Parameters
 	}
@@ -248,6 +549,26 @@ int main(int argc, char** argv) {
 		coatingThickness = 50 * um;
 		siPMThickness = 3 * mm;
 		sipmsPerSide = 20;
+		sipmStripMode = false;	// one continuous strip per edge, the SiPMs become virtual segments
+		sipmStoreHits = false;	// debug only, the ntuple is filled from the per-SiPM counters
+
+		digitizerSettings = SiPMDigitizerSettings{
+			false,							// enabled
+			false,							// storeWaveforms
+			0 * ns,							// windowStart
+			0.5 * ns,						// sampleWidth
+			256,							// nSamples
+			1 * ns,							// riseTime
+			15 * ns,						// fallTime
+			3600,							// nCells
+			0.1,							// crosstalkProbability
+			0.05,							// afterpulseProbability
+			10 * ns,						// afterpulseTimeConstant
+			20 * ns,						// recoveryTime
+			0.1 * megahertz,				// darkCountRate
+			0.05,							// noiseSigma (photoelectrons)
+			0.5								// threshold (photoelectrons)
+		};
 
 		// The size of the scintillator has yet to be formally established
 		// but for the purposes of this project any reasonable value will do
@@ -269,6 +590,7 @@ int main(int argc, char** argv) {
 			3.3 * ns,		// decayTime
 			1.58,			// refractiveIndex
 			210. * cm,		// absorptionLength
+			1.,				// generationFraction (set below from the weighted yield settings)
 		};
 
 		// These values are used in the primary generator action
@@ -294,17 +616,270 @@ int main(int argc, char** argv) {
 			0.01							// beamApertureY
 		};
 
+		// One muon per event by default
+		spillSettings = SpillSettings{
+			false,							// enabled
+			5.,								// meanMuons
+			1000 * ns,						// duration
+			0 * ns,							// bunchSpacing (0 = uniform)
+			1 * ns							// bunchWidth
+		};
+
+		// Every event is written by default
+		triggerSettings = TriggerSettings{
+			false,							// enabled
+			true,							// geometricCheck
+			0 * MeV							// edepThreshold (0 = disabled)
+		};
+
+		// Full optical simulation by default, check config.yaml for the fast optics modes
+		fastOpticsSettings = FastOpticsSettings{
+			false,							// buildTable
+			false,							// useTable
+			"lrf_table.bin",				// tableFile
+			25, 25, 3						// gridX, gridY, gridZ
+		};
+
+		analyticOpticsSettings = AnalyticOpticsSettings{
+			false,							// enabled
+			1024							// batchSize
+		};
+
+		// Typical blue-sensitive SiPM PDE (peak around 420 nm)
+		stackingActionParameters = StackingActionParameters{
+			false,							// enablePDEThinning
+			0.6,							// fillFactor
+			{ 2.0 * eV, 2.5 * eV, 2.85 * eV, 3.1 * eV, 3.5 * eV },	// pdeEnergies
+			{ 0.25, 0.45, 0.55, 0.50, 0.35 },						// pdeValues
+			WeightedYieldSettings{
+				false,						// enabled
+				0.1							// fraction
+			}
+		};
+
+		photonLimits = PhotonLimits{
+			0 * ns,							// maxGlobalTime (0 = disabled)
+			0,								// maxReflections (0 = disabled)
+			0 * mm							// maxPathLength (0 = disabled)
+		};
+
+		twoStageSettings = TwoStageSettings{
+			false,							// record
+			false,							// replay
+			"edep_steps.bin"				// streamFile
+		};
+
+		photonRecordSettings = PhotonRecordSettings{
+			false,							// enabled
+			"detected_photons.bin"			// file
+		};
+
+		subEventSettings = SubEventSettings{
+			false,							// enabled
+			2000							// photonsPerSubEvent
+		};
+
+		photonTrackInfoMode = PhotonTrackInfoMode::SideTable;	// reflection counters kept by the thread, no track user information
+		countReflections = true;									// reflections counted by the boundary process (off for production runs)
+
 		outputDir = "output_data";
 		outputFile = "output.root";
+		photonHistogramsPrescale = 1;		// every detected scintillation photon in the per-photon histograms
+		perThreadFiles = false;				// the workers ntuples are merged through the master into the output file
+
+		// Per-event data in the G4 ntuple by default
+		rntupleSettings = RNTupleSettings{
+			false,							// enabled
+			"zstd",							// compression
+			5,								// compressionLevel
+			50								// clusterSize (MB)
+		};
+
+		asyncOutputSettings = AsyncOutputSettings{
+			false,							// enabled
+			4096,							// queueCapacity
+			256,							// batchSize
+			1								// compressionLevel (0 = uncompressed)
+		};
+
+		tensorShardSettings = TensorShardSettings{
+			false,							// enabled
+			100000,							// eventsPerShard
+			0.1,							// valFraction
+			0.1								// testFraction
+		};
+
+		sparseEncodingSettings = SparseEncodingSettings{
+			false,							// enabled (dense per-SiPM vectors)
+			0.5								// maxOccupancy (above half the SiPMs the pairs cost more than the dense vector)
+		};
+
+		outputRotationSettings = OutputRotationSettings{
+			false,							// enabled (one file per run)
+			100000,							// eventsPerFile
+			0.,								// maxFileSize (bytes, 0 = only the event count)
+			32 * 1024						// basketSize (bytes)
+		};
 
 		#pragma endregion Hardcoded Simulation Parameters
 	}
 
+	// The weighted yield mode emits fewer scintillation photons, the DetectorConstruction scales the yield accordingly
+	const WeightedYieldSettings& weightedYieldSettings = stackingActionParameters.weightedYieldSettings;
+	scintData.generationFraction = weightedYieldSettings.enabled ? weightedYieldSettings.fraction : 1.;
+
+	// The two-stage simulation regenerates the photons itself, it can't be combined with the light response table
+	if ((twoStageSettings.record || twoStageSettings.replay) && (fastOpticsSettings.buildTable || fastOpticsSettings.useTable))
+	{
+		G4cerr << "[HodoSim] Error: two_stage and fast_optics can't be enabled together." << G4endl;
+		return 1;
+	}
+
+	// The table registers the emissions in the TrackingAction, after the thinning has already killed the photons the SiPMs
+	// would not detect: it would hold the geometric efficiency only, and the fast optics would never apply the PDE
+	if (stackingActionParameters.enablePDEThinning && (fastOpticsSettings.buildTable || fastOpticsSettings.useTable))
+	{
+		G4cerr << "[HodoSim] Error: pde_thinning and fast_optics can't be enabled together." << G4endl;
+		return 1;
+	}
+
+	// The analytic tracer refracts the photons straight from the scintillator into the SiPMs (scintillator -> Si Fresnel),
+	// with a gap the full simulation has another interface in between and the two would disagree
+	if (analyticOpticsSettings.enabled && gap != 0.)
+	{
+		G4cerr << "[HodoSim] Error: analytic_optics needs detector_geometry gap 0 (the SiPMs must touch the scintillator)." << G4endl;
+		return 1;
+	}
+
+	// The fast optics samples the counts without arrival times, there is nothing to digitize
+	if (digitizerSettings.enabled && fastOpticsSettings.useTable)
+	{
+		G4cerr << "[HodoSim] Error: the SiPM digitizer can't be used with fast_optics use." << G4endl;
+		return 1;
+	}
+	digitizerSettings.storeWaveforms = digitizerSettings.enabled && digitizerSettings.storeWaveforms;
+
+	// The sub-events are merged per event, the modes writing per-event streams from the SD/actions would see them as events
+	if (subEventSettings.enabled && (twoStageSettings.record || twoStageSettings.replay || photonRecordSettings.enabled))
+	{
+		G4cerr << "[HodoSim] Error: sub_event can't be combined with two_stage or photon_records." << G4endl;
+		return 1;
+	}
+	stackingActionParameters.enableSubEvents = subEventSettings.enabled;
+
+	// The reflection limit and the photon records (reweighting of the coating reflectivity) need the reflection counters
+	if (!countReflections && (photonLimits.maxReflections > 0 || photonRecordSettings.enabled))
+	{
+		G4cerr << "[HodoSim] Error: max_reflections and photon_records need count_reflections." << G4endl;
+		return 1;
+	}
+
+	// The two-stage replay has no muon to trigger on (stage 1 can be triggered instead),
+	// the edep threshold needs the optical photons in the waiting stack instead of the sub-event stacks
+	if (triggerSettings.enabled && (twoStageSettings.replay || (subEventSettings.enabled && triggerSettings.edepThreshold > 0)))
+	{
+		G4cerr << "[HodoSim] Error: the trigger can't be used in the two_stage replay, nor its edep_threshold with sub_event." << G4endl;
+		return 1;
+	}
+	stackingActionParameters.triggerSettings = triggerSettings;
+
+	if (rntupleSettings.enabled && !RNTupleOutput::IsAvailable())
+	{
+		G4cerr << "[HodoSim] Error: the rntuple output backend needs HodoSim built with ROOT (>= 6.36)." << G4endl;
+		return 1;
+	}
+
+	// The async backend streams fixed-size records (integer counts and muon truth), the variable-length
+	// and weighted columns have no place in them
+	if (asyncOutputSettings.enabled && (weightedYieldSettings.enabled || digitizerSettings.enabled || sipmStripMode || spillSettings.enabled))
+	{
+		G4cerr << "[HodoSim] Error: the async output backend can't store weighted_yield, digitizer, strip_mode or spill data." << G4endl;
+		return 1;
+	}
+	if (asyncOutputSettings.enabled && sparseEncodingSettings.enabled)
+	{
+		G4cerr << "[HodoSim] Error: the async output backend has fixed-size records, it can't store the sparse columns." << G4endl;
+		return 1;
+	}
+	if (asyncOutputSettings.enabled && asyncOutputSettings.compressionLevel > 0 && !AsyncEventWriter::IsCompressionAvailable())
+	{
+		G4cout << "[HodoSim] Warning: HodoSim was built without zlib, the async output batches are stored uncompressed." << G4endl;
+	}
+
+	// The spill attributes the photons to their muon through the tracks ancestry,
+	// the modes that detect photons without tracking them from the muon (or on another thread) can't do it
+	if (spillSettings.enabled && (subEventSettings.enabled || analyticOpticsSettings.enabled || twoStageSettings.record || twoStageSettings.replay || fastOpticsSettings.useTable))
+	{
+		G4cerr << "[HodoSim] Error: spill can't be combined with sub_event, analytic_optics, two_stage or fast_optics use." << G4endl;
+		return 1;
+	}
+
+	// The muon index is the track ID of its primary minus one (EventAction, MuonScorer, SpillAncestry),
+	// every muon must be exactly one primary: a single source firing a single particle
+	if (spillSettings.enabled && ((gunSettings.isActive && gpsSettings.isActive) || (gunSettings.isActive && gunSettings.particleN != 1)))
+	{
+		G4cerr << "[HodoSim] Error: spill needs a single primary per muon, activate only one of particle_gun and gps (with particle_number 1)." << G4endl;
+		return 1;
+	}
+
+	// The muon arrival times are absolute (measured from the start of the spill), so are the photon time limit,
+	// the digitizer window and the photon time histogram: they must cover the whole spill,
+	// otherwise the photons of the late muons are killed or fall outside of the window
+	if (spillSettings.enabled)
+	{
+		// The bunches are centered in their slot, I allow for the gaussian tail of the last one
+		const G4double lastArrival = spillSettings.duration + ((spillSettings.bunchSpacing > 0.) ? 3. * spillSettings.bunchWidth : 0.);
+
+		if (photonLimits.maxGlobalTime > 0 && photonLimits.maxGlobalTime <= lastArrival)
+		{
+			G4cerr << "[HodoSim] Error: photon_limits max_global_time (" << photonLimits.maxGlobalTime / ns
+				<< " ns) must exceed the spill duration (" << lastArrival / ns << " ns), the times are measured from the start of the spill." << G4endl;
+			return 1;
+		}
+
+		const G4double windowEnd = digitizerSettings.windowStart + digitizerSettings.nSamples * digitizerSettings.sampleWidth;
+		if (digitizerSettings.enabled && (digitizerSettings.windowStart > 0. || windowEnd <= lastArrival))
+		{
+			G4cerr << "[HodoSim] Error: the digitizer window (" << digitizerSettings.windowStart / ns << " - " << windowEnd / ns
+				<< " ns) must cover the spill (0 - " << lastArrival / ns << " ns), the times are measured from the start of the spill." << G4endl;
+			return 1;
+		}
+
+		if (lastArrival > PhotonHistograms::kTimeAxis.max * ns)
+		{
+			G4cout << "[HodoSim] Warning: the ScintOpticalPhotonsTime histogram stops at " << PhotonHistograms::kTimeAxis.max
+				<< " ns, the photons of the muons arriving later in the spill end up in its overflow." << G4endl;
+		}
+	}
+
 	#pragma region RunManager Definition
 
-	// MT Mode
-	G4MTRunManager* runManager = new G4MTRunManager;
-	runManager->SetNumberOfThreads(threads);
+	G4RunManager* runManager = nullptr;
+
+	// Rolling output: the run manager splits every /run/beamOn into chunks, the run actions name and list their files
+	OutputRotation* outputRotation = nullptr;
+	if (outputRotationSettings.enabled)
+	{
+		if (subEventSettings.enabled)
+		{
+			G4cerr << "[HodoSim] Error: rolling output can't be combined with sub_event (it needs its own run manager)." << G4endl;
+			return 1;
+		}
+		outputRotation = new OutputRotation(outputRotationSettings);
+	}
+
+	if (subEventSettings.enabled)
+	{
+		// Sub-event parallel mode: the thread tracking the muon ships its optical photons to the others
+		runManager = G4RunManagerFactory::CreateRunManager(G4RunManagerType::SubEvtOnly, threads);
+		runManager->RegisterSubEventType(kOpticalPhotonSubEventType, subEventSettings.photonsPerSubEvent);
+	}
+	else
+	{
+		// MT Mode
+		runManager = outputRotation ? new RollingRunManager(outputRotation) : new G4MTRunManager;
+		runManager->SetNumberOfThreads(threads);
+	}
 
 	// ST Mode
 	// G4RunManager* runManager = G4RunManagerFactory::CreateRunManager(G4RunManagerType::Default);
@@ -322,12 +897,114 @@ int main(int argc, char** argv) {
 	auto optParams = G4OpticalParameters::Instance();
 	optParams->SetScintTrackSecondariesFirst(true);
 
+	// In fast optics mode the scintillation photons are not generated at all,
+	// their detected counts are sampled from the light response table instead.
+	if (fastOpticsSettings.useTable)
+	{
+		optParams->SetProcessActivation("Scintillation", false);
+	}
+
+	// Stage 1 of the two-stage simulation only needs the charged particles, the photons are generated in stage 2
+	if (twoStageSettings.record)
+	{
+		optParams->SetProcessActivation("Scintillation", false);
+		optParams->SetProcessActivation("Cerenkov", false);
+	}
+
 	physicsList->RegisterPhysics(optPhysics);
+
+	// The reflections are counted by a wrapper of the boundary process, which replaces the one of G4OpticalPhysics.
+	// Its border surfaces are filled by the DetectorConstruction when the geometry is built.
+	ReflectionSurfaces* reflectionSurfaces = nullptr;
+	if (countReflections)
+	{
+		reflectionSurfaces = new ReflectionSurfaces();
+		physicsList->RegisterPhysics(new ReflectionCountingPhysics(reflectionSurfaces));
+	}
+
+	// The analytic optics model is a fast simulation model, optical photons need the fast simulation process
+	if (analyticOpticsSettings.enabled)
+	{
+		auto fastSimPhysics = new G4FastSimulationPhysics();
+		fastSimPhysics->ActivateFastSimulation("opticalphoton");
+		physicsList->RegisterPhysics(fastSimPhysics);
+	}
+
 	physicsList->SetVerboseLevel(0);
 	
 	# pragma endregion PhysicsList Definition & Initialization
 
 
+	#pragma region Fast Optics Definition
+
+	// The table is loaded (memory-mapped) once here and shared read-only by all the worker threads
+	LightResponseTable* lightResponseTable = nullptr;
+	LightResponseTableBuilder* lightResponseTableBuilder = nullptr;
+
+	if (fastOpticsSettings.useTable)
+	{
+		lightResponseTable = new LightResponseTable(fastOpticsSettings.tableFile);
+		if (!lightResponseTable->IsLoaded())
+		{
+			G4cerr << "[HodoSim] Error: could not load light response table " << fastOpticsSettings.tableFile << ", quitting!" << G4endl;
+			return 1;
+		}
+		if (lightResponseTable->GetNumberOfSiPMs() != sipmsPerSide * 4)
+		{
+			G4cerr << "[HodoSim] Error: light response table was built for " << lightResponseTable->GetNumberOfSiPMs()
+				<< " SiPMs but the geometry has " << sipmsPerSide * 4 << ", quitting!" << G4endl;
+			return 1;
+		}
+	}
+
+	if (fastOpticsSettings.buildTable)
+	{
+		lightResponseTableBuilder = new LightResponseTableBuilder(
+			fastOpticsSettings,
+			scintGeometry.sizeX / 2,
+			scintGeometry.sizeY / 2,
+			scintGeometry.sizeZ / 2,
+			sipmsPerSide * 4
+		);
+	}
+
+	#pragma endregion Fast Optics Definition
+
+
+	#pragma region Two-Stage Definition
+
+	// A single stream is shared by all the worker threads, events are written/read as whole blocks
+	EdepStreamWriter* edepStreamWriter = nullptr;
+	EdepStreamReader* edepStreamReader = nullptr;
+
+	if (twoStageSettings.record)
+	{
+		edepStreamWriter = new EdepStreamWriter(twoStageSettings.streamFile);
+		if (!edepStreamWriter->IsOpen()) return 1;
+	}
+
+	if (twoStageSettings.replay)
+	{
+		edepStreamReader = new EdepStreamReader(twoStageSettings.streamFile);
+		if (!edepStreamReader->IsOpen()) return 1;
+	}
+
+	#pragma endregion Two-Stage Definition
+
+
+	#pragma region Photon Records Definition
+
+	PhotonRecordWriter* photonRecordWriter = nullptr;
+
+	if (photonRecordSettings.enabled)
+	{
+		photonRecordWriter = new PhotonRecordWriter(photonRecordSettings.file, sipmsPerSide * 4);
+		if (!photonRecordWriter->IsOpen()) return 1;
+	}
+
+	#pragma endregion Photon Records Definition
+
+
 	#pragma region DetectorConstruction Definition & Initialization
 
 	DetectorConstruction* detectorConstruction = new DetectorConstruction(
@@ -340,7 +1017,14 @@ int main(int argc, char** argv) {
 		scintLVName,
 		opCName,
 		enableCuts,
-		sipmsPerSide
+		sipmsPerSide,
+		sipmStripMode,
+		sipmStoreHits,
+		digitizerSettings.enabled,
+		analyticOpticsSettings,
+		lightResponseTableBuilder,
+		photonRecordWriter,
+		reflectionSurfaces
 	);
 
 	#pragma endregion DetectorConstruction Definition & Initialization
@@ -351,27 +1035,80 @@ int main(int argc, char** argv) {
 	PrimaryGeneratorActionParameters primaryGeneratorActionParameters = PrimaryGeneratorActionParameters{
 		particleName,
 		gunSettings,
-		gpsSettings
+		gpsSettings,
+		scintLVName,
+		edepStreamReader,
+		triggerSettings,
+		G4ThreeVector(scintGeometry.sizeX / 2, scintGeometry.sizeY / 2, scintGeometry.sizeZ / 2),
+		spillSettings
 	};
 	
 	RunActionParameters runActionParameters = RunActionParameters{
 		enableCuts,
 		sipmsPerSide,
 		outputDir,
-		outputFile
+		outputFile,
+		lightResponseTableBuilder,
+		weightedYieldSettings.enabled,
+		sipmStripMode,
+		triggerSettings.enabled,
+		photonHistogramsPrescale,
+		digitizerSettings.enabled,
+		digitizerSettings.storeWaveforms,
+		spillSettings.enabled,
+		sparseEncodingSettings.enabled,
+		perThreadFiles,
+		nullptr,						// rntupleOutput (set below)
+		nullptr,						// asyncEventWriter (set below)
+		tensorShardSettings,
+		outputRotation
 	};
+
+	// Shared by the run actions of all the threads, its fields follow the same flags of the G4 ntuple columns
+	RNTupleOutput* rntupleOutput = nullptr;
+	if (rntupleSettings.enabled)
+	{
+		rntupleOutput = new RNTupleOutput(rntupleSettings, runActionParameters);
+		runActionParameters.rntupleOutput = rntupleOutput;
+	}
+	AsyncEventWriter* asyncEventWriter = nullptr;
+	if (asyncOutputSettings.enabled)
+	{
+		asyncEventWriter = new AsyncEventWriter(asyncOutputSettings, sipmsPerSide * 4);
+		runActionParameters.asyncEventWriter = asyncEventWriter;
+	}
 	
 	EventActionParameters eventActionParameters = EventActionParameters{ 
 		scintLVName,
+		coatingLVName,
 		siliconPMSDName, 
 		opCName,
-		sipmsPerSide
+		sipmsPerSide,
+		lightResponseTable,
+		scintData.scalingFactor * scintData.scintYield / MeV,
+		weightedYieldSettings.enabled,
+		edepStreamWriter,
+		twoStageSettings.replay,
+		sipmStripMode,
+		subEventSettings.enabled,
+		triggerSettings,
+		digitizerSettings,
+		spillSettings.enabled,
+		sparseEncodingSettings
 	};
 
-	TrackingActionParameters trackingActionParameters = TrackingActionParameters{};
+	TrackingActionParameters trackingActionParameters = TrackingActionParameters{
+		lightResponseTableBuilder,
+		photonTrackInfoMode,
+		spillSettings.enabled
+	};
 
 	SteppingActionParameters steppingActionParameters = SteppingActionParameters{
-		scintLVName
+		scintLVName,
+		fastOpticsSettings.useTable,
+		twoStageSettings.record,
+		photonRecordSettings.enabled,
+		photonLimits
 	};
 
 	#pragma endregion User Actions Definition
@@ -384,7 +1121,8 @@ int main(int argc, char** argv) {
 		runActionParameters,
 		eventActionParameters,
 		trackingActionParameters,
-		steppingActionParameters
+		steppingActionParameters,
+		stackingActionParameters
 	));
 
 	// Batch mode
@@ -394,6 +1132,15 @@ int main(int argc, char** argv) {
 		UImanager->ApplyCommand("/control/execute macros\\batch.mac");
 
 		delete runManager;
+		delete lightResponseTable;
+		delete lightResponseTableBuilder;
+		delete edepStreamWriter;
+		delete edepStreamReader;
+		delete photonRecordWriter;
+		delete reflectionSurfaces;
+		delete rntupleOutput;
+		delete asyncEventWriter;
+		delete outputRotation;
 		return 0;
 	}
 	
@@ -425,6 +1172,15 @@ int main(int argc, char** argv) {
 	delete ui;
 	if (enableVis){ delete visManager; }
 	delete runManager;
+	delete lightResponseTable;
+	delete lightResponseTableBuilder;
+	delete edepStreamWriter;
+	delete edepStreamReader;
+	delete photonRecordWriter;
+	delete reflectionSurfaces;
+	delete rntupleOutput;
+	delete asyncEventWriter;
+	delete outputRotation;
 
 	return 0;
 }
@@ -7,7 +7,8 @@ ActionInitialization::ActionInitialization(
 	RunActionParameters runActionParameters,
 	EventActionParameters eventActionParameters,
 	TrackingActionParameters trackingActionParameters,
-	SteppingActionParameters steppingActionParameters
+	SteppingActionParameters steppingActionParameters,
+	StackingActionParameters stackingActionParameters
 ) : G4VUserActionInitialization() 
 {
 	_primaryGeneratorActionParameters = primaryGeneratorActionParameters;
@@ -15,12 +16,14 @@ ActionInitialization::ActionInitialization(
 	_eventActionParameters = eventActionParameters;
 	_trackingActionParameters = trackingActionParameters;
 	_steppingActionParameters = steppingActionParameters;
+	_stackingActionParameters = stackingActionParameters;
 }
 
 ActionInitialization::~ActionInitialization() {}
 
 // This method is called only in the master thread in multi-threaded mode,
 // omitting this brings issues with data collection.
+// (In sub-event mode the master thread tracks the muons, so Build is called for it as well.)
 void ActionInitialization::BuildForMaster() const 
 {
 	SetUserAction(new RunAction(_runActionParameters));
@@ -31,11 +34,13 @@ void ActionInitialization::Build() const
 	
 	// instantiate actions here
 
-	auto* eventAction = new EventAction(_eventActionParameters);
+	auto* runAction = new RunAction(_runActionParameters);
+	auto* eventAction = new EventAction(_eventActionParameters, runAction);
 
     SetUserAction(new PrimaryGeneratorAction(_primaryGeneratorActionParameters));
-    SetUserAction(new RunAction(_runActionParameters));
+    SetUserAction(runAction);
 	SetUserAction(eventAction);
 	SetUserAction(new TrackingAction(_trackingActionParameters, eventAction));
-	SetUserAction(new SteppingAction(_steppingActionParameters));
+	SetUserAction(new SteppingAction(_steppingActionParameters, eventAction, runAction));
+	SetUserAction(new StackingAction(_stackingActionParameters, eventAction));
 }
@@ -0,0 +1,268 @@
+#include "AsyncEventWriter.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+#ifdef HODOSIM_WITH_ZLIB
+#include <zlib.h>
+#endif
+
+
+#pragma region EventRecordQueue
+
+EventRecordQueue::EventRecordQueue(size_t capacity, size_t recordSize)
+{
+	size_t size = 2;
+	while (size < capacity) size <<= 1;
+
+	_mask = size - 1;
+	_recordSize = recordSize;
+	_cells.reset(new Cell[size]);
+	_storage.resize(size * recordSize);
+
+	// A cell is free for the producer when its sequence equals the position, full for the consumer at position + 1
+	for (size_t i = 0; i < size; i++) _cells[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+G4bool EventRecordQueue::TryPush(const char* record)
+{
+	size_t position = _enqueuePosition.load(std::memory_order_relaxed);
+	Cell* cell;
+	for (;;)
+	{
+		cell = &_cells[position & _mask];
+		const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+		const intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+
+		if (difference == 0)
+		{
+			if (_enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+		}
+		else if (difference < 0)
+		{
+			return false;	// full, the consumer has not freed this cell yet
+		}
+		else
+		{
+			position = _enqueuePosition.load(std::memory_order_relaxed);
+		}
+	}
+
+	std::memcpy(&_storage[(position & _mask) * _recordSize], record, _recordSize);
+	cell->sequence.store(position + 1, std::memory_order_release);
+	return true;
+}
+
+G4bool EventRecordQueue::TryPop(char* record)
+{
+	const size_t position = _dequeuePosition.load(std::memory_order_relaxed);
+	Cell& cell = _cells[position & _mask];
+	const size_t sequence = cell.sequence.load(std::memory_order_acquire);
+
+	if ((intptr_t)sequence - (intptr_t)(position + 1) < 0) return false;	// empty
+
+	std::memcpy(record, &_storage[(position & _mask) * _recordSize], _recordSize);
+	cell.sequence.store(position + _mask + 1, std::memory_order_release);
+	_dequeuePosition.store(position + 1, std::memory_order_relaxed);
+	return true;
+}
+
+size_t EventRecordQueue::Depth() const
+{
+	const size_t enqueued = _enqueuePosition.load(std::memory_order_relaxed);
+	const size_t dequeued = _dequeuePosition.load(std::memory_order_relaxed);
+	return enqueued > dequeued ? enqueued - dequeued : 0;
+}
+
+#pragma endregion EventRecordQueue
+
+
+AsyncEventWriter::AsyncEventWriter(const AsyncOutputSettings& settings, G4int nSiPMs)
+{
+	_settings = settings;
+	_nSiPMs = nSiPMs;
+	_recordSize = EventRecordSize((std::uint32_t)nSiPMs);
+	_queue = std::make_unique<EventRecordQueue>((size_t)settings.queueCapacity, _recordSize);
+}
+
+AsyncEventWriter::~AsyncEventWriter()
+{
+	// In case the run was aborted before the master EndOfRunAction
+	Close();
+}
+
+G4bool AsyncEventWriter::IsCompressionAvailable()
+{
+#ifdef HODOSIM_WITH_ZLIB
+	return true;
+#else
+	return false;
+#endif
+}
+
+G4bool AsyncEventWriter::Open(const G4String& filename)
+{
+	_out.open(filename, std::ios::binary | std::ios::trunc);
+	if (!_out)
+	{
+		G4cerr << "[AsyncEventWriter] Could not open file: " << filename << G4endl;
+		return false;
+	}
+
+	std::strncpy(_header.magic, "HODOEVT", 8);
+	_header.version = kEventStreamVersion;
+	_header.nSiPMs = (std::uint32_t)_nSiPMs;
+	_header.recordSize = _recordSize;
+	_header.compression = (IsCompressionAvailable() && _settings.compressionLevel > 0) ? 1 : 0;
+	_header.nEvents = 0;
+	// The header is written again on close, with the number of events filled in
+	_out.write(reinterpret_cast<const char*>(&_header), sizeof(_header));
+
+	_batch.assign((size_t)_settings.batchSize * _recordSize, 0);
+	_batchRecords = 0;
+	_nPushed = 0;
+	_nBlockedPushes = 0;
+	_blockedNanoseconds = 0;
+	_maxDepth = 0;
+	_nBatches = 0;
+	_rawBytes = 0;
+	_storedBytes = 0;
+
+	_stop = false;
+	_writerThread = std::thread(&AsyncEventWriter::WriterLoop, this);
+
+	G4cout << "[AsyncEventWriter] Writing the per-event data to " << filename << " (queue of " << _queue->Capacity() << " records)" << G4endl;
+	return true;
+}
+
+void AsyncEventWriter::Close()
+{
+	if (!_writerThread.joinable()) return;
+
+	// The workers have ended their run, the writer drains what is left and exits
+	_stop = true;
+	_writerThread.join();
+
+	_out.seekp(0);
+	_out.write(reinterpret_cast<const char*>(&_header), sizeof(_header));
+	_out.close();
+
+	PrintSummary();
+}
+
+void AsyncEventWriter::Push(const NtupleRow& row)
+{
+	// Packed in a per-thread buffer, then copied once into the queue cell
+	static thread_local std::vector<char> record;
+	record.resize(_recordSize);
+
+	EventRecordTruth truth{};
+	truth.eventID = row.eventID;
+	truth.scintEdep = row.scintEdep;
+	truth.coatingEdep = row.coatingEdep;
+	truth.muPathLength = row.muPathLength;
+	truth.muonHitX = row.muonHitX;
+	truth.muonHitY = row.muonHitY;
+	truth.muonExitX = row.muonExit[0];
+	truth.muonExitY = row.muonExit[1];
+	truth.muonExitZ = row.muonExit[2];
+	truth.muonExitDirX = row.muonExitDir[0];
+	truth.muonExitDirY = row.muonExitDir[1];
+	truth.muonExitDirZ = row.muonExitDir[2];
+	truth.muonExitEnergy = row.muonExitEnergy;
+	std::memcpy(record.data(), &truth, sizeof(truth));
+
+	char* counts = record.data() + sizeof(truth);
+	for (G4int i = 0; i < _nSiPMs; i++)
+	{
+		const G4int scint = i < (G4int)row.scintOPs.size() ? row.scintOPs[i] : 0;
+		const G4int cer = i < (G4int)row.cerOPs.size() ? row.cerOPs[i] : 0;
+		const std::uint16_t scint16 = (std::uint16_t)std::min(std::max(scint, 0), 0xFFFF);
+		const std::uint16_t cer16 = (std::uint16_t)std::min(std::max(cer, 0), 0xFFFF);
+		std::memcpy(counts + i * sizeof(std::uint16_t), &scint16, sizeof(scint16));
+		std::memcpy(counts + (_nSiPMs + i) * sizeof(std::uint16_t), &cer16, sizeof(cer16));
+	}
+
+	// Back-pressure: the writer can't keep up, the worker waits for a free cell
+	if (!_queue->TryPush(record.data()))
+	{
+		_nBlockedPushes++;
+		const auto start = std::chrono::steady_clock::now();
+		while (!_queue->TryPush(record.data())) std::this_thread::yield();
+		_blockedNanoseconds += (std::uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	}
+	_nPushed++;
+
+	const size_t depth = _queue->Depth();
+	size_t maxDepth = _maxDepth.load(std::memory_order_relaxed);
+	while (depth > maxDepth && !_maxDepth.compare_exchange_weak(maxDepth, depth, std::memory_order_relaxed)) {}
+}
+
+void AsyncEventWriter::WriterLoop()
+{
+	for (;;)
+	{
+		// The stop flag is read before draining, so the records pushed before Close are all written
+		const G4bool stopping = _stop.load(std::memory_order_acquire);
+
+		G4bool idle = true;
+		while (_queue->TryPop(&_batch[(size_t)_batchRecords * _recordSize]))
+		{
+			idle = false;
+			if (++_batchRecords == (std::uint32_t)_settings.batchSize) WriteBatch();
+		}
+
+		if (stopping) break;
+		if (idle) std::this_thread::sleep_for(std::chrono::microseconds(200));
+	}
+
+	if (_batchRecords > 0) WriteBatch();
+}
+
+void AsyncEventWriter::WriteBatch()
+{
+	EventStreamBatchHeader batchHeader{};
+	batchHeader.nRecords = _batchRecords;
+	batchHeader.rawSize = _batchRecords * _recordSize;
+	batchHeader.storedSize = batchHeader.rawSize;
+
+	const char* data = _batch.data();
+
+#ifdef HODOSIM_WITH_ZLIB
+	if (_header.compression == 1)
+	{
+		uLongf compressedSize = compressBound(batchHeader.rawSize);
+		_compressed.resize(compressedSize);
+		if (compress2(_compressed.data(), &compressedSize, reinterpret_cast<const Bytef*>(data), batchHeader.rawSize, _settings.compressionLevel) == Z_OK
+			&& compressedSize < batchHeader.rawSize)
+		{
+			batchHeader.storedSize = (std::uint32_t)compressedSize;
+			data = reinterpret_cast<const char*>(_compressed.data());
+		}
+	}
+#endif
+
+	_out.write(reinterpret_cast<const char*>(&batchHeader), sizeof(batchHeader));
+	_out.write(data, batchHeader.storedSize);
+
+	_header.nEvents += _batchRecords;
+	_nBatches++;
+	_rawBytes += batchHeader.rawSize;
+	_storedBytes += batchHeader.storedSize;
+	_batchRecords = 0;
+}
+
+void AsyncEventWriter::PrintSummary() const
+{
+	G4cout << "[AsyncEventWriter] Written " << _header.nEvents << " events in " << _nBatches << " batches, "
+		<< _rawBytes / 1024 << " kB packed, " << _storedBytes / 1024 << " kB on disk" << G4endl;
+	G4cout << "[AsyncEventWriter] Queue: max depth " << _maxDepth.load() << " / " << _queue->Capacity()
+		<< ", " << _nBlockedPushes.load() << " of " << _nPushed.load() << " pushes found it full ("
+		<< _blockedNanoseconds.load() * 1e-6 << " ms waited by the workers)" << G4endl;
+	if (_nBlockedPushes.load() > 0)
+	{
+		G4cout << "[AsyncEventWriter] The output is the bottleneck, consider a larger queue_capacity or a lower compression_level" << G4endl;
+	}
+}
@@ -0,0 +1,278 @@
+#include "BoxOpticsModel.hh"
+#include "SiliconPMSD.hh"
+#include "HotPathDispatch.hh"
+
+#include "G4FastTrack.hh"
+#include "G4FastStep.hh"
+#include "G4Track.hh"
+#include "G4VProcess.hh"
+#include "G4OpticalPhoton.hh"
+#include "G4RunManager.hh"
+#include "G4Event.hh"
+#include "G4PhysicalConstants.hh"
+#include "G4SystemOfUnits.hh"
+#include "Randomize.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+
+// Photons still alive after this many interactions are dropped (R = 1 and no bulk absorption would loop forever)
+static constexpr G4int kMaxBounces = 100000;
+
+
+BoxOpticsModel::BoxOpticsModel(const G4String& name, G4Region* region, BoxOpticsProperties properties, G4int batchSize, SiliconPMSD* siliconPMSD)
+	: G4VFastSimulationModel(name, region)
+{
+	_properties = properties;
+	_batchSize = std::max(1, batchSize);
+	_siliconPMSD = siliconPMSD;
+
+	// The SiPMs on the four sides share the same width (see DetectorConstruction::BuildGeometry)
+	_sipmWidth = 2 * _properties.halfX / _properties.sipmsPerSide;
+
+	Resize(_batchSize);
+}
+
+BoxOpticsModel::~BoxOpticsModel() {}
+
+void BoxOpticsModel::Resize(G4int capacity)
+{
+	for (auto* v : { &_x, &_y, &_z, &_dx, &_dy, &_dz, &_time, &_absPath, &_pathLength, &_energy, &_n1, &_n2, &_reflectivity, &_x0, &_y0, &_z0, &_weight, &_stepLength, &_random })
+	{
+		v->resize(capacity);
+	}
+	for (auto* v : { &_isCerenkov, &_nReflections, &_nReflectionsAtCoating, &_alive, &_face })
+	{
+		v->resize(capacity);
+	}
+}
+
+G4bool BoxOpticsModel::IsApplicable(const G4ParticleDefinition& particle)
+{
+	return &particle == G4OpticalPhoton::Definition();
+}
+
+G4bool BoxOpticsModel::ModelTrigger(const G4FastTrack& fastTrack)
+{
+	// Every optical photon in the plate is taken over, they are all born inside it
+	return true;
+}
+
+void BoxOpticsModel::DoIt(const G4FastTrack& fastTrack, G4FastStep& fastStep)
+{
+	const G4Track* track = fastTrack.GetPrimaryTrack();
+	const G4double energy = track->GetKineticEnergy();
+
+	// The envelope is the plate itself, so the local frame is centered in the plate
+	const G4ThreeVector position = fastTrack.GetPrimaryTrackLocalPosition();
+	const G4ThreeVector direction = fastTrack.GetPrimaryTrackLocalDirection();
+
+	const G4int i = _nPhotons++;
+
+	_x[i] = _x0[i] = position.x();
+	_y[i] = _y0[i] = position.y();
+	_z[i] = _z0[i] = position.z();
+	_dx[i] = direction.x();
+	_dy[i] = direction.y();
+	_dz[i] = direction.z();
+	_time[i] = track->GetGlobalTime();
+	_energy[i] = energy;
+	_weight[i] = track->GetWeight();
+
+	// The optical properties are evaluated once, at the photon energy
+	_n1[i] = _properties.scintRIndex->Value(energy);
+	_n2[i] = _properties.sipmRIndex->Value(energy);
+	_reflectivity[i] = _properties.coatingReflectivity->Value(energy);
+	_pathLength[i] = 0.;
+	_absPath[i] = CLHEP::RandExponential::shoot(_properties.scintAbsLength->Value(energy));
+
+	_isCerenkov[i] = (GetOpticalPhotonOrigin(track) == OpticalPhotonOrigin::Cerenkov) ? 1 : 0;
+	_nReflections[i] = 0;
+	_nReflectionsAtCoating[i] = 0;
+
+	fastStep.KillPrimaryTrack();
+	fastStep.ProposeTotalEnergyDeposited(0.);
+
+	if (_nPhotons >= _batchSize) Propagate();
+}
+
+void BoxOpticsModel::FlushBatch()
+{
+	if (_nPhotons > 0) Propagate();
+}
+
+void BoxOpticsModel::Propagate()
+{
+	const G4double infinity = std::numeric_limits<G4double>::infinity();
+
+	const G4double hx = _properties.halfX;
+	const G4double hy = _properties.halfY;
+	const G4double hz = _properties.halfZ;
+	const G4int nPerSide = _properties.sipmsPerSide;
+	const G4int eventID = G4RunManager::GetRunManager()->GetCurrentEvent()->GetEventID();
+
+	auto* engine = G4Random::getTheEngine();
+
+	G4int n = _nPhotons;
+	G4int nAlive = n;
+	std::fill(_alive.begin(), _alive.begin() + n, 1);
+
+	for (G4int bounce = 0; nAlive > 0 && bounce < kMaxBounces; bounce++)
+	{
+		// Distance to the nearest face and move (no branches on the photon state, this loop vectorizes)
+		for (G4int i = 0; i < n; i++)
+		{
+			const G4double tx = (_dx[i] != 0.) ? ((_dx[i] > 0. ? hx : -hx) - _x[i]) / _dx[i] : infinity;
+			const G4double ty = (_dy[i] != 0.) ? ((_dy[i] > 0. ? hy : -hy) - _y[i]) / _dy[i] : infinity;
+			const G4double tz = (_dz[i] != 0.) ? ((_dz[i] > 0. ? hz : -hz) - _z[i]) / _dz[i] : infinity;
+
+			G4double t = tx;
+			G4int face = 0;
+			if (ty < t) { t = ty; face = 1; }
+			if (tz < t) { t = tz; face = 2; }
+			t = std::max(t, 0.);
+
+			// Bulk absorption happens before reaching the face
+			const G4bool absorbed = t >= _absPath[i];
+			_face[i] = absorbed ? -1 : face;
+			_stepLength[i] = absorbed ? 0. : t * _alive[i];
+		}
+
+		for (G4int i = 0; i < n; i++)
+		{
+			const G4double t = _stepLength[i];
+			_x[i] += _dx[i] * t;
+			_y[i] += _dy[i] * t;
+			_z[i] += _dz[i] * t;
+			_absPath[i] -= t;
+			_pathLength[i] += t;
+			_time[i] += t * _n1[i] / c_light;
+		}
+
+		engine->flatArray(n, _random.data());
+
+		// Surface interactions
+		for (G4int i = 0; i < n; i++)
+		{
+			if (!_alive[i]) continue;
+
+			const G4int face = _face[i];
+			const G4double r = _random[i];
+
+			if (face < 0)
+			{
+				_alive[i] = 0;
+				nAlive--;
+				continue;
+			}
+
+			// Front/back faces: Al coating, specular reflection with probability REFLECTIVITY, otherwise absorbed
+			if (face == 2)
+			{
+				if (r < _reflectivity[i])
+				{
+					_dz[i] = -_dz[i];
+					_nReflections[i]++;
+					_nReflectionsAtCoating[i]++;
+				}
+				else
+				{
+					_alive[i] = 0;
+					nAlive--;
+				}
+				continue;
+			}
+
+			// Lateral faces: scintillator -> SiPM dielectric interface, unpolarized Fresnel coefficients
+			G4double& dNormal = (face == 0) ? _dx[i] : _dy[i];
+			const G4double n1 = _n1[i];
+			const G4double n2 = _n2[i];
+			const G4double cosI = std::abs(dNormal);
+			const G4double sinT2 = (n1 / n2) * (n1 / n2) * (1. - cosI * cosI);
+
+			G4double reflectance = 1.; // total internal reflection
+			if (sinT2 < 1.)
+			{
+				const G4double cosT = std::sqrt(1. - sinT2);
+				const G4double rs = (n1 * cosI - n2 * cosT) / (n1 * cosI + n2 * cosT);
+				const G4double rp = (n1 * cosT - n2 * cosI) / (n1 * cosT + n2 * cosI);
+				reflectance = 0.5 * (rs * rs + rp * rp);
+			}
+
+			if (r < reflectance)
+			{
+				dNormal = -dNormal;
+				_nReflections[i]++;
+				continue;
+			}
+
+			// Refracted into the SiPM: find the copy number the same way the rows are placed in BuildGeometry
+			G4int side;
+			G4double u;
+			if (face == 1)
+			{
+				side = (_dy[i] > 0.) ? 0 : 2;						// top : bottom
+				u = (_dy[i] > 0.) ? _x[i] + hx : hx - _x[i];
+			}
+			else
+			{
+				side = (_dx[i] > 0.) ? 1 : 3;						// right : left
+				u = (_dx[i] > 0.) ? hy - _y[i] : _y[i] + hy;
+			}
+			const G4int index = std::min(std::max((G4int)(u / _sipmWidth), 0), nPerSide - 1);
+
+			// The plate is placed in the origin without rotations, so local and global frames coincide
+			_siliconPMSD->RecordPhoton(
+				eventID,
+				side * nPerSide + index,
+				_isCerenkov[i] ? OpticalPhotonOrigin::Cerenkov : OpticalPhotonOrigin::Scintillation,
+				_energy[i],
+				_time[i],
+				G4ThreeVector(_x[i], _y[i], _z[i]),
+				G4ThreeVector(_x0[i], _y0[i], _z0[i]),
+				_nReflections[i],
+				_nReflectionsAtCoating[i],
+				_pathLength[i],
+				_weight[i],
+				u / ((face == 1) ? 2 * hx : 2 * hy)		// position along the edge (strip mode)
+			);
+
+			_alive[i] = 0;
+			nAlive--;
+		}
+
+		// Keep the surviving photons packed at the front, so the long tail of bouncing photons
+		// doesn't pay for the lanes that are already done
+		if (nAlive > 0 && nAlive < n / 2)
+		{
+			G4int k = 0;
+			for (G4int i = 0; i < n; i++)
+			{
+				if (!_alive[i]) continue;
+				if (k != i)
+				{
+					_x[k] = _x[i]; _y[k] = _y[i]; _z[k] = _z[i];
+					_dx[k] = _dx[i]; _dy[k] = _dy[i]; _dz[k] = _dz[i];
+					_time[k] = _time[i];
+					_absPath[k] = _absPath[i];
+					_pathLength[k] = _pathLength[i];
+					_energy[k] = _energy[i];
+					_n1[k] = _n1[i]; _n2[k] = _n2[i];
+					_reflectivity[k] = _reflectivity[i];
+					_x0[k] = _x0[i]; _y0[k] = _y0[i]; _z0[k] = _z0[i];
+					_weight[k] = _weight[i];
+					_isCerenkov[k] = _isCerenkov[i];
+					_nReflections[k] = _nReflections[i];
+					_nReflectionsAtCoating[k] = _nReflectionsAtCoating[i];
+					_alive[k] = 1;
+				}
+				k++;
+			}
+			n = k;
+		}
+	}
+
+	_nPhotons = 0;
+}
@@ -1,16 +1,13 @@
 #include "DetectorConstruction.hh"
 #include "SiliconPMSD.hh"
-#include "PrimaryMuonFilter.hh"
 
 #include "G4Box.hh"
 #include "G4LogicalVolume.hh"
 #include "G4PVPlacement.hh"
 
 #include "G4SDManager.hh"
-#include "G4MultiFunctionalDetector.hh"
-#include "G4PSEnergyDeposit.hh"
-#include "G4PSPassageTrackLength.hh"
 #include "G4ProductionCuts.hh"
+#include "G4RegionStore.hh"
 
 #include "G4SystemOfUnits.hh"
 
@@ -25,7 +22,14 @@ DetectorConstruction::DetectorConstruction(
 	G4String scintLVName,
 	G4String opCName,
 	G4bool enableCuts,
-	G4int sipmsPerSide
+	G4int sipmsPerSide,
+	G4bool stripMode,
+	G4bool storeHits,
+	G4bool storeArrivalTimes,
+	AnalyticOpticsSettings analyticOpticsSettings,
+	LightResponseTableBuilder* lightResponseTableBuilder,
+	PhotonRecordWriter* photonRecordWriter,
+	ReflectionSurfaces* reflectionSurfaces
 ) : G4VUserDetectorConstruction()
 {
 	_worldSizeXYZ = worldSizeXYZ;
@@ -34,6 +38,9 @@ DetectorConstruction::DetectorConstruction(
 	_siPMThickness = siPMThickness; 
 	_gap = gap;
 	_sipmsPerSide = sipmsPerSide;
+	_stripMode = stripMode;
+	_storeHits = storeHits;
+	_storeArrivalTimes = storeArrivalTimes;
 
 	_siliconPMSDName = siliconPMSDName;
 	_scintLVName = scintLVName;
@@ -41,6 +48,11 @@ DetectorConstruction::DetectorConstruction(
 
 	_enableCuts = enableCuts;
 
+	_analyticOpticsSettings = analyticOpticsSettings;
+	_lightResponseTableBuilder = lightResponseTableBuilder;
+	_photonRecordWriter = photonRecordWriter;
+	_reflectionSurfaces = reflectionSurfaces;
+
 	nist = G4NistManager::Instance();
 }
 
@@ -153,8 +165,10 @@ G4VPhysicalVolume* DetectorConstruction::BuildGeometry()
 
 	// For simplicity i'll start with just 4 SiPMs, one for each lateral side of the scint plate.
 	// In a future version I may consider adding a variable to control the number of SiPMs per side.
+	// In strip mode a single continuous strip is placed per side, the SiPMs are then virtual segments of it (see SiliconPMSD).
+	const G4int sipmVolumesPerSide = _stripMode ? 1 : _sipmsPerSide;
 
-	G4double sipmDeltaX = plateSizeX / (_sipmsPerSide);	// These are to be intended in the sipm local frame
+	G4double sipmDeltaX = plateSizeX / (sipmVolumesPerSide);	// These are to be intended in the sipm local frame
 	G4double sipmDeltaY = plateThickness;				// where the Z axis is equivalent to the Y axis of the global frame
 	G4double sipmDeltaZ = siPMThickness;
 	G4int globalIndex = 0;
@@ -170,7 +184,7 @@ G4VPhysicalVolume* DetectorConstruction::BuildGeometry()
 	std::vector<G4VPhysicalVolume*> sipmPhysicalVolumes;
 
 	// Top Row
-	for (int i = 0; i < _sipmsPerSide; i++)
+	for (int i = 0; i < sipmVolumesPerSide; i++)
 	{
 		G4double x_i = -plateSizeX / 2 + sipmDeltaX / 2 + i * sipmDeltaX;
 		G4double y_i = plateSizeY / 2 + sipmDeltaZ / 2 + gap;
@@ -191,7 +205,7 @@ G4VPhysicalVolume* DetectorConstruction::BuildGeometry()
 	}
 	
 	// Right Row
-	for (int i = 0; i < _sipmsPerSide; i++)
+	for (int i = 0; i < sipmVolumesPerSide; i++)
 	{
 		G4double x_i = plateSizeX / 2 + sipmDeltaZ / 2 + gap;
 		G4double y_i = plateSizeY / 2 - sipmDeltaX / 2 - i * sipmDeltaX;
@@ -214,7 +228,7 @@ G4VPhysicalVolume* DetectorConstruction::BuildGeometry()
 	}
 	
 	// Bottom Row
-	for (int i = 0; i < _sipmsPerSide; i++)
+	for (int i = 0; i < sipmVolumesPerSide; i++)
 	{
 		G4double x_i = plateSizeX / 2 - sipmDeltaX / 2 - i * sipmDeltaX;
 		G4double y_i = - plateSizeY / 2 - sipmDeltaZ / 2 - gap;
@@ -237,7 +251,7 @@ G4VPhysicalVolume* DetectorConstruction::BuildGeometry()
 	}
 
 	// Left Row
-	for (int i = 0; i < _sipmsPerSide; i++)
+	for (int i = 0; i < sipmVolumesPerSide; i++)
 	{
 		G4double x_i = - plateSizeX / 2 - sipmDeltaZ / 2 - gap;
 		G4double y_i = - plateSizeY / 2 + sipmDeltaX / 2 + i * sipmDeltaX;
@@ -269,7 +283,7 @@ G4VPhysicalVolume* DetectorConstruction::BuildGeometry()
 	// Scintillator <-> SiPM Surfaces
 		#pragma region Scintillator-SiPM Surfaces
 
-	for (G4int i = 0; i < _sipmsPerSide * 4; i++)
+	for (G4int i = 0; i < sipmVolumesPerSide * 4; i++)
 	{
 		G4String border_name_i = "ScintToSiPM" + std::to_string(i);
 		auto scint_to_sipm_i = new G4LogicalBorderSurface(
@@ -323,6 +337,12 @@ G4VPhysicalVolume* DetectorConstruction::BuildGeometry()
 		scintPhysical,
 		scint_surface
 	);
+
+	// The boundary process attributes the reflections to the coating through these pointers
+	if (_reflectionSurfaces)
+	{
+		_reflectionSurfaces->coating = { scint_to_coating_front, scint_to_coating_back, coating_front_to_scint, coating_back_to_scint };
+	}
 	
 
 		#pragma endregion Scintillator-Coating Surfaces
@@ -349,6 +369,12 @@ G4VPhysicalVolume* DetectorConstruction::BuildGeometry()
 		makeRegion("SiPMRegion", siPMLogic, 20 * um, 10 * um, 10 * um);
 		makeRegion("CoatingRegion", coatingLogic, 5 * um, 2 * um, 2 * um);
 	}
+	else if (_analyticOpticsSettings.enabled)
+	{
+		// The analytic optics model needs a region to be attached to (the cuts are inherited from the world)
+		auto* scintRegion = new G4Region("ScintRegion");
+		scintRegion->AddRootLogicalVolume(scintLogic);
+	}
 
 	#pragma endregion Cuts
 	
@@ -366,6 +392,17 @@ void DetectorConstruction::DefineMaterials()
 	DefineScintillatorMaterial();
 	DefineCoatingMaterial();
 	DefineSiPMMaterial();
+
+	// The photon records are reweighted relative to the optics actually simulated
+	if (_photonRecordWriter)
+	{
+		auto* coatingReflectivity = coating_surface->GetMaterialPropertiesTable()->GetProperty("REFLECTIVITY");
+		_photonRecordWriter->SetReferenceOptics(
+			coatingReflectivity->Value(_scintData.waveLengthPeak),
+			_scintData.absorptionLength,
+			_scintData.scalingFactor
+		);
+	}
 }
 
 void DetectorConstruction::DefineScintillatorMaterial()
@@ -421,7 +458,8 @@ void DetectorConstruction::DefineScintillatorMaterial()
 	scintMPT->AddProperty("RINDEX", scintPhotonEnergy, scintRefractiveIndex, nEntries);
 	scintMPT->AddProperty("ABSLENGTH", scintPhotonEnergy, scintAbsLength, nEntries);
 
-	scintMPT->AddConstProperty("SCINTILLATIONYIELD", sFactor * sYield / MeV);	
+	// In the weighted yield mode only a fraction of the photons is emitted, the StackingAction restores the normalization with the weights
+	scintMPT->AddConstProperty("SCINTILLATIONYIELD", sFactor * sYield * _scintData.generationFraction / MeV);
 	scintMPT->AddConstProperty("SCINTILLATIONYIELD1", 1.0);						
 	scintMPT->AddConstProperty("SCINTILLATIONTIMECONSTANT1", dTime);
 	scintMPT->AddConstProperty("RESOLUTIONSCALE", 1.0);
@@ -550,54 +588,17 @@ void DetectorConstruction::ConstructSDandField()
 {
 	auto* sdManager = G4SDManager::GetSDMpointer();
 
-	// Set the following filter to ignore non-primary muons,
-	// be careful that muplus are also ignored.
-	auto* muFilter = new PrimaryMuonFilter("PrimaryMuFilter");
-	
-
-	#pragma region Scintillator MFD
-	
-	G4MultiFunctionalDetector* scintMFD = new G4MultiFunctionalDetector("ScintillatorMFD");
-	sdManager->AddNewDetector(scintMFD);
-	
-	// I set these primitive scorers according to the data i want to collect (check the README.md file for that)
-	G4PSEnergyDeposit* scintPSedep = new G4PSEnergyDeposit("Edep");
-	scintPSedep->SetFilter(muFilter); // to get all particles edep comment out this line
-	scintMFD->RegisterPrimitive(scintPSedep);
-	
-	G4PSPassageTrackLength* scintPSmuPathLength = new G4PSPassageTrackLength("MuPathLength");
-	scintPSmuPathLength->SetFilter(muFilter);
-	scintMFD->RegisterPrimitive(scintPSmuPathLength);
-
-	SetSensitiveDetector("ScintLogic", scintMFD);
-	
-	#pragma endregion Scintillator MFD
-
-	
-	#pragma region Coating MFD
-	
-	// It is also possible to add a MFD for each physical copy of the same logical volume
-	// but i'm not doing that now since it is not a priority for the purposes of this simulation.
-	G4MultiFunctionalDetector* coatingMFD = new G4MultiFunctionalDetector("CoatingMFD");
-	sdManager->AddNewDetector(coatingMFD);
-
-	// I set these primitive scorers according to the data i want to collect (check the README.md file for that)
-	G4PSEnergyDeposit* coatingPSedep = new G4PSEnergyDeposit("Edep");
-	coatingPSedep->SetFilter(muFilter); // to get all particles edep comment out this line
-	coatingMFD->RegisterPrimitive(coatingPSedep);
-
-	SetSensitiveDetector("CoatLogic", coatingMFD);
-
-	#pragma endregion Coating MFD
-
+	// The edep and path length of the primary muon in the scintillator and in the coating
+	// are scored by the MuonScorer (fed by the SteppingAction), there are no MFDs here anymore.
 
 	#pragma region SiPM SD & MFD
 	
 	G4String siliconPMSDName = _siliconPMSDName;
 	G4String opCName = _opCName;
 	
-	SiliconPMSD* siliconPMSD = new SiliconPMSD(siliconPMSDName, opCName);
+	SiliconPMSD* siliconPMSD = new SiliconPMSD(siliconPMSDName, opCName, _sipmsPerSide * 4, _storeHits, _lightResponseTableBuilder, _photonRecordWriter);
 	sdManager->AddNewDetector(siliconPMSD);
+	siliconPMSD->SetStoreArrivalTimes(_storeArrivalTimes);
 	
 	// Assign the SiPMSD to the SiPM logical volume
 	// I'll differentiate between the physical copies using the copy number assigned during placement
@@ -605,6 +606,36 @@ void DetectorConstruction::ConstructSDandField()
 	// This way i'll only have to handle a single SD ie a single hit collection.
 	SetSensitiveDetector("SiPMLogic", siliconPMSD); // builtin method of G4VUserDetectorConstruction
 
+	// In strip mode the copy number is the edge, the SD splits it into the virtual SiPMs
+	if (_stripMode)
+	{
+		siliconPMSD->SetStripMode(_sipmsPerSide, _scintData.geometry.sizeX / 2, _scintData.geometry.sizeY / 2);
+	}
+
 	#pragma endregion SiPM SD & MFD
 
+
+	#pragma region Analytic Optics Model
+
+	// Fast simulation models are thread-local, like the SDs, so they are built here
+	if (_analyticOpticsSettings.enabled)
+	{
+		BoxOpticsProperties properties = BoxOpticsProperties{
+			_scintData.geometry.sizeX / 2,
+			_scintData.geometry.sizeY / 2,
+			_scintData.geometry.sizeZ / 2,
+			_sipmsPerSide,
+			scint_material->GetMaterialPropertiesTable()->GetProperty("RINDEX"),
+			scint_material->GetMaterialPropertiesTable()->GetProperty("ABSLENGTH"),
+			sipm_material->GetMaterialPropertiesTable()->GetProperty("RINDEX"),
+			coating_surface->GetMaterialPropertiesTable()->GetProperty("REFLECTIVITY")
+		};
+
+		auto* scintRegion = G4RegionStore::GetInstance()->GetRegion("ScintRegion");
+		auto* boxOpticsModel = new BoxOpticsModel("BoxOpticsModel", scintRegion, properties, _analyticOpticsSettings.batchSize, siliconPMSD);
+		siliconPMSD->SetBoxOpticsModel(boxOpticsModel);
+	}
+
+	#pragma endregion Analytic Optics Model
+
 }
\ No newline at end of file
@@ -0,0 +1,102 @@
+#include "EdepStream.hh"
+
+#include "G4AutoLock.hh"
+
+#include <cstring>
+
+
+namespace {
+	G4Mutex edepWriterMutex = G4MUTEX_INITIALIZER;
+	G4Mutex edepReaderMutex = G4MUTEX_INITIALIZER;
+}
+
+
+#pragma region EdepStreamWriter
+
+EdepStreamWriter::EdepStreamWriter(const G4String& filename)
+{
+	_out.open(filename, std::ios::binary | std::ios::trunc);
+	if (!_out)
+	{
+		G4cerr << "[EdepStreamWriter] Could not open file: " << filename << G4endl;
+		return;
+	}
+
+	EdepStreamHeader header{};
+	std::strncpy(header.magic, "HODOEDS", 8);
+	header.version = kEdepStreamVersion;
+	_out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+	G4cout << "[EdepStreamWriter] Recording scintillator steps to " << filename << G4endl;
+}
+
+EdepStreamWriter::~EdepStreamWriter()
+{
+	if (!_out.is_open()) return;
+
+	_out.close();
+	G4cout << "[EdepStreamWriter] Written " << _nEvents << " events, " << _nSteps << " steps" << G4endl;
+}
+
+void EdepStreamWriter::WriteEvent(const EdepEventRecord& event, const std::vector<EdepStepRecord>& steps)
+{
+	if (!_out.is_open()) return;
+
+	G4AutoLock lock(&edepWriterMutex);
+
+	_out.write(reinterpret_cast<const char*>(&event), sizeof(event));
+	_out.write(reinterpret_cast<const char*>(steps.data()), steps.size() * sizeof(EdepStepRecord));
+
+	_nEvents++;
+	_nSteps += steps.size();
+}
+
+#pragma endregion EdepStreamWriter
+
+
+#pragma region EdepStreamReader
+
+EdepStreamReader::EdepStreamReader(const G4String& filename)
+{
+	_in.open(filename, std::ios::binary);
+	if (!_in)
+	{
+		G4cerr << "[EdepStreamReader] Could not open file: " << filename << G4endl;
+		return;
+	}
+
+	EdepStreamHeader header{};
+	_in.read(reinterpret_cast<char*>(&header), sizeof(header));
+
+	if (!_in || std::strncmp(header.magic, "HODOEDS", 8) != 0 || header.version != kEdepStreamVersion)
+	{
+		G4cerr << "[EdepStreamReader] Invalid or corrupted stream: " << filename << G4endl;
+		return;
+	}
+
+	_isValid = true;
+	G4cout << "[EdepStreamReader] Replaying scintillator steps from " << filename << G4endl;
+}
+
+EdepStreamReader::~EdepStreamReader() {}
+
+G4bool EdepStreamReader::ReadEvent(EdepEventRecord& event, std::vector<EdepStepRecord>& steps)
+{
+	if (!_isValid) return false;
+
+	G4AutoLock lock(&edepReaderMutex);
+
+	if (!_in.read(reinterpret_cast<char*>(&event), sizeof(event))) return false;
+
+	steps.resize(event.nSteps);
+	if (!_in.read(reinterpret_cast<char*>(steps.data()), steps.size() * sizeof(EdepStepRecord)))
+	{
+		G4cerr << "[EdepStreamReader] Truncated stream at event " << event.eventID << G4endl;
+		_isValid = false;
+		return false;
+	}
+
+	return true;
+}
+
+#pragma endregion EdepStreamReader
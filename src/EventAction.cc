@@ -2,135 +2,373 @@
 
 #include "G4HCofThisEvent.hh"
 #include "G4SystemOfUnits.hh"
+#include "G4PhysicalConstants.hh"
+#include "G4Poisson.hh"
+#include "G4EventManager.hh"
+#include "G4AutoLock.hh"
+#include "G4DigiManager.hh"
 
-#include "OpticalPhotonHit.hh"
+#include <algorithm>
+#include <cmath>
 
+#include "SiPMCounters.hh"
+#include "HotPathDispatch.hh"
+#include "RunAction.hh"
+#include "OpticsReplay.hh"
+#include "SubEventParallel.hh"
+#include "Spill.hh"
+#include "SiliconPMSD.hh"
 
-EventAction::EventAction(EventActionParameters eventActionParameters) 
+
+namespace { G4Mutex subEventMergeMutex = G4MUTEX_INITIALIZER; }
+
+
+EventAction::EventAction(EventActionParameters eventActionParameters, RunAction* runAction) 
+	: muonScorer(eventActionParameters.scintLVName, eventActionParameters.coatingLVName)
 {
 	_eventActionParameters = eventActionParameters;
+	_runAction = runAction;
 	analysisManager = G4AnalysisManager::Instance();
+
+	if (_eventActionParameters.lightResponseTable)
+	{
+		expectedScintHits.assign(_eventActionParameters.sipmsPerSide * 4, 0.);
+	}
+
+	// The event actions are thread-local, so is the G4DigiManager the module is registered to
+	if (_eventActionParameters.digitizerSettings.enabled)
+	{
+		digitizer = new SiPMDigitizer("SiPMDigitizer", _eventActionParameters.digitizerSettings, _eventActionParameters.sipmsPerSide * 4);
+		G4DigiManager::GetDMpointer()->AddNewModule(digitizer);
+	}
 }
 
 EventAction::~EventAction() {}
 
 void EventAction::BeginOfEventAction(const G4Event* event)
 {
-	
+	std::fill(expectedScintHits.begin(), expectedScintHits.end(), 0.);
+	edepSteps.clear();
+	muonScorer.Reset();
+	spillEntered.clear();
+	spillEntryTimes.clear();
+	spillEntryPositions.clear();
+	if (_eventActionParameters.enableSpill) SpillAncestry::Reset();
+
+	// The PrimaryGeneratorAction marks the events whose primaries can't reach the scintillator,
+	// aborting here skips the tracking altogether (the EndOfEventAction is still called)
+	vetoedByGeometry = event->IsAborted();
+	if (vetoedByGeometry)
+	{
+		G4EventManager::GetEventManager()->AbortCurrentEvent();
+		return;
+	}
+
+	// The muon event collects the detected photons of its sub-events (the event manager owns and deletes it)
+	if (_eventActionParameters.enableSubEvents && !event->IsSubEvent())
+	{
+		G4EventManager::GetEventManager()->SetUserInformation(new SubEventHits(_eventActionParameters.sipmsPerSide * 4));
+	}
 }
 
 void EventAction::EndOfEventAction(const G4Event* event) 
 {
+	const G4bool muonHit = muonHitRegistered;
 	muonHitRegistered = false; // reset for next event
 
-	G4String siliconPMSDName = _eventActionParameters.siliconPMSDName;
-
-	G4String opCName = _eventActionParameters.opCName;
-
 	G4HCofThisEvent* hce = event->GetHCofThisEvent();
 
-	auto SDManager = G4SDManager::GetSDMpointer();
-
 	if (!hce) return;
 
-	// Get HCID once 
-	if (siliconPM_op_HCID < 0)
-	{
-		siliconPM_op_HCID = SDManager->GetCollectionID(opCName); // good
-
-		// Querying the HCID this way is the best way to ask for errors,
-		// I'll just let it slide this time (maybe i'll fix it later)
-		scint_edep_HCID = SDManager->GetCollectionID("ScintillatorMFD/Edep"); // bad
-		scint_muPathLength_HCID = SDManager->GetCollectionID("ScintillatorMFD/MuPathLength"); // bad
-		coating_edep_HCID = SDManager->GetCollectionID("CoatingMFD/Edep"); // bad
-	}
-
-	auto siliconPMSD_HC = hce->GetHC(siliconPM_op_HCID);
-	auto scint_edep_HC = hce->GetHC(scint_edep_HCID);
-	auto scint_muPathLength_HC = hce->GetHC(scint_muPathLength_HCID);
-	auto coating_edep_HC = hce->GetHC(coating_edep_HCID);
-	
-	auto* map_scint_edep_HC = static_cast<G4THitsMap<G4double>*>(scint_edep_HC);
-	auto* map_scint_muPathLength_HC = static_cast<G4THitsMap<G4double>*>(scint_muPathLength_HC);
-	auto* map_coating_edep_HC = static_cast<G4THitsMap<G4double>*>(coating_edep_HC);
+	// The counters HCID is resolved once per thread and shared with the other actions
+	auto* siliconPMSD_counters = static_cast<SiPMCountersCollection*>(hce->GetHC(HitCollectionIDs::Get().siPMCounters));
+	const MuonScore& muonScore = muonScorer.GetScore();
 	
 	// From here on, i'll just fill the root structures with the data
 
 	const G4int nSiPMs = _eventActionParameters.sipmsPerSide * 4;
-	std::vector<G4int> nScintHits(nSiPMs);
-	std::vector<G4int> nCerHits(nSiPMs);
-	G4double scintEdep = SumOverHC(map_scint_edep_HC);
-	G4double scintMuPathLength = SumOverHC(map_scint_muPathLength_HC);
-	G4double coatingEdep = SumOverHC(map_coating_edep_HC);
+	// The scintillation counts are sums of photon weights (all 1 unless the weighted yield mode is on),
+	// nScintHitsW2 is the sum of the squared weights, i.e. the variance estimate of the weighted count
+	SiPMCounts counts = siliconPMSD_counters ? siliconPMSD_counters->counts : SiPMCounts(nSiPMs);
+	std::vector<G4double>& nScintHits = counts.scintHits;
+	std::vector<G4double>& nScintHitsW2 = counts.scintHitsW2;
+	std::vector<G4int>& nCerHits = counts.cerHits;
+	G4double scintEdep = muonScore.scintEdep;
+	G4double scintMuPathLength = muonScore.scintPathLength;
+	G4double coatingEdep = muonScore.coatingEdep;
 	G4double muonHitX = muonLocalEntryPosition.x();
 	G4double muonHitY = muonLocalEntryPosition.y();
+	G4ThreeVector muonExitPosition = muonScore.exitLocalPosition;
+	G4ThreeVector muonExitDirection = muonScore.exitDirection;
+	G4double muonExitEnergy = muonScore.exitKineticEnergy;
+	G4int eventID = event->GetEventID();
 
-	// Analyze & Store in Histograms
-	#pragma region Histograms
+	// Vetoed events are not written anywhere, they are only counted
+	#pragma region Trigger
 
-	if (siliconPMSD_HC) {
-		G4int nHits = siliconPMSD_HC->GetSize();
-		
+	const TriggerSettings& triggerSettings = _eventActionParameters.triggerSettings;
+	if (triggerSettings.enabled && !event->IsSubEvent())
+	{
+		G4bool vetoed = true;
+		if (vetoedByGeometry) _runAction->CountVetoedEvent(TriggerVeto::Geometry);
+		// (aborted in the trigger stage, or no optical photon was waiting for it)
+		else if (event->IsAborted() || scintEdep < triggerSettings.edepThreshold) _runAction->CountVetoedEvent(TriggerVeto::Edep);
+		else if (!muonHit) _runAction->CountVetoedEvent(TriggerVeto::NoMuonHit);
+		else vetoed = false;
 
-		for (G4int i = 0; i < nHits; i++) {
-			auto hit = static_cast<OpticalPhotonHit*>(siliconPMSD_HC->GetHit(i));
-			auto process = hit->GetProcess();
-			auto edep = hit->GetEdep();
-			auto time = hit->GetTime();
-			auto position = hit->GetPosition();
-			auto siPMID = hit->GetSiPMID();
-
-			// Check siPMID validity
-			if (siPMID < 0 || siPMID >= nSiPMs) continue;
-
-			// dont forget to remove the g4 units
-			if (process == "Scintillation") {
-				analysisManager->FillH1(0, edep / eV); // Scint OP Energy 
-				analysisManager->FillH1(1, time / ns); // Scint OP Time
-				analysisManager->FillH2(0, position.x() / mm, position.y() / mm); // Scint OP Spread
-				nScintHits[siPMID]++;
-			} else if (process == "Cerenkov") {
-				nCerHits[siPMID]++;
-			}
+		if (vetoed)
+		{
+			if (auto* sd = GetSiliconPMSD()) sd->FlushPhotonRecords(false);
+			return;
 		}
 	}
 
-	#pragma endregion Histograms
+	// The photon records are only written for the events the trigger accepts
+	if (auto* sd = GetSiliconPMSD()) sd->FlushPhotonRecords(!event->IsAborted());
+
+	#pragma endregion Trigger
+
+	// Two-stage simulation
+	#pragma region Two-Stage
+
+	// Stage 1: the event truth is stored with the steps, the stage 2 events have no muon to measure it
+	if (auto* writer = _eventActionParameters.edepStreamWriter)
+	{
+		EdepEventRecord record{};
+		record.eventID = eventID;
+		record.nSteps = (std::uint32_t)edepSteps.size();
+		record.scintEdep = (float)(scintEdep / eV);
+		record.coatingEdep = (float)(coatingEdep / eV);
+		record.muPathLength = (float)(scintMuPathLength / mm);
+		record.muonHitX = (float)(muonHitX / mm);
+		record.muonHitY = (float)(muonHitY / mm);
+		record.muonExitX = (float)(muonExitPosition.x() / mm);
+		record.muonExitY = (float)(muonExitPosition.y() / mm);
+		record.muonExitZ = (float)(muonExitPosition.z() / mm);
+		record.muonExitDirX = (float)muonExitDirection.x();
+		record.muonExitDirY = (float)muonExitDirection.y();
+		record.muonExitDirZ = (float)muonExitDirection.z();
+		record.muonExitEnergy = (float)(muonExitEnergy / MeV);
+		writer->WriteEvent(record, edepSteps);
+	}
+
+	// Stage 2: the truth is taken back from the stream
+	if (_eventActionParameters.enableReplay)
+	{
+		auto* replayInfo = dynamic_cast<ReplayEventInfo*>(event->GetUserInformation());
+		if (!replayInfo) return; // the stream was exhausted, there is nothing to store
+
+		const auto& record = replayInfo->GetRecord();
+		eventID = record.eventID;
+		scintEdep = record.scintEdep * eV;
+		coatingEdep = record.coatingEdep * eV;
+		scintMuPathLength = record.muPathLength * mm;
+		muonHitX = record.muonHitX * mm;
+		muonHitY = record.muonHitY * mm;
+		muonExitPosition = G4ThreeVector(record.muonExitX, record.muonExitY, record.muonExitZ) * mm;
+		muonExitDirection = G4ThreeVector(record.muonExitDirX, record.muonExitDirY, record.muonExitDirZ);
+		muonExitEnergy = record.muonExitEnergy * MeV;
+	}
+
+	#pragma endregion Two-Stage
+
+	// Per-SiPM counts, the SD fills the counters (and the histograms) photon by photon
+	#pragma region Counters
+
+	// Sub-event mode: the photons of the muon event were detected in its sub-events
+	if (auto* subEventHits = dynamic_cast<SubEventHits*>(event->GetUserInformation()))
+	{
+		counts.Add(subEventHits->counts);
+	}
+
+	// In fast optics mode the scintillation counts are sampled from the light response table.
+	// The emission is Poissonian and each photon is detected independently,
+	// so the counts of the single SiPMs are independent Poisson variables.
+	if (_eventActionParameters.lightResponseTable)
+	{
+		for (G4int i = 0; i < nSiPMs; i++)
+		{
+			nScintHits[i] = (G4double)G4Poisson(expectedScintHits[i]);
+			nScintHitsW2[i] = nScintHits[i];
+		}
+	}
+
+	#pragma endregion Counters
+
+	// The counts of a sub-event are merged into the muon event (MergeSubEvent)
+	if (event->IsSubEvent()) return;
 
 	// Analyze & Store in NTuples
 	#pragma region Ntuples
 		
-	if (siliconPMSD_HC && scint_edep_HC && scint_muPathLength_HC && coating_edep_HC)
+	if (siliconPMSD_counters)
 	{
-		// eventID
-		analysisManager->FillNtupleDColumn(0, event->GetEventID());		
-		
-		// scint OP hits
+		// The whole row is filled here and written by the RunAction in a few calls (see NtupleRow)
+		NtupleRow& row = _runAction->GetNtupleRow();
+
+		row.eventID = eventID + _runAction->GetEventIDOffset();
 		for (int i = 0; i < nSiPMs; i++)
 		{
-			analysisManager->FillNtupleDColumn(1 + i, nScintHits[i]);
+			row.scintOPs[i] = (G4int)std::lround(nScintHits[i]);
+			row.cerOPs[i] = nCerHits[i];
+		}
 
+		row.scintEdep = (G4float)(scintEdep / eV);
+		row.coatingEdep = (G4float)(coatingEdep / eV);
+		row.muPathLength = (G4float)(scintMuPathLength / mm);
+		row.muonHitX = (G4float)(muonHitX / mm);
+		row.muonHitY = (G4float)(muonHitY / mm);
+		for (int k = 0; k < 3; k++)
+		{
+			row.muonExit[k] = (G4float)(muonExitPosition[k] / mm);	// scintillator frame
+			row.muonExitDir[k] = (G4float)muonExitDirection[k];
 		}
-		// cer OP hits
-		for (int i = 0; i < nSiPMs; i++)
+		row.muonExitEnergy = (G4float)(muonExitEnergy / MeV);
+
+		// Weighted yield mode: per-SiPM variance of the weighted counts and effective sample size of the event
+		if (_eventActionParameters.enableWeightedYield)
 		{
-			analysisManager->FillNtupleDColumn(1 + nSiPMs + i, nCerHits[i]);
+			G4double sumW = 0., sumW2 = 0.;
+			for (int i = 0; i < nSiPMs; i++)
+			{
+				row.scintOPsWeighted[i] = (G4float)nScintHits[i];
+				row.scintOPsVariance[i] = (G4float)nScintHitsW2[i];
+				sumW += nScintHits[i];
+				sumW2 += nScintHitsW2[i];
+			}
+			// Kish effective sample size, (sum w)^2 / sum w^2
+			row.effectiveSampleSize = (G4float)(sumW2 > 0 ? sumW * sumW / sumW2 : 0.);
+
+			_runAction->AddWeightedScintHits(sumW, sumW2);
+		}
+
+		// SiPM digitizer: charge, leading edge time, time over threshold and first photon time of every SiPM
+		if (digitizer)
+		{
+			auto* digiManager = G4DigiManager::GetDMpointer();
+			digitizer->SetCounts(&counts);
+			digiManager->Digitize(digitizer->GetName());
+
+			if (digiCollectionID < 0) digiCollectionID = digiManager->GetDigiCollectionID(digitizer->GetName() + "/" + SiPMDigitizer::kDigiCollectionName);
+			const auto* digis = static_cast<const SiPMDigiCollection*>(digiManager->GetDigiCollection(digiCollectionID));
+
+			for (size_t i = 0; digis && i < digis->entries() && i < row.siPMCharge.size(); i++)
+			{
+				const SiPMDigi* digi = (*digis)[i];
+				row.siPMCharge[i] = (G4float)digi->GetCharge();
+				row.siPMTime[i] = (G4float)(digi->GetTime() >= 0. ? digi->GetTime() / ns : -1.);
+				row.siPMToT[i] = (G4float)(digi->GetTimeOverThreshold() / ns);
+				row.siPMFirstPhotonTime[i] = (G4float)(digi->GetFirstPhotonTime() >= 0. ? digi->GetFirstPhotonTime() / ns : -1.);
+			}
+
+			if (_eventActionParameters.digitizerSettings.storeWaveforms)
+			{
+				row.waveforms = digitizer->GetWaveforms();
+			}
+		}
+
+		if (_eventActionParameters.enableStripMode)
+		{
+			row.edgeHits.scintEdge = counts.scintEdge;
+			row.edgeHits.scintPosition.assign(counts.scintPosition.begin(), counts.scintPosition.end());
+			if (_eventActionParameters.enableWeightedYield) row.edgeHits.scintWeight.assign(counts.scintWeight.begin(), counts.scintWeight.end());
+			row.edgeHits.cerEdge = counts.cerEdge;
+			row.edgeHits.cerPosition.assign(counts.cerPosition.begin(), counts.cerPosition.end());
+		}
+
+		// Spill mode: per-muon truth, one entry per primary in track ID order
+		if (_eventActionParameters.enableSpill) FillSpillColumns(event, counts, muonScore, row.spill);
+
+		// The dense vectors stay filled for the other consumers of the row (tensor shards), only the columns are sparse
+		if (_eventActionParameters.sparseEncoding.enabled)
+		{
+			EncodeSparseColumns(row, _eventActionParameters.sparseEncoding.maxOccupancy,
+				_eventActionParameters.enableWeightedYield, digitizer != nullptr);
 		}
 
-		G4int ct = 1 + 2 * nSiPMs;
-		analysisManager->FillNtupleDColumn(ct, scintEdep / eV);			// scint edep
-		analysisManager->FillNtupleDColumn(ct + 1, coatingEdep / eV);		// coating edep
-		analysisManager->FillNtupleDColumn(ct + 2, scintMuPathLength / mm);	// scint mu path length
-		analysisManager->FillNtupleDColumn(ct + 3, muonHitX / mm);			// muon X coordinate on hit
-		analysisManager->FillNtupleDColumn(ct + 4, muonHitY / mm);			// muon Y coordinate on hit 
-		analysisManager->AddNtupleRow();
+		_runAction->AddNtupleRow();
 	}
 
 	#pragma endregion Ntuples
 }
 
-void EventAction::RegisterMuonHit(G4ThreeVector localPos, G4ThreeVector globalPos, G4double tGlob)
+SiliconPMSD* EventAction::GetSiliconPMSD()
+{
+	// Resolved once per thread, the SDs are thread-local like the event actions
+	if (!siliconPMSD)
+	{
+		siliconPMSD = dynamic_cast<SiliconPMSD*>(G4SDManager::GetSDMpointer()->FindSensitiveDetector(_eventActionParameters.siliconPMSDName, false));
+	}
+	return siliconPMSD;
+}
+
+void EventAction::MergeSubEvent(G4Event* masterEvent, const G4Event* subEvent)
 {
+	auto* subEventHits = dynamic_cast<SubEventHits*>(masterEvent->GetUserInformation());
+	G4HCofThisEvent* hce = subEvent->GetHCofThisEvent();
+	if (!subEventHits || !hce) return;
+
+	// Sub-events of the same event can finish at the same time on different threads
+	G4AutoLock lock(&subEventMergeMutex);
+
+	if (auto* counters = static_cast<SiPMCountersCollection*>(hce->GetHC(HitCollectionIDs::Get().siPMCounters)))
+	{
+		subEventHits->counts.Add(counters->counts);
+	}
+}
+
+void EventAction::FillSpillColumns(const G4Event* event, SiPMCounts& counts, const MuonScore& muonScore, SpillColumns& spill)
+{
+	spill.time.clear();
+
+	// The primaries get their track IDs in the order of the vertices and of their particles
+	for (G4int v = 0; v < event->GetNumberOfPrimaryVertex(); v++)
+	{
+		const G4PrimaryVertex* vertex = event->GetPrimaryVertex(v);
+		for (G4int p = 0; p < vertex->GetNumberOfParticle(); p++) spill.time.push_back((G4float)(vertex->GetT0() / ns));
+	}
+
+	const size_t nMuons = spill.time.size();
+	counts.ResizeMuons(nMuons);
+	spill.entryX.assign(nMuons, -1.f);
+	spill.entryY.assign(nMuons, -1.f);
+	spill.entryTime.assign(nMuons, -1.f);
+	spill.scintEdep.assign(nMuons, 0.f);
+	spill.scintOPs.assign(counts.muonScintHits.begin(), counts.muonScintHits.begin() + nMuons);
+	spill.cerOPs.assign(counts.muonCerHits.begin(), counts.muonCerHits.begin() + nMuons);
+
+	for (size_t m = 0; m < nMuons; m++)
+	{
+		if (m < muonScore.muonScintEdep.size()) spill.scintEdep[m] = (G4float)(muonScore.muonScintEdep[m] / eV);
+		if (m < spillEntered.size() && spillEntered[m])
+		{
+			spill.entryX[m] = (G4float)(spillEntryPositions[m].x() / mm);
+			spill.entryY[m] = (G4float)(spillEntryPositions[m].y() / mm);
+			spill.entryTime[m] = (G4float)(spillEntryTimes[m] / ns);
+		}
+	}
+}
+
+void EventAction::RegisterMuonHit(G4int trackID, G4ThreeVector localPos, G4ThreeVector globalPos, G4double tGlob)
+{
+	if (_eventActionParameters.enableSpill && trackID > 0)
+	{
+		const size_t muonIndex = trackID - 1;
+		if (muonIndex >= spillEntered.size())
+		{
+			spillEntered.resize(muonIndex + 1, false);
+			spillEntryTimes.resize(muonIndex + 1, 0.);
+			spillEntryPositions.resize(muonIndex + 1);
+		}
+		// Only the first entry of each muon (it can leave and come back)
+		if (!spillEntered[muonIndex])
+		{
+			spillEntered[muonIndex] = true;
+			spillEntryTimes[muonIndex] = tGlob;
+			spillEntryPositions[muonIndex] = localPos;
+		}
+	}
+
 	// For starting I will assume that only one muon is present per event.
 	// Therefore this logic will need to be revised in case of multiple muons.
 	// To avoid errors in such a scenario, I will always sample just the first muon hit.
@@ -142,10 +380,34 @@ void EventAction::RegisterMuonHit(G4ThreeVector localPos, G4ThreeVector globalPo
 	muonGlobalTime = tGlob;
 }
 
-G4double EventAction::SumOverHC(const G4THitsMap<G4double>* hm)
+void EventAction::AddScintDeposit(const G4ThreeVector& prePos, const G4ThreeVector& postPos, G4double edep)
 {
-	G4double sum = 0.;
-	if (!hm) return 0.;
-	for (const auto& kv : *hm->GetMap()) sum += *(kv.second);
-	return sum;
-}
\ No newline at end of file
+	const auto* table = _eventActionParameters.lightResponseTable;
+	if (!table) return;
+
+	table->AccumulateStep(prePos, postPos, edep * _eventActionParameters.scintYield, expectedScintHits.data());
+}
+
+void EventAction::RecordScintStep(const G4Step* step)
+{
+	const auto* pre = step->GetPreStepPoint();
+	const auto* post = step->GetPostStepPoint();
+	const auto* particle = step->GetTrack()->GetDefinition();
+
+	EdepStepRecord record{};
+	record.preX = (float)(pre->GetPosition().x() / mm);
+	record.preY = (float)(pre->GetPosition().y() / mm);
+	record.preZ = (float)(pre->GetPosition().z() / mm);
+	record.postX = (float)(post->GetPosition().x() / mm);
+	record.postY = (float)(post->GetPosition().y() / mm);
+	record.postZ = (float)(post->GetPosition().z() / mm);
+	record.preTime = (float)(pre->GetGlobalTime() / ns);
+	record.postTime = (float)(post->GetGlobalTime() / ns);
+	record.edep = (float)(step->GetTotalEnergyDeposit() / eV);
+	record.preBeta = (float)pre->GetBeta();
+	record.postBeta = (float)post->GetBeta();
+	record.charge = (float)(particle->GetPDGCharge() / eplus);
+	record.pdg = particle->GetPDGEncoding();
+
+	edepSteps.push_back(record);
+}
@@ -0,0 +1,65 @@
+#include "HotPathDispatch.hh"
+
+#include "G4VProcess.hh"
+#include "G4DynamicParticle.hh"
+#include "G4PrimaryParticle.hh"
+#include "G4SDManager.hh"
+
+#include "OpticsReplay.hh"
+#include "SiPMCounters.hh"
+
+#include <utility>
+#include <vector>
+
+
+OpticalPhotonOrigin GetOpticalPhotonOrigin(const G4Track* track)
+{
+	// Only a handful of processes ever create optical photons, a linear scan beats any map here
+	static thread_local std::vector<std::pair<const G4VProcess*, OpticalPhotonOrigin>> originTable;
+
+	if (const auto* creator = track->GetCreatorProcess())
+	{
+		for (const auto& entry : originTable)
+		{
+			if (entry.first == creator) return entry.second;
+		}
+
+		// First photon of this process on this thread, the only name comparison
+		const G4String& name = creator->GetProcessName();
+		OpticalPhotonOrigin origin = OpticalPhotonOrigin::Other;
+		if (name == "Scintillation") origin = OpticalPhotonOrigin::Scintillation;
+		else if (name == "Cerenkov") origin = OpticalPhotonOrigin::Cerenkov;
+
+		originTable.emplace_back(creator, origin);
+		return origin;
+	}
+
+	if (const auto* primary = track->GetDynamicParticle()->GetPrimaryParticle())
+	{
+		if (const auto* info = dynamic_cast<const ReplayPhotonInfo*>(primary->GetUserInformation()))
+		{
+			return info->GetOrigin();
+		}
+	}
+	return OpticalPhotonOrigin::None;
+}
+
+const G4String& GetOpticalPhotonOriginName(OpticalPhotonOrigin origin)
+{
+	static const G4String names[] = { "none", "Scintillation", "Cerenkov", "other" };
+	return names[static_cast<G4int>(origin)];
+}
+
+const HitCollectionIDs& HitCollectionIDs::Get()
+{
+	static thread_local HitCollectionIDs ids{ -1 };
+	static thread_local G4bool resolved = false;
+
+	if (!resolved)
+	{
+		auto* sdManager = G4SDManager::GetSDMpointer();
+		ids.siPMCounters = sdManager->GetCollectionID(kSiPMCountersName);
+		resolved = true;
+	}
+	return ids;
+}
@@ -0,0 +1,284 @@
+#include "LightResponseTable.hh"
+
+#include "G4AutoLock.hh"
+#include "G4SystemOfUnits.hh"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+
+namespace { G4Mutex lrfMergeMutex = G4MUTEX_INITIALIZER; }
+
+G4ThreadLocal LightResponseTableBuilder::ThreadData* LightResponseTableBuilder::fThreadData = nullptr;
+
+
+#pragma region LightResponseTable
+
+LightResponseTable::LightResponseTable(const G4String& filename)
+{
+	// Map the whole file read-only, the OS will page it in on demand
+#ifdef _WIN32
+	HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		G4cerr << "[LightResponseTable] Could not open file: " << filename << G4endl;
+		return;
+	}
+	LARGE_INTEGER fileSize;
+	GetFileSizeEx(file, &fileSize);
+	HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!mapping)
+	{
+		CloseHandle(file);
+		G4cerr << "[LightResponseTable] Could not map file: " << filename << G4endl;
+		return;
+	}
+	_fileHandle = file;
+	_mappingHandle = mapping;
+	_mappedSize = (size_t)fileSize.QuadPart;
+	_mappedData = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0)
+	{
+		G4cerr << "[LightResponseTable] Could not open file: " << filename << G4endl;
+		return;
+	}
+	struct stat st;
+	fstat(fd, &st);
+	_mappedSize = (size_t)st.st_size;
+	void* data = mmap(nullptr, _mappedSize, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd); // the mapping stays valid after closing the descriptor
+	_mappedData = (data == MAP_FAILED) ? nullptr : data;
+#endif
+
+	if (!_mappedData || _mappedSize < sizeof(Header))
+	{
+		G4cerr << "[LightResponseTable] Could not map file: " << filename << G4endl;
+		Unmap();
+		return;
+	}
+
+	// Validate the header before trusting the content
+	auto* header = static_cast<const Header*>(_mappedData);
+	const size_t nCells = (size_t)header->nx * header->ny * header->nz;
+	const size_t expectedSize = sizeof(Header) + nCells * header->nSiPMs * sizeof(float);
+
+	if (std::strncmp(header->magic, "HODOLRF", 8) != 0 || header->version != kVersion || _mappedSize != expectedSize)
+	{
+		G4cerr << "[LightResponseTable] Invalid or corrupted table: " << filename << G4endl;
+		Unmap();
+		return;
+	}
+
+	_header = header;
+	_probabilities = reinterpret_cast<const float*>(static_cast<const char*>(_mappedData) + sizeof(Header));
+
+	_cellSizeX = 2 * _header->halfX / _header->nx;
+	_cellSizeY = 2 * _header->halfY / _header->ny;
+	_cellSizeZ = 2 * _header->halfZ / _header->nz;
+
+	G4cout << "[LightResponseTable] Loaded " << filename << " (" << _header->nx << "x" << _header->ny << "x" << _header->nz
+		<< " cells, " << _header->nSiPMs << " SiPMs)" << G4endl;
+}
+
+LightResponseTable::~LightResponseTable()
+{
+	Unmap();
+}
+
+void LightResponseTable::Unmap()
+{
+#ifdef _WIN32
+	if (_mappedData) UnmapViewOfFile(_mappedData);
+	if (_mappingHandle) CloseHandle((HANDLE)_mappingHandle);
+	if (_fileHandle) CloseHandle((HANDLE)_fileHandle);
+	_mappingHandle = nullptr;
+	_fileHandle = nullptr;
+#else
+	if (_mappedData) munmap(_mappedData, _mappedSize);
+#endif
+	_mappedData = nullptr;
+	_mappedSize = 0;
+	_header = nullptr;
+	_probabilities = nullptr;
+}
+
+G4int LightResponseTable::GetCellIndex(const G4ThreeVector& position) const
+{
+	// The table is written in mm
+	const G4double x = position.x() / mm + _header->halfX;
+	const G4double y = position.y() / mm + _header->halfY;
+	const G4double z = position.z() / mm + _header->halfZ;
+
+	if (x < 0 || y < 0 || z < 0) return -1;
+
+	const G4int ix = (G4int)(x / _cellSizeX);
+	const G4int iy = (G4int)(y / _cellSizeY);
+	const G4int iz = (G4int)(z / _cellSizeZ);
+
+	if (ix >= (G4int)_header->nx || iy >= (G4int)_header->ny || iz >= (G4int)_header->nz) return -1;
+
+	return (iz * (G4int)_header->ny + iy) * (G4int)_header->nx + ix;
+}
+
+void LightResponseTable::AccumulateStep(const G4ThreeVector& pre, const G4ThreeVector& post, G4double nPhotons, G4double* expected) const
+{
+	// The step is split in segments no longer than the smallest cell,
+	// so that a long muon step crossing several cells is sampled correctly.
+	const G4ThreeVector delta = post - pre;
+	const G4double minCellSize = std::min({ _cellSizeX, _cellSizeY, _cellSizeZ }) * mm;
+	const G4int nSegments = std::max(1, (G4int)std::ceil(delta.mag() / minCellSize));
+	const G4double photonsPerSegment = nPhotons / nSegments;
+	const G4int nSiPMs = (G4int)_header->nSiPMs;
+
+	for (G4int s = 0; s < nSegments; s++)
+	{
+		const G4int cell = GetCellIndex(pre + delta * ((s + 0.5) / nSegments));
+		if (cell < 0) continue;
+
+		const float* response = GetCellResponse(cell);
+		for (G4int i = 0; i < nSiPMs; i++)
+		{
+			expected[i] += photonsPerSegment * response[i];
+		}
+	}
+}
+
+#pragma endregion LightResponseTable
+
+
+#pragma region LightResponseTableBuilder
+
+LightResponseTableBuilder::LightResponseTableBuilder(FastOpticsSettings settings, G4double halfX, G4double halfY, G4double halfZ, G4int nSiPMs)
+{
+	_settings = settings;
+	_halfX = halfX;
+	_halfY = halfY;
+	_halfZ = halfZ;
+	_nSiPMs = nSiPMs;
+	_nCells = settings.gridX * settings.gridY * settings.gridZ;
+
+	_emitted.assign(_nCells, 0.);
+	_detected.assign((size_t)_nCells * _nSiPMs, 0.);
+}
+
+LightResponseTableBuilder::~LightResponseTableBuilder() {}
+
+LightResponseTableBuilder::ThreadData* LightResponseTableBuilder::GetThreadData()
+{
+	if (!fThreadData)
+	{
+		fThreadData = new ThreadData();
+		fThreadData->emitted.assign(_nCells, 0.);
+		fThreadData->detected.assign((size_t)_nCells * _nSiPMs, 0.);
+	}
+	return fThreadData;
+}
+
+G4int LightResponseTableBuilder::GetCellIndex(const G4ThreeVector& position) const
+{
+	// The plate is placed in the origin of the world without rotations,
+	// so global and local coordinates coincide.
+	const G4double x = position.x() + _halfX;
+	const G4double y = position.y() + _halfY;
+	const G4double z = position.z() + _halfZ;
+
+	if (x < 0 || y < 0 || z < 0) return -1;
+
+	const G4int ix = (G4int)(x / (2 * _halfX) * _settings.gridX);
+	const G4int iy = (G4int)(y / (2 * _halfY) * _settings.gridY);
+	const G4int iz = (G4int)(z / (2 * _halfZ) * _settings.gridZ);
+
+	if (ix >= _settings.gridX || iy >= _settings.gridY || iz >= _settings.gridZ) return -1;
+
+	return (iz * _settings.gridY + iy) * _settings.gridX + ix;
+}
+
+void LightResponseTableBuilder::RecordEmission(const G4ThreeVector& position, G4double weight)
+{
+	const G4int cell = GetCellIndex(position);
+	if (cell < 0) return;
+	GetThreadData()->emitted[cell] += weight;
+}
+
+void LightResponseTableBuilder::RecordDetection(const G4ThreeVector& emissionPosition, G4int siPMID, G4double weight)
+{
+	const G4int cell = GetCellIndex(emissionPosition);
+	if (cell < 0 || siPMID < 0 || siPMID >= _nSiPMs) return;
+	GetThreadData()->detected[(size_t)cell * _nSiPMs + siPMID] += weight;
+}
+
+void LightResponseTableBuilder::MergeThreadData()
+{
+	if (!fThreadData) return;
+
+	G4AutoLock lock(&lrfMergeMutex);
+
+	for (G4int c = 0; c < _nCells; c++) _emitted[c] += fThreadData->emitted[c];
+	for (size_t k = 0; k < _detected.size(); k++) _detected[k] += fThreadData->detected[k];
+
+	delete fThreadData;
+	fThreadData = nullptr;
+}
+
+G4bool LightResponseTableBuilder::WriteTable() const
+{
+	LightResponseTable::Header header{};
+	std::strncpy(header.magic, "HODOLRF", 8);
+	header.version = LightResponseTable::kVersion;
+	header.nSiPMs = (std::uint32_t)_nSiPMs;
+	header.nx = (std::uint32_t)_settings.gridX;
+	header.ny = (std::uint32_t)_settings.gridY;
+	header.nz = (std::uint32_t)_settings.gridZ;
+	header.halfX = _halfX / mm;
+	header.halfY = _halfY / mm;
+	header.halfZ = _halfZ / mm;
+
+	// Detection probability = detected / emitted, cells that were never populated are left at 0
+	std::vector<float> probabilities((size_t)_nCells * _nSiPMs, 0.f);
+	G4double totalEmitted = 0.;
+	G4int emptyCells = 0;
+	for (G4int c = 0; c < _nCells; c++)
+	{
+		totalEmitted += _emitted[c];
+		if (_emitted[c] <= 0.)
+		{
+			emptyCells++;
+			continue;
+		}
+		for (G4int i = 0; i < _nSiPMs; i++)
+		{
+			probabilities[(size_t)c * _nSiPMs + i] = (float)(_detected[(size_t)c * _nSiPMs + i] / _emitted[c]);
+		}
+	}
+
+	std::ofstream out(_settings.tableFile, std::ios::binary);
+	if (!out)
+	{
+		G4cerr << "[LightResponseTableBuilder] Could not open file: " << _settings.tableFile << G4endl;
+		return false;
+	}
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.write(reinterpret_cast<const char*>(probabilities.data()), probabilities.size() * sizeof(float));
+
+	G4cout << "[LightResponseTableBuilder] Written " << _settings.tableFile << " from " << totalEmitted << " emitted photons";
+	if (emptyCells > 0) G4cout << " (" << emptyCells << "/" << _nCells << " cells without statistics)";
+	G4cout << G4endl;
+
+	return true;
+}
+
+#pragma endregion LightResponseTableBuilder
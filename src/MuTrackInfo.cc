@@ -0,0 +1,4 @@
+#include "MuTrackInfo.hh"
+
+
+G4ThreadLocal G4Allocator<MuTrackInfo>* MuTrackInfoAllocator = nullptr;
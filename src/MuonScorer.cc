@@ -0,0 +1,78 @@
+#include "MuonScorer.hh"
+
+#include "G4LogicalVolumeStore.hh"
+#include "G4VTouchable.hh"
+
+
+MuonScorer::MuonScorer(const G4String& scintLVName, const G4String& coatingLVName)
+{
+	_scintLVName = scintLVName;
+	_coatingLVName = coatingLVName;
+}
+
+void MuonScorer::Reset()
+{
+	// The per-muon vector keeps its capacity from spill to spill
+	std::vector<G4double> muonScintEdep = std::move(_score.muonScintEdep);
+	muonScintEdep.clear();
+	_score = MuonScore();
+	_score.muonScintEdep = std::move(muonScintEdep);
+	inPassage = false;
+	passageLength = 0.;
+}
+
+void MuonScorer::ResolveVolumes()
+{
+	auto* store = G4LogicalVolumeStore::GetInstance();
+	scintLV = store->GetVolume(_scintLVName);
+	coatingLV = store->GetVolume(_coatingLVName);
+}
+
+void MuonScorer::ProcessStep(const G4Step* step)
+{
+	if (!scintLV) ResolveVolumes();
+
+	const auto* preStep = step->GetPreStepPoint();
+	const auto* postStep = step->GetPostStepPoint();
+
+	const auto* prePV = preStep->GetPhysicalVolume();
+	if (!prePV) return;
+	const auto* preLV = prePV->GetLogicalVolume();
+
+	// Same weighting of G4PSEnergyDeposit
+	const G4double edep = step->GetTotalEnergyDeposit() * preStep->GetWeight();
+
+	if (preLV == coatingLV)
+	{
+		_score.coatingEdep += edep;
+		return;
+	}
+
+	if (preLV != scintLV) return;
+
+	_score.scintEdep += edep;
+
+	const size_t muonIndex = step->GetTrack()->GetTrackID() - 1;
+	if (muonIndex >= _score.muonScintEdep.size()) _score.muonScintEdep.resize(muonIndex + 1, 0.);
+	_score.muonScintEdep[muonIndex] += edep;
+
+	// The path length is only counted for a muon that crossed the scintillator from boundary to boundary,
+	// a muon stopping inside doesn't contribute (same as G4PSPassageTrackLength)
+	if (preStep->GetStepStatus() == fGeomBoundary)
+	{
+		inPassage = true;
+		passageLength = 0.;
+	}
+	if (inPassage) passageLength += step->GetStepLength();
+
+	if (postStep->GetStepStatus() != fGeomBoundary) return;
+
+	if (inPassage) _score.scintPathLength += passageLength;
+	inPassage = false;
+
+	// The post-step touchable is already the volume across the boundary, the scintillator frame is the pre-step one
+	_score.exitedScint = true;
+	_score.exitLocalPosition = preStep->GetTouchable()->GetHistory()->GetTopTransform().TransformPoint(postStep->GetPosition());
+	_score.exitDirection = postStep->GetMomentumDirection();
+	_score.exitKineticEnergy = postStep->GetKineticEnergy();
+}
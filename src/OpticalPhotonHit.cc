@@ -45,6 +45,16 @@ void OpticalPhotonHit::SetSiPMID(G4int siPMID)
 	_siPMID = siPMID;
 }
 
+void OpticalPhotonHit::SetWeight(G4double weight)
+{
+	_weight = weight;
+}
+
+void OpticalPhotonHit::SetEdgePosition(G4double edgePosition)
+{
+	_edgePosition = edgePosition;
+}
+
 
 G4ThreadLocal G4Allocator<OpticalPhotonHit>* OpticalPhotonHitAllocator = nullptr;
 
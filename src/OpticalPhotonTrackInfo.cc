@@ -0,0 +1,37 @@
+#include "OpticalPhotonTrackInfo.hh"
+
+
+G4ThreadLocal G4Allocator<OpticalPhotonTrackInfo>* OpticalPhotonTrackInfoAllocator = nullptr;
+
+
+namespace
+{
+	struct SideTableEntry {
+		G4int trackID = -1;
+		OpticalPhotonTrackInfo counters;
+	};
+
+	SideTableEntry& SideTable()
+	{
+		static thread_local SideTableEntry entry;
+		return entry;
+	}
+}
+
+
+OpticalPhotonTrackInfo* OpticalPhotonTrackInfo::Get(const G4Track* track)
+{
+	if (auto* info = track->GetUserInformation()) return static_cast<OpticalPhotonTrackInfo*>(info);
+
+	auto& entry = SideTable();
+	return (entry.trackID == track->GetTrackID()) ? &entry.counters : nullptr;
+}
+
+void OpticalPhotonTrackInfo::BeginSideTableTrack(G4int trackID)
+{
+	auto& entry = SideTable();
+	entry.trackID = trackID;
+	entry.counters.nReflections = 0;
+	entry.counters.nReflectionsAtCoating = 0;
+	entry.counters.scintPathLength = 0.;
+}
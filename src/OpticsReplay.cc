@@ -0,0 +1,212 @@
+#include "OpticsReplay.hh"
+
+#include "G4LogicalVolumeStore.hh"
+#include "G4LogicalVolume.hh"
+#include "G4Material.hh"
+#include "G4MaterialPropertiesTable.hh"
+#include "G4PrimaryVertex.hh"
+#include "G4OpticalPhoton.hh"
+#include "G4RandomDirection.hh"
+#include "G4Poisson.hh"
+#include "G4PhysicalConstants.hh"
+#include "G4SystemOfUnits.hh"
+#include "Randomize.hh"
+
+#include <algorithm>
+#include <cmath>
+
+
+#pragma region Replay Information
+
+void ReplayPhotonInfo::Print() const
+{
+	G4cout << "[ReplayPhotonInfo] replayed " << GetOpticalPhotonOriginName(GetOrigin()) << " photon" << G4endl;
+}
+
+void ReplayEventInfo::Print() const
+{
+	G4cout << "[ReplayEventInfo] stage 1 event " << _record.eventID << ", " << _record.nSteps << " steps" << G4endl;
+}
+
+#pragma endregion Replay Information
+
+
+#pragma region OpticalPhotonReplayer
+
+OpticalPhotonReplayer::OpticalPhotonReplayer(const G4String& scintLVName)
+{
+	_scintLVName = scintLVName;
+}
+
+OpticalPhotonReplayer::~OpticalPhotonReplayer() {}
+
+void OpticalPhotonReplayer::Initialize()
+{
+	// The geometry doesn't exist yet when the actions are built, so I read the material on the first event
+	_isInitialized = true;
+
+	auto* scintLV = G4LogicalVolumeStore::GetInstance()->GetVolume(_scintLVName);
+	auto* mpt = scintLV ? scintLV->GetMaterial()->GetMaterialPropertiesTable() : nullptr;
+	if (!mpt)
+	{
+		G4cerr << "[OpticalPhotonReplayer] No optical properties for " << _scintLVName << ", no photon will be replayed" << G4endl;
+		return;
+	}
+
+	_scintYield = mpt->GetConstProperty("SCINTILLATIONYIELD");
+	_decayTime = mpt->GetConstProperty("SCINTILLATIONTIMECONSTANT1");
+
+	// Cumulative of the emission spectrum (trapezoidal rule, the same G4Scintillation integrates)
+	auto* emission = mpt->GetProperty("SCINTILLATIONCOMPONENT1");
+	const size_t nEntries = emission->GetVectorLength();
+	_emissionEnergy.resize(nEntries);
+	_emissionCDF.resize(nEntries);
+	for (size_t i = 0; i < nEntries; i++)
+	{
+		_emissionEnergy[i] = emission->Energy(i);
+		_emissionCDF[i] = (i == 0) ? 0. :
+			_emissionCDF[i - 1] + 0.5 * ((*emission)[i] + (*emission)[i - 1]) * (_emissionEnergy[i] - _emissionEnergy[i - 1]);
+	}
+	for (auto& value : _emissionCDF) value /= _emissionCDF.back();
+
+	_rIndex = mpt->GetProperty("RINDEX");
+	_maxRIndex = _rIndex->GetMaxValue();
+}
+
+G4int OpticalPhotonReplayer::GeneratePhotons(G4Event* event, const std::vector<EdepStepRecord>& steps)
+{
+	if (!_isInitialized) Initialize();
+	if (!_rIndex) return 0;
+
+	const G4int nBefore = event->GetNumberOfPrimaryVertex();
+
+	for (const auto& step : steps)
+	{
+		if (step.edep > 0) AddScintillationPhotons(event, step);
+		if (step.charge != 0) AddCerenkovPhotons(event, step);
+	}
+
+	return event->GetNumberOfPrimaryVertex() - nBefore;
+}
+
+void OpticalPhotonReplayer::AddScintillationPhotons(G4Event* event, const EdepStepRecord& step)
+{
+	const G4int nPhotons = (G4int)G4Poisson(_scintYield * step.edep * eV);
+
+	const G4ThreeVector pre(step.preX * mm, step.preY * mm, step.preZ * mm);
+	const G4ThreeVector delta = G4ThreeVector(step.postX * mm, step.postY * mm, step.postZ * mm) - pre;
+	const G4double preTime = step.preTime * ns;
+	const G4double deltaTime = step.postTime * ns - preTime;
+
+	for (G4int i = 0; i < nPhotons; i++)
+	{
+		const G4double fraction = G4UniformRand();
+		const G4double time = preTime + fraction * deltaTime - _decayTime * std::log(G4UniformRand());
+
+		// Isotropic emission, random linear polarization perpendicular to the direction
+		const G4ThreeVector direction = G4RandomDirection();
+		const G4ThreeVector perpendicular = direction.orthogonal().unit();
+		const G4double phi = twopi * G4UniformRand();
+		const G4ThreeVector polarization = std::cos(phi) * perpendicular + std::sin(phi) * direction.cross(perpendicular);
+
+		AddPhoton(event, pre + fraction * delta, time, SampleScintillationEnergy(), direction, polarization, false);
+	}
+}
+
+void OpticalPhotonReplayer::AddCerenkovPhotons(G4Event* event, const EdepStepRecord& step)
+{
+	const G4ThreeVector pre(step.preX * mm, step.preY * mm, step.preZ * mm);
+	const G4ThreeVector delta = G4ThreeVector(step.postX * mm, step.postY * mm, step.postZ * mm) - pre;
+	const G4double stepLength = delta.mag();
+	if (stepLength <= 0.) return;
+
+	const G4double beta = 0.5 * (step.preBeta + step.postBeta);
+	if (beta * _maxRIndex <= 1.) return; // below threshold everywhere
+
+	const G4int nPhotons = (G4int)G4Poisson(CerenkovPhotonsPerLength(beta, step.charge) * stepLength);
+
+	const G4ThreeVector p0 = delta.unit();
+	const G4double preTime = step.preTime * ns;
+	const G4double deltaTime = step.postTime * ns - preTime;
+	const G4double betaInverse = 1. / beta;
+	const G4double maxCos = betaInverse / _maxRIndex;
+	const G4double maxSin2 = (1. - maxCos) * (1. + maxCos);
+	const G4double minEnergy = _rIndex->GetMinEnergy();
+	const G4double maxEnergy = _rIndex->GetMaxEnergy();
+
+	for (G4int i = 0; i < nPhotons; i++)
+	{
+		// Same sampling as G4Cerenkov: flat in energy, accepted with probability sin^2(theta) / sin^2(theta_max)
+		G4double energy, cosTheta, sin2Theta;
+		do
+		{
+			energy = minEnergy + G4UniformRand() * (maxEnergy - minEnergy);
+			cosTheta = betaInverse / _rIndex->Value(energy);
+			sin2Theta = (1. - cosTheta) * (1. + cosTheta);
+		} while (G4UniformRand() * maxSin2 > sin2Theta);
+
+		const G4double sinTheta = std::sqrt(std::max(sin2Theta, 0.));
+		const G4double phi = twopi * G4UniformRand();
+		const G4double cosPhi = std::cos(phi);
+		const G4double sinPhi = std::sin(phi);
+
+		// Photons on the cone around the step direction, polarized in the plane of the cone
+		G4ThreeVector direction(sinTheta * cosPhi, sinTheta * sinPhi, cosTheta);
+		direction.rotateUz(p0);
+		G4ThreeVector polarization(cosTheta * cosPhi, cosTheta * sinPhi, -sinTheta);
+		polarization.rotateUz(p0);
+
+		const G4double fraction = G4UniformRand();
+		AddPhoton(event, pre + fraction * delta, preTime + fraction * deltaTime, energy, direction, polarization, true);
+	}
+}
+
+void OpticalPhotonReplayer::AddPhoton(G4Event* event, const G4ThreeVector& position, G4double time, G4double energy,
+	const G4ThreeVector& direction, const G4ThreeVector& polarization, G4bool isCerenkov)
+{
+	auto* photon = new G4PrimaryParticle(G4OpticalPhoton::Definition());
+	photon->SetKineticEnergy(energy);
+	photon->SetMomentumDirection(direction);
+	photon->SetPolarization(polarization);
+	photon->SetUserInformation(new ReplayPhotonInfo(isCerenkov));
+
+	auto* vertex = new G4PrimaryVertex(position, time);
+	vertex->SetPrimary(photon);
+	event->AddPrimaryVertex(vertex);
+}
+
+G4double OpticalPhotonReplayer::SampleScintillationEnergy() const
+{
+	const G4double u = G4UniformRand();
+	const size_t k = std::min<size_t>(
+		std::upper_bound(_emissionCDF.begin(), _emissionCDF.end(), u) - _emissionCDF.begin(),
+		_emissionCDF.size() - 1
+	);
+	if (k == 0) return _emissionEnergy.front();
+
+	// Linear interpolation of the inverse cumulative
+	const G4double width = _emissionCDF[k] - _emissionCDF[k - 1];
+	const G4double t = (width > 0.) ? (u - _emissionCDF[k - 1]) / width : 0.;
+	return _emissionEnergy[k - 1] + t * (_emissionEnergy[k] - _emissionEnergy[k - 1]);
+}
+
+G4double OpticalPhotonReplayer::CerenkovPhotonsPerLength(G4double beta, G4double charge) const
+{
+	// Frank-Tamm: dN/dx = Rfact * z^2 * integral of (1 - 1 / (beta n(E))^2) dE over the energies above threshold
+	const G4double Rfact = 369.81 / (eV * cm);
+	const G4double beta2 = beta * beta;
+
+	G4double integral = 0.;
+	for (size_t i = 1; i < _rIndex->GetVectorLength(); i++)
+	{
+		const G4double n0 = (*_rIndex)[i - 1];
+		const G4double n1 = (*_rIndex)[i];
+		const G4double f0 = std::max(0., 1. - 1. / (beta2 * n0 * n0));
+		const G4double f1 = std::max(0., 1. - 1. / (beta2 * n1 * n1));
+		integral += 0.5 * (f0 + f1) * (_rIndex->Energy(i) - _rIndex->Energy(i - 1));
+	}
+
+	return Rfact * charge * charge * integral;
+}
+
+#pragma endregion OpticalPhotonReplayer
@@ -0,0 +1,88 @@
+#include "OutputRotation.hh"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+
+
+OutputRotation::OutputRotation(const OutputRotationSettings& settings)
+{
+	_settings = settings;
+}
+
+G4int OutputRotation::NextChunkEvents(G4int remaining) const
+{
+	G4int nEvents = std::min(remaining, _settings.eventsPerFile);
+
+	// No estimate before the first chunk is closed, it gets the full event count
+	if (_settings.maxFileSize > 0 && _bytesPerEvent > 0)
+	{
+		nEvents = std::min(nEvents, std::max(1, (G4int)(_settings.maxFileSize / _bytesPerEvent)));
+	}
+	return nEvents;
+}
+
+std::string OutputRotation::GetChunkFileName(const std::string& outputFile, G4int chunk)
+{
+	const std::filesystem::path path(outputFile);
+
+	char index[16];
+	std::snprintf(index, sizeof(index), "_%04d", chunk);
+	return path.stem().string() + index + path.extension().string();
+}
+
+void OutputRotation::ChunkClosed(const std::string& outputDir, const std::string& outputFile, G4int chunk, G4int nEvents, const std::vector<std::string>& files)
+{
+	namespace fs = std::filesystem;
+
+	const fs::path manifestPath = fs::path(outputDir) / (fs::path(outputFile).stem().string() + "_manifest.txt");
+	const G4bool newManifest = !fs::exists(manifestPath);
+
+	// Appended and closed every chunk, a reader never sees a file that is still being written
+	std::ofstream manifest(manifestPath, std::ios::app);
+	if (!manifest)
+	{
+		G4cerr << "[OutputRotation] Could not open the manifest " << manifestPath.string() << G4endl;
+	}
+	if (newManifest) manifest << "# chunk\tfirst_event\tevents\tbytes\tfile\n";
+
+	std::uintmax_t largestFile = 0;
+	for (const auto& file : files)
+	{
+		std::error_code ec;
+		const std::uintmax_t bytes = fs::file_size(fs::path(outputDir) / file, ec);
+		if (ec) continue;
+
+		largestFile = std::max(largestFile, bytes);
+		manifest << chunk << '\t' << _eventIDOffset << '\t' << nEvents << '\t' << bytes << '\t' << file << '\n';
+	}
+	manifest.close();
+
+	if (nEvents > 0 && largestFile > 0) _bytesPerEvent = (G4double)largestFile / nEvents;
+	_eventIDOffset += nEvents;
+
+	G4cout << "[OutputRotation] Chunk " << chunk << " closed: " << nEvents << " events, " << largestFile / 1024 << " kB" << G4endl;
+}
+
+
+void RollingRunManager::BeamOn(G4int nEvents, const char* macroFile, G4int nSelect)
+{
+	// Every chunk is a run of its own, the RunAction closes its files and updates the rotation before the next one
+	if (nEvents <= 0)
+	{
+		G4MTRunManager::BeamOn(nEvents, macroFile, nSelect);
+		return;
+	}
+
+	G4int remaining = nEvents;
+	while (remaining > 0)
+	{
+		const G4int chunkEvents = _rotation->NextChunkEvents(remaining);
+		G4MTRunManager::BeamOn(chunkEvents, macroFile, nSelect);
+		remaining -= chunkEvents;
+
+		if (runAborted) break;	// /run/abort stops the whole beamOn, not only the chunk
+	}
+}
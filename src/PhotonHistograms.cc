@@ -0,0 +1,133 @@
+#include "PhotonHistograms.hh"
+
+#include "G4AnalysisManager.hh"
+
+
+#pragma region FixedBinH1
+
+FixedBinH1::FixedBinH1(const FixedBinAxis& axis)
+{
+	_axis = axis;
+	_invWidth = axis.nBins / (axis.max - axis.min);
+	_bins.assign(axis.nBins + 2, 0.);
+}
+
+void FixedBinH1::FillBatch(const std::vector<G4double>& values, const std::vector<G4double>& weights, G4double scale)
+{
+	// The indices are computed in a separate loop without branches, so that it can be vectorized
+	_indices.resize(values.size());
+	for (size_t i = 0; i < values.size(); i++) _indices[i] = Index(values[i]);
+	for (size_t i = 0; i < _indices.size(); i++) _bins[_indices[i]] += weights[i] * scale;
+}
+
+void FixedBinH1::MergeInto(G4int h1ID) const
+{
+	auto* analysisManager = G4AnalysisManager::Instance();
+	for (size_t i = 0; i < _bins.size(); i++)
+	{
+		if (_bins[i] != 0.) analysisManager->FillH1(h1ID, Center((G4int)i), _bins[i]);
+	}
+}
+
+void FixedBinH1::Reset()
+{
+	std::fill(_bins.begin(), _bins.end(), 0.);
+}
+
+#pragma endregion FixedBinH1
+
+
+#pragma region FixedBinH2
+
+FixedBinH2::FixedBinH2(const FixedBinAxis& xAxis, const FixedBinAxis& yAxis) : _x(xAxis), _y(yAxis)
+{
+	_nx = xAxis.nBins + 2;
+	_bins.assign(_nx * (yAxis.nBins + 2), 0.);
+}
+
+void FixedBinH2::FillBatch(const std::vector<G4double>& xs, const std::vector<G4double>& ys, const std::vector<G4double>& weights, G4double scale)
+{
+	_indices.resize(xs.size());
+	for (size_t i = 0; i < xs.size(); i++) _indices[i] = _y.Index(ys[i]) * _nx + _x.Index(xs[i]);
+	for (size_t i = 0; i < _indices.size(); i++) _bins[_indices[i]] += weights[i] * scale;
+}
+
+void FixedBinH2::MergeInto(G4int h2ID) const
+{
+	auto* analysisManager = G4AnalysisManager::Instance();
+	for (size_t i = 0; i < _bins.size(); i++)
+	{
+		if (_bins[i] == 0.) continue;
+		const G4int ix = (G4int)i % _nx;
+		const G4int iy = (G4int)i / _nx;
+		analysisManager->FillH2(h2ID, _x.Center(ix), _y.Center(iy), _bins[i]);
+	}
+}
+
+void FixedBinH2::Reset()
+{
+	std::fill(_bins.begin(), _bins.end(), 0.);
+}
+
+#pragma endregion FixedBinH2
+
+
+#pragma region PhotonHistograms
+
+PhotonHistograms::PhotonHistograms()
+	: energyH1(kEnergyAxis), timeH1(kTimeAxis), spreadH2(kSpreadAxis, kSpreadAxis)
+{}
+
+PhotonHistograms& PhotonHistograms::Get()
+{
+	static thread_local PhotonHistograms histograms;
+	return histograms;
+}
+
+void PhotonHistograms::Configure(G4int prescale)
+{
+	_prescale = prescale;
+	_skipped = 0;
+
+	energies.clear();
+	times.clear();
+	xs.clear();
+	ys.clear();
+	weights.clear();
+
+	energyH1.Reset();
+	timeH1.Reset();
+	spreadH2.Reset();
+}
+
+void PhotonHistograms::Flush()
+{
+	if (energies.empty()) return;
+
+	// Photon weight (weighted yield mode) times the prescale
+	const G4double scale = _prescale;
+	energyH1.FillBatch(energies, weights, scale);
+	timeH1.FillBatch(times, weights, scale);
+	spreadH2.FillBatch(xs, ys, weights, scale);
+
+	energies.clear();
+	times.clear();
+	xs.clear();
+	ys.clear();
+	weights.clear();
+}
+
+void PhotonHistograms::MergeIntoAnalysis()
+{
+	Flush();
+
+	energyH1.MergeInto(0);
+	timeH1.MergeInto(1);
+	spreadH2.MergeInto(0);
+
+	energyH1.Reset();
+	timeH1.Reset();
+	spreadH2.Reset();
+}
+
+#pragma endregion PhotonHistograms
@@ -0,0 +1,64 @@
+#include "PhotonRecord.hh"
+
+#include "G4AutoLock.hh"
+#include "G4SystemOfUnits.hh"
+
+#include <cstring>
+
+
+namespace { G4Mutex photonRecordMutex = G4MUTEX_INITIALIZER; }
+
+
+PhotonRecordWriter::PhotonRecordWriter(const G4String& filename, G4int nSiPMs)
+{
+	_out.open(filename, std::ios::binary | std::ios::trunc);
+	if (!_out)
+	{
+		G4cerr << "[PhotonRecordWriter] Could not open file: " << filename << G4endl;
+		return;
+	}
+
+	std::strncpy(_header.magic, "HODOPHR", 8);
+	_header.version = kPhotonRecordVersion;
+	_header.nSiPMs = (std::uint32_t)nSiPMs;
+
+	// The header is written again on close, with the number of events and the reference optics filled in
+	WriteHeader();
+
+	G4cout << "[PhotonRecordWriter] Recording detected photons to " << filename << G4endl;
+}
+
+PhotonRecordWriter::~PhotonRecordWriter()
+{
+	if (!_out.is_open()) return;
+
+	_out.seekp(0);
+	WriteHeader();
+	_out.close();
+
+	G4cout << "[PhotonRecordWriter] Written " << _header.nEvents << " events, " << _nPhotons << " detected photons" << G4endl;
+}
+
+void PhotonRecordWriter::WriteHeader()
+{
+	_out.write(reinterpret_cast<const char*>(&_header), sizeof(_header));
+}
+
+void PhotonRecordWriter::SetReferenceOptics(G4double coatingReflectivity, G4double absLength, G4double yieldFactor)
+{
+	_header.coatingReflectivity = (float)coatingReflectivity;
+	_header.absLength = (float)(absLength / mm);
+	_header.yieldFactor = (float)yieldFactor;
+}
+
+void PhotonRecordWriter::WriteEvent(const std::vector<DetectedPhotonRecord>& photons)
+{
+	if (!_out.is_open()) return;
+
+	G4AutoLock lock(&photonRecordMutex);
+
+	_out.write(reinterpret_cast<const char*>(photons.data()), photons.size() * sizeof(DetectedPhotonRecord));
+
+	_header.nEvents++;
+	_nPhotons += photons.size();
+}
@@ -5,6 +5,15 @@
 #include "G4ParticleDefinition.hh"
 #include "G4SystemOfUnits.hh"
 #include "G4GeneralParticleSource.hh"
+#include "G4RunManager.hh"
+#include "G4PrimaryVertex.hh"
+#include "G4PrimaryParticle.hh"
+#include "G4Poisson.hh"
+#include "Randomize.hh"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
 
 
 PrimaryGeneratorAction::PrimaryGeneratorAction(PrimaryGeneratorActionParameters primaryGeneratorActionParameters) {
@@ -96,14 +105,107 @@ void PrimaryGeneratorAction::BuildGPS()
 PrimaryGeneratorAction::~PrimaryGeneratorAction() {
     delete particleGun;
     delete gps;
+    delete replayer;
 }
 
 void PrimaryGeneratorAction::GeneratePrimaries(G4Event* anEvent) {
     
+    if (_primaryGeneratorActionParameters.edepStreamReader)
+    {
+        GenerateReplayPrimaries(anEvent);
+        return;
+    }
+
     auto particleGunSettings = _primaryGeneratorActionParameters.particleGunSettings;
     auto gpsSettings = _primaryGeneratorActionParameters.gpsSettings;
     
-    if (particleGunSettings.isActive) particleGun->GeneratePrimaryVertex(anEvent);
-    if (gpsSettings.isActive) gps->GeneratePrimaryVertex(anEvent);
+    // Spill mode: the sources are fired once per muon and all the vertices of a muon share its arrival time.
+    // A spill can also be empty, the event is then written with no signal (it still counts for the intensity).
+    const SpillSettings& spillSettings = _primaryGeneratorActionParameters.spillSettings;
+    const G4int nMuons = spillSettings.enabled ? (G4int)G4Poisson(spillSettings.meanMuons) : 1;
+
+    for (G4int m = 0; m < nMuons; m++)
+    {
+        const G4int firstVertex = anEvent->GetNumberOfPrimaryVertex();
+
+        if (particleGunSettings.isActive) particleGun->GeneratePrimaryVertex(anEvent);
+        if (gpsSettings.isActive) gps->GeneratePrimaryVertex(anEvent);
+
+        if (!spillSettings.enabled) continue;
+
+        const G4double t0 = SampleSpillTime();
+        for (G4int v = firstVertex; v < anEvent->GetNumberOfPrimaryVertex(); v++) anEvent->GetPrimaryVertex(v)->SetT0(t0);
+    }
+
+    // Geometric trigger: the EventAction aborts the event before any particle is tracked
+    const auto& triggerSettings = _primaryGeneratorActionParameters.triggerSettings;
+    if (triggerSettings.enabled && triggerSettings.geometricCheck && !PrimariesCrossScintillator(anEvent))
+    {
+        anEvent->SetEventAborted();
+    }
+}
+
+G4double PrimaryGeneratorAction::SampleSpillTime() const
+{
+    const SpillSettings& spillSettings = _primaryGeneratorActionParameters.spillSettings;
+
+    if (spillSettings.bunchSpacing <= 0.) return G4UniformRand() * spillSettings.duration;
+
+    const G4int nBunches = std::max(1, (G4int)(spillSettings.duration / spillSettings.bunchSpacing));
+    const G4int bunch = std::min((G4int)(G4UniformRand() * nBunches), nBunches - 1);
+    return (bunch + 0.5) * spillSettings.bunchSpacing + CLHEP::RandGauss::shoot(0., spillSettings.bunchWidth);
 }
 
+G4bool PrimaryGeneratorAction::PrimariesCrossScintillator(const G4Event* anEvent) const
+{
+    const G4ThreeVector& halfSize = _primaryGeneratorActionParameters.scintHalfSize;
+
+    for (G4int v = 0; v < anEvent->GetNumberOfPrimaryVertex(); v++)
+    {
+        const G4PrimaryVertex* vertex = anEvent->GetPrimaryVertex(v);
+        const G4ThreeVector position = vertex->GetPosition();
+
+        for (G4int p = 0; p < vertex->GetNumberOfParticle(); p++)
+        {
+            const G4ThreeVector direction = vertex->GetPrimary(p)->GetMomentumDirection();
+
+            // Slab test of the forward straight line against the scintillator box
+            G4double tMin = 0., tMax = DBL_MAX;
+            G4bool crosses = true;
+            for (G4int axis = 0; axis < 3 && crosses; axis++)
+            {
+                if (std::abs(direction[axis]) < 1e-12)
+                {
+                    crosses = std::abs(position[axis]) <= halfSize[axis];
+                    continue;
+                }
+                G4double t1 = (-halfSize[axis] - position[axis]) / direction[axis];
+                G4double t2 = (halfSize[axis] - position[axis]) / direction[axis];
+                if (t1 > t2) std::swap(t1, t2);
+                tMin = std::max(tMin, t1);
+                tMax = std::min(tMax, t2);
+                crosses = tMin <= tMax;
+            }
+            if (crosses) return true;
+        }
+    }
+    return false;
+}
+
+void PrimaryGeneratorAction::GenerateReplayPrimaries(G4Event* anEvent) {
+
+    if (!replayer) replayer = new OpticalPhotonReplayer(_primaryGeneratorActionParameters.scintLVName);
+
+    EdepEventRecord record;
+    if (!_primaryGeneratorActionParameters.edepStreamReader->ReadEvent(record, replaySteps))
+    {
+        // More events were requested than the ones recorded in stage 1
+        G4cerr << "[PrimaryGeneratorAction] Edep stream exhausted, aborting the run" << G4endl;
+        G4RunManager::GetRunManager()->AbortRun(true);
+        return;
+    }
+
+    // The event action takes the muon truth from here, nothing but optical photons is tracked in stage 2
+    anEvent->SetUserInformation(new ReplayEventInfo(record));
+    replayer->GeneratePhotons(anEvent, replaySteps);
+}
@@ -0,0 +1,275 @@
+#include "RNTupleOutput.hh"
+
+#ifdef HODOSIM_WITH_RNTUPLE
+
+#include <ROOT/REntry.hxx>
+#include <ROOT/RNTupleFillContext.hxx>
+#include <ROOT/RNTupleModel.hxx>
+#include <ROOT/RNTupleParallelWriter.hxx>
+#include <ROOT/RNTupleWriteOptions.hxx>
+#include <Compression.h>
+
+#include <exception>
+#include <vector>
+
+
+struct RNTupleOutput::Writer {
+	std::unique_ptr<ROOT::RNTupleParallelWriter> writer;
+};
+
+namespace
+{
+	// Fill context of this thread and its entry, bound to the thread's NtupleRow
+	struct ThreadContext {
+		std::shared_ptr<ROOT::RNTupleFillContext> context;
+		std::unique_ptr<ROOT::REntry> entry;
+	};
+
+	ThreadContext& Context()
+	{
+		static thread_local ThreadContext context;
+		return context;
+	}
+
+	ROOT::RCompressionSetting::EAlgorithm::EValues CompressionAlgorithm(const G4String& name)
+	{
+		if (name == "lz4") return ROOT::RCompressionSetting::EAlgorithm::kLZ4;
+		if (name == "zlib") return ROOT::RCompressionSetting::EAlgorithm::kZLIB;
+		return ROOT::RCompressionSetting::EAlgorithm::kZSTD;
+	}
+
+	// Same names and units of the G4 ntuple columns (see RunAction)
+	std::unique_ptr<ROOT::RNTupleModel> BuildModel(const RunActionParameters& layout)
+	{
+		auto model = ROOT::RNTupleModel::CreateBare();
+
+		model->MakeField<G4int>("EventID");
+		if (layout.enableSparse)
+		{
+			model->MakeField<std::vector<G4int>>("ScintOPsChannels");
+			if (layout.enableWeightedYield) model->MakeField<std::vector<G4float>>("ScintOPsValues");
+			else model->MakeField<std::vector<G4int>>("ScintOPsValues");
+			model->MakeField<std::vector<G4int>>("CerOPsChannels");
+			model->MakeField<std::vector<G4int>>("CerOPsValues");
+		}
+		else
+		{
+			if (layout.enableWeightedYield) model->MakeField<std::vector<G4float>>("ScintOPs");
+			else model->MakeField<std::vector<G4int>>("ScintOPs");
+			model->MakeField<std::vector<G4int>>("CerOPs");
+		}
+		for (const char* name : { "ScintTotalEdep", "CoatingTotalEdep", "MuPathLength", "MuonHitX", "MuonHitY",
+			"MuonExitX", "MuonExitY", "MuonExitZ", "MuonExitDirX", "MuonExitDirY", "MuonExitDirZ", "MuonExitEnergy" })
+		{
+			model->MakeField<G4float>(name);
+		}
+		if (layout.enableWeightedYield)
+		{
+			model->MakeField<std::vector<G4float>>(layout.enableSparse ? "ScintOPsVarianceValues" : "ScintOPsVariance");
+			model->MakeField<G4float>("ScintEffectiveSampleSize");
+		}
+		if (layout.enableDigitizer && layout.enableSparse)
+		{
+			model->MakeField<std::vector<G4int>>("SiPMChannels");
+			model->MakeField<std::vector<G4float>>("SiPMChargeValues");
+			model->MakeField<std::vector<G4float>>("SiPMTimeValues");
+			model->MakeField<std::vector<G4float>>("SiPMToTValues");
+			model->MakeField<std::vector<G4float>>("SiPMFirstPhotonTimeValues");
+		}
+		else if (layout.enableDigitizer)
+		{
+			model->MakeField<std::vector<G4float>>("SiPMCharge");
+			model->MakeField<std::vector<G4float>>("SiPMTime");
+			model->MakeField<std::vector<G4float>>("SiPMToT");
+			model->MakeField<std::vector<G4float>>("SiPMFirstPhotonTime");
+		}
+		if (layout.enableStripMode)
+		{
+			model->MakeField<std::vector<G4int>>("ScintEdgeID");
+			model->MakeField<std::vector<G4float>>("ScintEdgePos");
+			if (layout.enableWeightedYield) model->MakeField<std::vector<G4float>>("ScintEdgeWeight");
+			model->MakeField<std::vector<G4int>>("CerEdgeID");
+			model->MakeField<std::vector<G4float>>("CerEdgePos");
+		}
+		if (layout.storeWaveforms)
+		{
+			model->MakeField<std::vector<G4float>>("SiPMWaveforms");
+		}
+		if (layout.enableSpill)
+		{
+			for (const char* name : { "SpillMuonTime", "SpillMuonHitX", "SpillMuonHitY", "SpillMuonHitTime", "SpillMuonScintEdep", "SpillMuonScintOPs" })
+			{
+				model->MakeField<std::vector<G4float>>(name);
+			}
+			model->MakeField<std::vector<G4int>>("SpillMuonCerOPs");
+		}
+		return model;
+	}
+
+	// The entry reads the row members directly when it is filled, nothing is copied in between
+	void BindRow(ROOT::REntry& entry, NtupleRow& row, const RunActionParameters& layout)
+	{
+		entry.BindRawPtr("EventID", &row.eventID);
+		if (layout.enableSparse)
+		{
+			entry.BindRawPtr("ScintOPsChannels", &row.sparse.scintChannels);
+			if (layout.enableWeightedYield) entry.BindRawPtr("ScintOPsValues", &row.sparse.scintValuesWeighted);
+			else entry.BindRawPtr("ScintOPsValues", &row.sparse.scintValues);
+			entry.BindRawPtr("CerOPsChannels", &row.sparse.cerChannels);
+			entry.BindRawPtr("CerOPsValues", &row.sparse.cerValues);
+		}
+		else
+		{
+			if (layout.enableWeightedYield) entry.BindRawPtr("ScintOPs", &row.scintOPsWeighted);
+			else entry.BindRawPtr("ScintOPs", &row.scintOPs);
+			entry.BindRawPtr("CerOPs", &row.cerOPs);
+		}
+		entry.BindRawPtr("ScintTotalEdep", &row.scintEdep);
+		entry.BindRawPtr("CoatingTotalEdep", &row.coatingEdep);
+		entry.BindRawPtr("MuPathLength", &row.muPathLength);
+		entry.BindRawPtr("MuonHitX", &row.muonHitX);
+		entry.BindRawPtr("MuonHitY", &row.muonHitY);
+		entry.BindRawPtr("MuonExitX", &row.muonExit[0]);
+		entry.BindRawPtr("MuonExitY", &row.muonExit[1]);
+		entry.BindRawPtr("MuonExitZ", &row.muonExit[2]);
+		entry.BindRawPtr("MuonExitDirX", &row.muonExitDir[0]);
+		entry.BindRawPtr("MuonExitDirY", &row.muonExitDir[1]);
+		entry.BindRawPtr("MuonExitDirZ", &row.muonExitDir[2]);
+		entry.BindRawPtr("MuonExitEnergy", &row.muonExitEnergy);
+		if (layout.enableWeightedYield)
+		{
+			if (layout.enableSparse) entry.BindRawPtr("ScintOPsVarianceValues", &row.sparse.scintVariance);
+			else entry.BindRawPtr("ScintOPsVariance", &row.scintOPsVariance);
+			entry.BindRawPtr("ScintEffectiveSampleSize", &row.effectiveSampleSize);
+		}
+		if (layout.enableDigitizer && layout.enableSparse)
+		{
+			entry.BindRawPtr("SiPMChannels", &row.sparse.siPMChannels);
+			entry.BindRawPtr("SiPMChargeValues", &row.sparse.siPMCharge);
+			entry.BindRawPtr("SiPMTimeValues", &row.sparse.siPMTime);
+			entry.BindRawPtr("SiPMToTValues", &row.sparse.siPMToT);
+			entry.BindRawPtr("SiPMFirstPhotonTimeValues", &row.sparse.siPMFirstPhotonTime);
+		}
+		else if (layout.enableDigitizer)
+		{
+			entry.BindRawPtr("SiPMCharge", &row.siPMCharge);
+			entry.BindRawPtr("SiPMTime", &row.siPMTime);
+			entry.BindRawPtr("SiPMToT", &row.siPMToT);
+			entry.BindRawPtr("SiPMFirstPhotonTime", &row.siPMFirstPhotonTime);
+		}
+		if (layout.enableStripMode)
+		{
+			entry.BindRawPtr("ScintEdgeID", &row.edgeHits.scintEdge);
+			entry.BindRawPtr("ScintEdgePos", &row.edgeHits.scintPosition);
+			if (layout.enableWeightedYield) entry.BindRawPtr("ScintEdgeWeight", &row.edgeHits.scintWeight);
+			entry.BindRawPtr("CerEdgeID", &row.edgeHits.cerEdge);
+			entry.BindRawPtr("CerEdgePos", &row.edgeHits.cerPosition);
+		}
+		if (layout.storeWaveforms)
+		{
+			entry.BindRawPtr("SiPMWaveforms", &row.waveforms);
+		}
+		if (layout.enableSpill)
+		{
+			entry.BindRawPtr("SpillMuonTime", &row.spill.time);
+			entry.BindRawPtr("SpillMuonHitX", &row.spill.entryX);
+			entry.BindRawPtr("SpillMuonHitY", &row.spill.entryY);
+			entry.BindRawPtr("SpillMuonHitTime", &row.spill.entryTime);
+			entry.BindRawPtr("SpillMuonScintEdep", &row.spill.scintEdep);
+			entry.BindRawPtr("SpillMuonScintOPs", &row.spill.scintOPs);
+			entry.BindRawPtr("SpillMuonCerOPs", &row.spill.cerOPs);
+		}
+	}
+}
+
+
+RNTupleOutput::RNTupleOutput(const RNTupleSettings& settings, const RunActionParameters& layout)
+	: _writer(std::make_unique<Writer>())
+{
+	_settings = settings;
+	_layout = layout;
+}
+
+RNTupleOutput::~RNTupleOutput() = default;
+
+G4bool RNTupleOutput::IsAvailable() { return true; }
+
+G4bool RNTupleOutput::Open(const G4String& filename)
+{
+	ROOT::RNTupleWriteOptions options;
+	if (_settings.compression == "none") options.SetCompression(0);
+	else options.SetCompression(CompressionAlgorithm(_settings.compression), _settings.compressionLevel);
+	options.SetApproxZippedClusterSize((std::size_t)_settings.clusterSize * 1024 * 1024);
+
+	try
+	{
+		_writer->writer = ROOT::RNTupleParallelWriter::Recreate(BuildModel(_layout), "PerEventCollectedData", filename, options);
+	}
+	catch (const std::exception& e)
+	{
+		G4cerr << "[RNTupleOutput] Error: could not create " << filename << ": " << e.what() << G4endl;
+		return false;
+	}
+
+	G4cout << "[RNTupleOutput] Writing the per-event data to " << filename << G4endl;
+	return true;
+}
+
+void RNTupleOutput::Close()
+{
+	// The remaining clusters and the footer are written when the writer is destroyed
+	_writer->writer.reset();
+}
+
+void RNTupleOutput::Fill(NtupleRow& row)
+{
+	auto& thread = Context();
+	if (!thread.context)
+	{
+		if (!_writer->writer) return;
+
+		// CreateFillContext is thread-safe, the rows of this thread are then filled without any lock
+		thread.context = _writer->writer->CreateFillContext();
+		thread.entry = thread.context->GetModel().CreateBareEntry();
+		BindRow(*thread.entry, row, _layout);
+	}
+	thread.context->Fill(*thread.entry);
+}
+
+void RNTupleOutput::CloseThread()
+{
+	// Destroying the context flushes the last cluster of this thread, it must happen before the writer is closed
+	auto& thread = Context();
+	thread.entry.reset();
+	thread.context.reset();
+}
+
+#else
+
+// Built without ROOT, main.cc refuses the rntuple backend before any of these is called
+
+struct RNTupleOutput::Writer {};
+
+RNTupleOutput::RNTupleOutput(const RNTupleSettings& settings, const RunActionParameters& layout)
+{
+	_settings = settings;
+	_layout = layout;
+}
+
+RNTupleOutput::~RNTupleOutput() = default;
+
+G4bool RNTupleOutput::IsAvailable() { return false; }
+
+G4bool RNTupleOutput::Open(const G4String& filename)
+{
+	G4cerr << "[RNTupleOutput] Error: HodoSim was built without ROOT, " << filename << " can't be written." << G4endl;
+	return false;
+}
+
+void RNTupleOutput::Close() {}
+
+void RNTupleOutput::Fill(NtupleRow&) {}
+
+void RNTupleOutput::CloseThread() {}
+
+#endif
@@ -0,0 +1,83 @@
+#include "ReflectionCounting.hh"
+#include "OpticalPhotonTrackInfo.hh"
+
+#include "G4OpticalPhoton.hh"
+#include "G4ProcessManager.hh"
+
+#include <algorithm>
+
+
+G4bool ReflectionSurfaces::IsCoating(const G4LogicalBorderSurface* surface) const
+{
+	return std::find(coating.begin(), coating.end(), surface) != coating.end();
+}
+
+
+ReflectionCountingBoundaryProcess::ReflectionCountingBoundaryProcess(const ReflectionSurfaces* surfaces)
+	: G4OpBoundaryProcess()
+{
+	_surfaces = surfaces;
+}
+
+G4VParticleChange* ReflectionCountingBoundaryProcess::PostStepDoIt(const G4Track& track, const G4Step& step)
+{
+	auto* particleChange = G4OpBoundaryProcess::PostStepDoIt(track, step);
+
+	// Every step of a photon ends up here, the ones not at a boundary come out as NotAtBoundary/StepTooSmall
+	// To determine the enumerator i just checked the source code of Geant4
+	const auto status = GetStatus();
+	const G4bool isReflection =
+		(status == G4OpBoundaryProcessStatus::TotalInternalReflection) ||
+		(status == G4OpBoundaryProcessStatus::FresnelReflection) ||
+		(status == G4OpBoundaryProcessStatus::LobeReflection) ||
+		(status == G4OpBoundaryProcessStatus::SpikeReflection) ||
+		(status == G4OpBoundaryProcessStatus::LambertianReflection) ||
+		(status == G4OpBoundaryProcessStatus::BackScattering);
+
+	if (!isReflection) return particleChange;
+
+	auto* trackInfo = OpticalPhotonTrackInfo::Get(&track);
+	if (!trackInfo) return particleChange;
+
+	trackInfo->nReflections++;
+
+	// Same lookup the boundary process does to pick the optical surface: pre-step volume -> volume across the boundary.
+	// The reweighting of the coating reflectivity relies on this count, the SiPM faces and the TIR must not end up here.
+	const auto* surface = G4LogicalBorderSurface::GetSurface(
+		step.GetPreStepPoint()->GetPhysicalVolume(),
+		step.GetPostStepPoint()->GetPhysicalVolume()
+	);
+	if (surface && _surfaces && _surfaces->IsCoating(surface)) trackInfo->nReflectionsAtCoating++;
+
+	return particleChange;
+}
+
+
+ReflectionCountingPhysics::ReflectionCountingPhysics(const ReflectionSurfaces* surfaces)
+	: G4VPhysicsConstructor("ReflectionCounting")
+{
+	_surfaces = surfaces;
+}
+
+void ReflectionCountingPhysics::ConstructProcess()
+{
+	auto* processManager = G4OpticalPhoton::Definition()->GetProcessManager();
+	if (!processManager) return;
+
+	auto* processList = processManager->GetProcessList();
+
+	for (size_t i = 0; i < processList->size(); i++)
+	{
+		auto* boundary = dynamic_cast<G4OpBoundaryProcess*>((*processList)[i]);
+		if (!boundary) continue;
+
+		processManager->RemoveProcess(boundary);
+		delete boundary;
+
+		// The G4OpticalParameters (e.g. InvokeSD) are read again when the physics tables are prepared
+		processManager->AddDiscreteProcess(new ReflectionCountingBoundaryProcess(_surfaces));
+		return;
+	}
+
+	G4cout << "[ReflectionCountingPhysics] Warning: no G4OpBoundaryProcess found, the reflections won't be counted." << G4endl;
+}
@@ -1,8 +1,17 @@
 #include "RunAction.hh"
+#include "PhotonHistograms.hh"
+#include "RNTupleOutput.hh"
+#include "AsyncEventWriter.hh"
+#include "OutputRotation.hh"
 
 #include "G4EmCalculator.hh"
+#include "G4Exception.hh"
+#include "G4AccumulableManager.hh"
+#include "G4RunManager.hh"
 #include "G4SystemOfUnits.hh"
+#include "G4Threading.hh"
 
+#include <cmath>
 #include <filesystem>
 
 RunAction::RunAction(RunActionParameters runActionParameters)
@@ -14,15 +23,28 @@ RunAction::RunAction(RunActionParameters runActionParameters)
 	analysisManager = G4AnalysisManager::Instance();
 	analysisManager->Reset();
 	analysisManager->SetVerboseLevel(1);
-	analysisManager->SetNtupleMerging(true);
+	// The workers send their ntuple baskets to the master, which writes them one thread at a time,
+	// or write their own file (merged after the run by the Merge tool). The histograms are merged by the master in both cases.
+	analysisManager->SetNtupleMerging(!_runActionParameters.enablePerThreadFiles);
+
+	// Rolling output: the per-thread ntuple buffers are bounded, a full basket is written to the file of the chunk
+	if (auto* outputRotation = _runActionParameters.outputRotation)
+	{
+		analysisManager->SetBasketSize((unsigned int)outputRotation->GetSettings().basketSize);
+	}
 
 	// Create Ntuples and histograms here using analysisManager
 	
 	G4int sipmsPerSide = _runActionParameters.sipmsPerSide;
 
-	analysisManager->CreateH1("ScintOpticalPhotonsEnergy", "Scint Optical Photons Energy (eV)", 1000, 2.2, 3.3);
-	analysisManager->CreateH1("ScintOpticalPhotonsTime", "Scint Optical Photons Time (ns)", 1000, 0, 30);
-	analysisManager->CreateH2("ScintOpticalPhotonsSpread", "Scint Optical Photons Spread; X (mm); Y (mm)", 100, -40, 40, 100, -40, 40);
+	// Filled at the end of the run from the per-thread bins of PhotonHistograms, which use the same binning
+	const auto& energyAxis = PhotonHistograms::kEnergyAxis;
+	const auto& timeAxis = PhotonHistograms::kTimeAxis;
+	const auto& spreadAxis = PhotonHistograms::kSpreadAxis;
+	analysisManager->CreateH1("ScintOpticalPhotonsEnergy", "Scint Optical Photons Energy (eV)", energyAxis.nBins, energyAxis.min, energyAxis.max);
+	analysisManager->CreateH1("ScintOpticalPhotonsTime", "Scint Optical Photons Time (ns)", timeAxis.nBins, timeAxis.min, timeAxis.max);
+	analysisManager->CreateH2("ScintOpticalPhotonsSpread", "Scint Optical Photons Spread; X (mm); Y (mm)",
+		spreadAxis.nBins, spreadAxis.min, spreadAxis.max, spreadAxis.nBins, spreadAxis.min, spreadAxis.max);
 	
 	// I turned down reflection histograms since they are not essential right now
 	// analysisManager->CreateH1("OpticalPhotonsReflections0", "Optical Photons Reflections", 1000, 0, 1000);
@@ -30,26 +52,130 @@ RunAction::RunAction(RunActionParameters runActionParameters)
 	// analysisManager->CreateH1("OpticalPhotonsReflections2", "Optical Photons Reflections", 1000, 0, 1000);
 	// analysisManager->CreateH1("OpticalPhotonsReflections3", "Optical Photons Reflections", 1000, 0, 1000);
 
+	// The per-SiPM quantities are one vector column per species (see NtupleRow)
+	const G4int nSiPMs = sipmsPerSide * 4;
+	auto& row = ntupleRow;
+	row.scintOPs.assign(nSiPMs, 0);
+	row.cerOPs.assign(nSiPMs, 0);
+	if (_runActionParameters.enableWeightedYield)
+	{
+		row.scintOPsWeighted.assign(nSiPMs, 0.f);
+		row.scintOPsVariance.assign(nSiPMs, 0.f);
+	}
+	if (_runActionParameters.enableDigitizer)
+	{
+		row.siPMCharge.assign(nSiPMs, 0.f);
+		row.siPMTime.assign(nSiPMs, -1.f);
+		row.siPMToT.assign(nSiPMs, 0.f);
+		row.siPMFirstPhotonTime.assign(nSiPMs, -1.f);
+	}
+
+	// The RNTuple backend has its own schema with the same names (see RNTupleOutput), the async backend its own stream
+	// (see AsyncEventWriter), the G4 file keeps the histograms
+	if (!_runActionParameters.rntupleOutput && !_runActionParameters.asyncEventWriter) BookNtuple();
+
+	auto* accumulableManager = G4AccumulableManager::Instance();
+	accumulableManager->Register(nOpticalPhotons);
+	accumulableManager->Register(nKilledByTime);
+	accumulableManager->Register(nKilledByReflections);
+	accumulableManager->Register(nKilledByPathLength);
+	accumulableManager->Register(scintHitsSumW);
+	accumulableManager->Register(scintHitsSumW2);
+	accumulableManager->Register(nVetoedByGeometry);
+	accumulableManager->Register(nVetoedByEdep);
+	accumulableManager->Register(nVetoedByMuonHit);
+}
+
+void RunAction::BookNtuple()
+{
+	// Typed schema, integer counts and float kinematics
+	auto& row = ntupleRow;
+
 	analysisManager->CreateNtuple("PerEventCollectedData", "Per-Event Collected Data");
-	analysisManager->CreateNtupleDColumn("EventID");
-	for (G4int i = 0 ; i < sipmsPerSide * 4; i++)
+	eventIDColumn = analysisManager->CreateNtupleIColumn("EventID");
+	if (_runActionParameters.enableSparse)
+	{
+		// Channels + values, see SparseEncoding.hh
+		analysisManager->CreateNtupleIColumn("ScintOPsChannels", row.sparse.scintChannels);
+		if (_runActionParameters.enableWeightedYield) analysisManager->CreateNtupleFColumn("ScintOPsValues", row.sparse.scintValuesWeighted);
+		else analysisManager->CreateNtupleIColumn("ScintOPsValues", row.sparse.scintValues);
+		analysisManager->CreateNtupleIColumn("CerOPsChannels", row.sparse.cerChannels);
+		analysisManager->CreateNtupleIColumn("CerOPsValues", row.sparse.cerValues);
+	}
+	else if (_runActionParameters.enableWeightedYield)
+	{
+		// The weighted counts are sums of weights, not integers
+		analysisManager->CreateNtupleFColumn("ScintOPs", row.scintOPsWeighted);
+		analysisManager->CreateNtupleIColumn("CerOPs", row.cerOPs);
+	}
+	else
+	{
+		analysisManager->CreateNtupleIColumn("ScintOPs", row.scintOPs);
+		analysisManager->CreateNtupleIColumn("CerOPs", row.cerOPs);
+	}
+	truthColumn = analysisManager->CreateNtupleFColumn("ScintTotalEdep");	// eV
+	analysisManager->CreateNtupleFColumn("CoatingTotalEdep");				// eV
+	analysisManager->CreateNtupleFColumn("MuPathLength");					// mm
+	analysisManager->CreateNtupleFColumn("MuonHitX");						// mm
+	analysisManager->CreateNtupleFColumn("MuonHitY");
+	analysisManager->CreateNtupleFColumn("MuonExitX");						// mm, scintillator frame
+	analysisManager->CreateNtupleFColumn("MuonExitY");
+	analysisManager->CreateNtupleFColumn("MuonExitZ");
+	analysisManager->CreateNtupleFColumn("MuonExitDirX");
+	analysisManager->CreateNtupleFColumn("MuonExitDirY");
+	analysisManager->CreateNtupleFColumn("MuonExitDirZ");
+	analysisManager->CreateNtupleFColumn("MuonExitEnergy");					// MeV
+	if (_runActionParameters.enableWeightedYield)
+	{
+		if (_runActionParameters.enableSparse) analysisManager->CreateNtupleFColumn("ScintOPsVarianceValues", row.sparse.scintVariance);
+		else analysisManager->CreateNtupleFColumn("ScintOPsVariance", row.scintOPsVariance);
+		effectiveSampleSizeColumn = analysisManager->CreateNtupleFColumn("ScintEffectiveSampleSize");
+	}
+	if (_runActionParameters.enableDigitizer && _runActionParameters.enableSparse)
+	{
+		analysisManager->CreateNtupleIColumn("SiPMChannels", row.sparse.siPMChannels);
+		analysisManager->CreateNtupleFColumn("SiPMChargeValues", row.sparse.siPMCharge);
+		analysisManager->CreateNtupleFColumn("SiPMTimeValues", row.sparse.siPMTime);
+		analysisManager->CreateNtupleFColumn("SiPMToTValues", row.sparse.siPMToT);
+		analysisManager->CreateNtupleFColumn("SiPMFirstPhotonTimeValues", row.sparse.siPMFirstPhotonTime);
+	}
+	else if (_runActionParameters.enableDigitizer)
+	{
+		analysisManager->CreateNtupleFColumn("SiPMCharge", row.siPMCharge);		// photoelectrons
+		analysisManager->CreateNtupleFColumn("SiPMTime", row.siPMTime);			// ns, -1 below threshold
+		analysisManager->CreateNtupleFColumn("SiPMToT", row.siPMToT);			// ns
+		analysisManager->CreateNtupleFColumn("SiPMFirstPhotonTime", row.siPMFirstPhotonTime);	// ns, -1 without photons
+	}
+	if (_runActionParameters.enableStripMode)
 	{
-		analysisManager->CreateNtupleDColumn("ScintOPsCollected" + std::to_string(i));
+		// Rebinned to any number of SiPMs per side by the Rebin tool
+		analysisManager->CreateNtupleIColumn("ScintEdgeID", row.edgeHits.scintEdge);
+		analysisManager->CreateNtupleFColumn("ScintEdgePos", row.edgeHits.scintPosition);
+		if (_runActionParameters.enableWeightedYield) analysisManager->CreateNtupleFColumn("ScintEdgeWeight", row.edgeHits.scintWeight);
+		analysisManager->CreateNtupleIColumn("CerEdgeID", row.edgeHits.cerEdge);
+		analysisManager->CreateNtupleFColumn("CerEdgePos", row.edgeHits.cerPosition);
 	}
-	for (G4int i = 0; i < sipmsPerSide * 4; i++)
+	if (_runActionParameters.storeWaveforms)
 	{
-		analysisManager->CreateNtupleDColumn("CerOPsCollected" + std::to_string(i));
+		analysisManager->CreateNtupleFColumn("SiPMWaveforms", row.waveforms);
+	}
+	if (_runActionParameters.enableSpill)
+	{
+		// One entry per muon of the spill, the scalar truth columns above are sums (edep) or the first muon (hit position)
+		analysisManager->CreateNtupleFColumn("SpillMuonTime", row.spill.time);				// ns
+		analysisManager->CreateNtupleFColumn("SpillMuonHitX", row.spill.entryX);			// mm
+		analysisManager->CreateNtupleFColumn("SpillMuonHitY", row.spill.entryY);			// mm
+		analysisManager->CreateNtupleFColumn("SpillMuonHitTime", row.spill.entryTime);		// ns
+		analysisManager->CreateNtupleFColumn("SpillMuonScintEdep", row.spill.scintEdep);	// eV
+		analysisManager->CreateNtupleFColumn("SpillMuonScintOPs", row.spill.scintOPs);
+		analysisManager->CreateNtupleIColumn("SpillMuonCerOPs", row.spill.cerOPs);
 	}
-	analysisManager->CreateNtupleDColumn("ScintTotalEdep");
-	analysisManager->CreateNtupleDColumn("CoatingTotalEdep");
-	analysisManager->CreateNtupleDColumn("MuPathLength");
-	analysisManager->CreateNtupleDColumn("MuonHitX");
-	analysisManager->CreateNtupleDColumn("MuonHitY");
 	analysisManager->FinishNtuple();
 }
 
 RunAction::~RunAction()
 {
+	delete tensorShards;
 	delete timer;
 }
 
@@ -72,10 +198,21 @@ void RunAction::BeginOfRunAction(const G4Run* run)
 			<< " al=" << Tcut_al / MeV << G4endl;
 	}
 
+	G4AccumulableManager::Instance()->Reset();
+	PhotonHistograms::Get().Configure(_runActionParameters.photonHistogramsPrescale);
+
 	timer->Start();
 
 	std::string outputDir = _runActionParameters.outputDir;
 	std::string outputFile = _runActionParameters.outputFile;
+	const std::string runStem = std::filesystem::path(outputFile).stem().string();
+
+	// Rolling output: every run is a chunk, all its files are named after <stem>_<run ID>
+	if (auto* outputRotation = _runActionParameters.outputRotation)
+	{
+		outputFile = OutputRotation::GetChunkFileName(outputFile, run->GetRunID());
+		eventIDOffset = outputRotation->GetEventIDOffset();
+	}
 
 	namespace fs = std::filesystem;
 	const fs::path outDir{ outputDir };
@@ -83,6 +220,39 @@ void RunAction::BeginOfRunAction(const G4Run* run)
 	fs::create_directories(outDir, ec); // safe if already exists
 	const auto outFile = (outDir / outputFile).string();
 	analysisManager->OpenFile(outFile);
+
+	// The RNTuple goes to its own file, opened by the master before the workers start filling it
+	if (auto* rntupleOutput = _runActionParameters.rntupleOutput; rntupleOutput && IsMaster())
+	{
+		const fs::path rntupleFile = outDir / (fs::path(outputFile).stem().string() + "_rntuple.root");
+		// Without the writer every Fill would be silently dropped, I stop here instead of producing an empty output
+		if (!rntupleOutput->Open(rntupleFile.string()))
+		{
+			G4ExceptionDescription msg;
+			msg << "Could not open the RNTuple output " << rntupleFile.string();
+			G4Exception("RunAction::BeginOfRunAction", "HodoSim_RNTupleOpen", FatalException, msg);
+		}
+	}
+	if (auto* asyncEventWriter = _runActionParameters.asyncEventWriter; asyncEventWriter && IsMaster())
+	{
+		const fs::path streamFile = outDir / (fs::path(outputFile).stem().string() + ".hodoevt");
+		// Without the writer thread nobody drains the queue, the workers would spin forever once it is full
+		if (!asyncEventWriter->Open(streamFile.string()))
+		{
+			G4ExceptionDescription msg;
+			msg << "Could not open the async output stream " << streamFile.string();
+			G4Exception("RunAction::BeginOfRunAction", "HodoSim_AsyncOpen", FatalException, msg);
+		}
+	}
+	// Every thread filling rows writes its own shards, no synchronization with the other threads.
+	// These are the workers, and the master in sub-event mode (it tracks the muons), so the writer is created with the first row
+	if (_runActionParameters.tensorShardSettings.enabled)
+	{
+		// The shards of all the chunks go in the same directory, their names already tell the run apart
+		tensorShardDir = (outDir / (runStem + "_shards")).string();
+		tensorShardPrefix = runStem + "_r" + std::to_string(run->GetRunID())
+			+ (IsMaster() ? std::string("_master") : "_t" + std::to_string(G4Threading::G4GetThreadId()));
+	}
 	
 	// Reset ntuple
 	// analysisManager->Reset();
@@ -90,8 +260,182 @@ void RunAction::BeginOfRunAction(const G4Run* run)
 
 void RunAction::EndOfRunAction(const G4Run* run)
 {
+	// The workers hand their photon statistics to the builder, then the master (which ends last) writes the table
+	if (auto* builder = _runActionParameters.lightResponseTableBuilder)
+	{
+		builder->MergeThreadData();
+		if (IsMaster()) builder->WriteTable();
+	}
+
+	// The bins of this thread go into its G4 histograms before they are written (and merged by the master)
+	PhotonHistograms::Get().MergeIntoAnalysis();
+
+	// Rolling output: every chunk file holds only the histograms of its own events, they start from zero again
+	// (without rotation every run rewrites the same file and the histograms keep accumulating, as they always did)
 	analysisManager->Write();
-	analysisManager->CloseFile(false);
+	analysisManager->CloseFile(_runActionParameters.outputRotation != nullptr);
+
+	// The workers end their run before the master, whose Close writes the RNTuple footer
+	if (auto* rntupleOutput = _runActionParameters.rntupleOutput)
+	{
+		// (in sub-event mode the master fills rows too, its own context is flushed before the writer is destroyed)
+		rntupleOutput->CloseThread();
+		if (IsMaster()) rntupleOutput->Close();
+	}
+	if (auto* asyncEventWriter = _runActionParameters.asyncEventWriter; asyncEventWriter && IsMaster())
+	{
+		asyncEventWriter->Close();
+	}
+	// Closing the shards writes their final .npy headers
+	delete tensorShards;
+	tensorShards = nullptr;
+
+	// Rolling output: the files of the chunk are complete, the master lists them for the downstream tools
+	if (auto* outputRotation = _runActionParameters.outputRotation; outputRotation && IsMaster())
+	{
+		const std::string chunkFile = OutputRotation::GetChunkFileName(_runActionParameters.outputFile, run->GetRunID());
+		const std::string chunkStem = std::filesystem::path(chunkFile).stem().string();
+
+		std::vector<std::string> files = { chunkFile };
+		if (_runActionParameters.enablePerThreadFiles)
+		{
+			const std::string extension = std::filesystem::path(chunkFile).extension().string();
+			for (G4int t = 0; t < G4RunManager::GetRunManager()->GetNumberOfThreads(); t++) files.push_back(chunkStem + "_t" + std::to_string(t) + extension);
+		}
+		if (_runActionParameters.rntupleOutput) files.push_back(chunkStem + "_rntuple.root");
+		if (_runActionParameters.asyncEventWriter) files.push_back(chunkStem + ".hodoevt");
+
+		outputRotation->ChunkClosed(_runActionParameters.outputDir, _runActionParameters.outputFile, run->GetRunID(), run->GetNumberOfEvent(), files);
+	}
 
 	timer->Stop();
+
+	G4AccumulableManager::Instance()->Merge();
+
+	if (IsMaster())
+	{
+		PrintPhotonLimitsSummary();
+		PrintWeightedYieldSummary();
+		PrintTriggerSummary(run);
+	}
+}
+
+void RunAction::AddNtupleRow()
+{
+	if (_runActionParameters.tensorShardSettings.enabled)
+	{
+		if (!tensorShards)
+		{
+			tensorShards = new TensorShardWriter(_runActionParameters.tensorShardSettings, _runActionParameters.sipmsPerSide * 4,
+				_runActionParameters.enableWeightedYield, tensorShardDir, tensorShardPrefix);
+		}
+		tensorShards->Add(ntupleRow);
+	}
+
+	if (auto* rntupleOutput = _runActionParameters.rntupleOutput)
+	{
+		rntupleOutput->Fill(ntupleRow);
+		return;
+	}
+	// The worker only packs and enqueues the row, the writer thread does the I/O
+	if (auto* asyncEventWriter = _runActionParameters.asyncEventWriter)
+	{
+		asyncEventWriter->Push(ntupleRow);
+		return;
+	}
+
+	// The vector columns read the bound row members when the row is added, only the scalars need a fill call
+	const auto& row = ntupleRow;
+	analysisManager->FillNtupleIColumn(eventIDColumn, row.eventID);
+
+	const G4float truth[12] = {
+		row.scintEdep, row.coatingEdep, row.muPathLength, row.muonHitX, row.muonHitY,
+		row.muonExit[0], row.muonExit[1], row.muonExit[2],
+		row.muonExitDir[0], row.muonExitDir[1], row.muonExitDir[2],
+		row.muonExitEnergy
+	};
+	for (G4int i = 0; i < 12; i++) analysisManager->FillNtupleFColumn(truthColumn + i, truth[i]);
+
+	if (effectiveSampleSizeColumn >= 0) analysisManager->FillNtupleFColumn(effectiveSampleSizeColumn, row.effectiveSampleSize);
+
+	analysisManager->AddNtupleRow();
+}
+
+void RunAction::CountKilledPhoton(PhotonLimit limit)
+{
+	switch (limit)
+	{
+	case PhotonLimit::GlobalTime:	nKilledByTime += 1; break;
+	case PhotonLimit::Reflections:	nKilledByReflections += 1; break;
+	case PhotonLimit::PathLength:	nKilledByPathLength += 1; break;
+	}
+}
+
+void RunAction::CountVetoedEvent(TriggerVeto veto)
+{
+	switch (veto)
+	{
+	case TriggerVeto::Geometry:		nVetoedByGeometry += 1; break;
+	case TriggerVeto::Edep:			nVetoedByEdep += 1; break;
+	case TriggerVeto::NoMuonHit:	nVetoedByMuonHit += 1; break;
+	}
+}
+
+void RunAction::PrintPhotonLimitsSummary()
+{
+	const G4double nPhotons = nOpticalPhotons.GetValue();
+	if (nPhotons <= 0) return; // limits disabled
+
+	// Only the counts: the tracking time saved can't be derived from them (a killed photon was already tracked up to the limit,
+	// and the photons of the trapped tail would have cost far more than the average one), compare the run times instead
+	auto report = [&](const char* name, G4double nKilled) {
+		G4cout << "|  " << name << ": " << nKilled << " photons killed (" << 100. * nKilled / nPhotons << " %)" << G4endl;
+	};
+
+	G4cout << "===============================================" << G4endl;
+	G4cout << "[RunAction] Optical photon limits summary (" << nPhotons << " photons tracked)" << G4endl;
+	report("max global time ", nKilledByTime.GetValue());
+	report("max reflections ", nKilledByReflections.GetValue());
+	report("max path length ", nKilledByPathLength.GetValue());
+	G4cout << "===============================================" << G4endl;
+}
+
+void RunAction::PrintWeightedYieldSummary()
+{
+	if (!_runActionParameters.enableWeightedYield) return;
+
+	const G4double sumW = scintHitsSumW.GetValue();
+	const G4double sumW2 = scintHitsSumW2.GetValue();
+	if (sumW2 <= 0) return;
+
+	// The effective sample size is the number of unweighted photons that would give the same relative error
+	const G4double ess = sumW * sumW / sumW2;
+
+	G4cout << "===============================================" << G4endl;
+	G4cout << "[RunAction] Weighted yield summary" << G4endl;
+	G4cout << "|  weighted scint photons detected: " << sumW << G4endl;
+	G4cout << "|  effective sample size: " << ess << " (" << 100. * ess / sumW << " % of the full yield statistics)" << G4endl;
+	G4cout << "|  relative error on the total count: " << 100. * std::sqrt(sumW2) / sumW << " %" << G4endl;
+	G4cout << "===============================================" << G4endl;
+}
+
+void RunAction::PrintTriggerSummary(const G4Run* run)
+{
+	if (!_runActionParameters.enableTrigger) return;
+
+	const G4double nEvents = run->GetNumberOfEvent();
+	if (nEvents <= 0) return;
+
+	auto report = [&](const char* name, G4double nVetoed) {
+		G4cout << "|  " << name << ": " << nVetoed << " events vetoed (" << 100. * nVetoed / nEvents << " %)" << G4endl;
+	};
+
+	const G4double nVetoed = nVetoedByGeometry.GetValue() + nVetoedByEdep.GetValue() + nVetoedByMuonHit.GetValue();
+
+	G4cout << "===============================================" << G4endl;
+	G4cout << "[RunAction] Trigger summary (" << nEvents << " events, " << nEvents - nVetoed << " written)" << G4endl;
+	report("geometric check ", nVetoedByGeometry.GetValue());
+	report("edep threshold  ", nVetoedByEdep.GetValue());
+	report("no muon hit     ", nVetoedByMuonHit.GetValue());
+	G4cout << "===============================================" << G4endl;
 }
\ No newline at end of file
@@ -0,0 +1,7 @@
+#include "SiPMDigi.hh"
+
+G4ThreadLocal G4Allocator<SiPMDigi>* SiPMDigiAllocator = nullptr;
+
+SiPMDigi::SiPMDigi() {}
+
+SiPMDigi::~SiPMDigi() {}
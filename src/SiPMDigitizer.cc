@@ -0,0 +1,214 @@
+#include "SiPMDigitizer.hh"
+
+#include "G4Poisson.hh"
+#include "Randomize.hh"
+
+#include <algorithm>
+#include <cmath>
+
+
+const G4String SiPMDigitizer::kDigiCollectionName = "SiPMDigis";
+
+
+SiPMDigitizer::SiPMDigitizer(const G4String& name, const SiPMDigitizerSettings& settings, G4int nSiPMs)
+	: G4VDigitizerModule(name)
+{
+	_settings = settings;
+	_nSiPMs = nSiPMs;
+
+	collectionName.push_back(kDigiCollectionName);
+
+	// The pulse is sampled at the middle of each sample, its peak is normalized to one photoelectron
+	// and it is cut after ten fall times (or at the end of the window)
+	const G4double dt = _settings.sampleWidth;
+	const G4int maxLength = std::min(_settings.nSamples, (G4int)std::ceil(10. * _settings.fallTime / dt) + 1);
+	kernel.resize(maxLength);
+
+	G4double peak = 0.;
+	for (G4int k = 0; k < maxLength; k++)
+	{
+		const G4double t = (k + 0.5) * dt;
+		kernel[k] = std::exp(-t / _settings.fallTime) - ((_settings.riseTime > 0.) ? std::exp(-t / _settings.riseTime) : 0.);
+		peak = std::max(peak, kernel[k]);
+	}
+	kernelIntegral = 0.;
+	for (auto& value : kernel)
+	{
+		value /= peak;
+		kernelIntegral += value;
+	}
+
+	photonTimes.resize(_nSiPMs);
+	photonAmplitudes.resize(_nSiPMs);
+	binnedAmplitudes.assign(_settings.nSamples, 0.);
+	waveform.assign(_settings.nSamples, 0.);
+	if (_settings.storeWaveforms) waveforms.assign((size_t)_nSiPMs * _settings.nSamples, 0.f);
+}
+
+void SiPMDigitizer::Digitize()
+{
+	auto* digis = new SiPMDigiCollection(GetName(), kDigiCollectionName);
+
+	// Photons grouped by SiPM
+	for (G4int i = 0; i < _nSiPMs; i++)
+	{
+		photonTimes[i].clear();
+		photonAmplitudes[i].clear();
+	}
+	if (_counts)
+	{
+		for (size_t p = 0; p < _counts->photonSiPM.size(); p++)
+		{
+			const G4int siPMID = _counts->photonSiPM[p];
+			if (siPMID < 0 || siPMID >= _nSiPMs) continue;
+			photonTimes[siPMID].push_back(_counts->photonTime[p]);
+			photonAmplitudes[siPMID].push_back(_counts->photonWeight[p]);
+		}
+	}
+
+	for (G4int i = 0; i < _nSiPMs; i++)
+	{
+		BuildAvalanches(i);
+		Convolve();
+
+		auto* digi = new SiPMDigi();
+		digi->SetSiPMID(i);
+		digi->SetNAvalanches((G4int)avalancheTimes.size());
+		if (!photonTimes[i].empty()) digi->SetFirstPhotonTime(*std::min_element(photonTimes[i].begin(), photonTimes[i].end()));
+		Discriminate(digi);
+		digis->insert(digi);
+
+		if (_settings.storeWaveforms)
+		{
+			std::copy(waveform.begin(), waveform.end(), waveforms.begin() + (size_t)i * _settings.nSamples);
+		}
+	}
+
+	StoreDigiCollection(digis);
+	_counts = nullptr;
+}
+
+void SiPMDigitizer::BuildAvalanches(G4int siPMID)
+{
+	avalancheTimes.assign(photonTimes[siPMID].begin(), photonTimes[siPMID].end());
+	avalancheAmplitudes.assign(photonAmplitudes[siPMID].begin(), photonAmplitudes[siPMID].end());
+
+	// Dark counts, uniform in the window
+	const G4double window = _settings.nSamples * _settings.sampleWidth;
+	if (_settings.darkCountRate > 0.)
+	{
+		const G4long nDark = G4Poisson(_settings.darkCountRate * window);
+		for (G4long d = 0; d < nDark; d++)
+		{
+			avalancheTimes.push_back(_settings.windowStart + G4UniformRand() * window);
+			avalancheAmplitudes.push_back(1.);
+		}
+	}
+
+	// Optical crosstalk, prompt and chained (each crosstalk avalanche can trigger another one)
+	if (_settings.crosstalkProbability > 0.)
+	{
+		const size_t nPrimaries = avalancheTimes.size();
+		for (size_t a = 0; a < nPrimaries; a++)
+		{
+			while (G4UniformRand() < _settings.crosstalkProbability)
+			{
+				avalancheTimes.push_back(avalancheTimes[a]);
+				avalancheAmplitudes.push_back(avalancheAmplitudes[a]);
+			}
+		}
+	}
+
+	// Afterpulses, delayed and with the amplitude of a partially recharged cell
+	if (_settings.afterpulseProbability > 0.)
+	{
+		const size_t nAvalanches = avalancheTimes.size();
+		for (size_t a = 0; a < nAvalanches; a++)
+		{
+			if (G4UniformRand() >= _settings.afterpulseProbability) continue;
+			const G4double delay = CLHEP::RandExponential::shoot(_settings.afterpulseTimeConstant);
+			const G4double recharge = (_settings.recoveryTime > 0.) ? 1. - std::exp(-delay / _settings.recoveryTime) : 1.;
+			avalancheTimes.push_back(avalancheTimes[a] + delay);
+			avalancheAmplitudes.push_back(avalancheAmplitudes[a] * recharge);
+		}
+	}
+
+	// Microcell saturation: n avalanches spread over the cells fire nCells * (1 - exp(-n / nCells)) of them
+	G4double total = 0.;
+	for (G4double amplitude : avalancheAmplitudes) total += amplitude;
+	if (_settings.nCells > 0 && total > 0.)
+	{
+		const G4double fired = _settings.nCells * (1. - std::exp(-total / _settings.nCells));
+		const G4double scale = fired / total;
+		for (auto& amplitude : avalancheAmplitudes) amplitude *= scale;
+	}
+}
+
+void SiPMDigitizer::Convolve()
+{
+	const G4int nSamples = _settings.nSamples;
+	const G4double invWidth = 1. / _settings.sampleWidth;
+
+	std::fill(binnedAmplitudes.begin(), binnedAmplitudes.end(), 0.);
+	std::fill(waveform.begin(), waveform.end(), 0.);
+
+	for (size_t a = 0; a < avalancheTimes.size(); a++)
+	{
+		const G4double u = (avalancheTimes[a] - _settings.windowStart) * invWidth;
+		if (u < 0. || u >= nSamples) continue;
+		binnedAmplitudes[(G4int)u] += avalancheAmplitudes[a];
+	}
+
+	// Only the samples with avalanches contribute, the inner loop is a plain axpy on contiguous arrays
+	const G4int kernelLength = (G4int)kernel.size();
+	const G4double* pulse = kernel.data();
+	for (G4int i = 0; i < nSamples; i++)
+	{
+		const G4double amplitude = binnedAmplitudes[i];
+		if (amplitude == 0.) continue;
+
+		G4double* out = waveform.data() + i;
+		const G4int n = std::min(kernelLength, nSamples - i);
+		for (G4int k = 0; k < n; k++) out[k] += amplitude * pulse[k];
+	}
+
+	if (_settings.noiseSigma > 0.)
+	{
+		for (auto& sample : waveform) sample += CLHEP::RandGauss::shoot(0., _settings.noiseSigma);
+	}
+}
+
+void SiPMDigitizer::Discriminate(SiPMDigi* digi) const
+{
+	const G4int nSamples = _settings.nSamples;
+	const G4double dt = _settings.sampleWidth;
+	const G4double threshold = _settings.threshold;
+
+	G4double sum = 0.;
+	for (G4double sample : waveform) sum += sample;
+	digi->SetCharge(sum / kernelIntegral);
+
+	// Crossing time between two samples, linear interpolation.
+	// Sample i is the pulse (k + 0.5) * dt after the start of the bin of the avalanche (see the kernel in the constructor),
+	// so it stands for the time windowStart + (i + 0.5) * dt
+	auto sampleTime = [&](G4double i) { return _settings.windowStart + (i + 0.5) * dt; };
+	auto crossing = [&](G4int i) {
+		if (i == 0) return sampleTime(0);
+		const G4double previous = waveform[i - 1];
+		const G4double fraction = (threshold - previous) / (waveform[i] - previous);
+		return sampleTime(i - 1 + fraction);
+	};
+
+	G4int rise = 0;
+	while (rise < nSamples && waveform[rise] < threshold) rise++;
+	if (rise == nSamples) return;
+
+	G4int fall = rise + 1;
+	while (fall < nSamples && waveform[fall] >= threshold) fall++;
+
+	const G4double riseTime = crossing(rise);
+	const G4double fallTime = (fall < nSamples) ? crossing(fall) : sampleTime(nSamples - 1);
+
+	digi->SetTime(riseTime);
+	digi->SetTimeOverThreshold(fallTime - riseTime);
+}
@@ -4,47 +4,78 @@
 #include "G4AnalysisManager.hh"
 #include "G4OpticalPhoton.hh" // not to be confused with OpticalPhotonHit.hh
 #include "G4RunManager.hh"
+#include "G4SystemOfUnits.hh"
+#include "G4VProcess.hh"
 
 #include "OpticalPhotonTrackInfo.hh"
+#include "BoxOpticsModel.hh"
+#include "HotPathDispatch.hh"
+#include "Spill.hh"
 
+#include <algorithm>
 
-SiliconPMSD::SiliconPMSD(const G4String& name, G4String cName) : G4VSensitiveDetector(name), opHitsCollection(nullptr)
+
+SiliconPMSD::SiliconPMSD(const G4String& name, G4String cName, G4int nSiPMs, G4bool storeHits, LightResponseTableBuilder* lightResponseTableBuilder, PhotonRecordWriter* photonRecordWriter)
+	: G4VSensitiveDetector(name), opHitsCollection(nullptr), countersCollection(nullptr)
 {
+	_nSiPMs = nSiPMs;
+	_storeHits = storeHits;
+	_lightResponseTableBuilder = lightResponseTableBuilder;
+	_photonRecordWriter = photonRecordWriter;
+	_photonHistograms = &PhotonHistograms::Get(); // the SDs are thread-local, like the histograms
+
 	// collectionName is a variable of G4VSensitiveDetector
 
 	_cName = cName;
 	collectionName.insert(_cName);
+	collectionName.insert(kSiPMCountersName);
 }
 
 SiliconPMSD::~SiliconPMSD() {}
 
 void SiliconPMSD::Initialize(G4HCofThisEvent* hce)
 {
+	if (hcID < 0)
+	{
+		hcID = G4SDManager::GetSDMpointer()->GetCollectionID(collectionName[0]);
+		countersHCID = G4SDManager::GetSDMpointer()->GetCollectionID(collectionName[1]);
+	}
+
 	// SensitiveDetectorName is a variable of G4VSensitiveDetector
-	opHitsCollection = new G4THitsCollection<OpticalPhotonHit>(SensitiveDetectorName, collectionName[0]);
+	countersCollection = new SiPMCountersCollection(SensitiveDetectorName, collectionName[1], _nSiPMs);
+	hce->AddHitsCollection(countersHCID, countersCollection);
+
+	opHitsCollection = nullptr;
+	if (_storeHits)
+	{
+		opHitsCollection = new G4THitsCollection<OpticalPhotonHit>(SensitiveDetectorName, collectionName[0]);
+		hce->AddHitsCollection(hcID, opHitsCollection);
+	}
 
-	hcID = G4SDManager::GetSDMpointer()->GetCollectionID(collectionName[0]);
-	hce->AddHitsCollection(hcID, opHitsCollection);
+	// The event ID is the same for every photon of the event
+	_eventID = G4RunManager::GetRunManager()->GetCurrentEvent()->GetEventID();
+
+	// Left over if the EventAction returned before the trigger decision
+	photonRecords.clear();
 }
 
 G4bool SiliconPMSD::ProcessHits(G4Step* step, G4TouchableHistory* history)
 {
 	G4Track* track = step->GetTrack();
-	G4int eventID = G4RunManager::GetRunManager()->GetCurrentEvent()->GetEventID();
 
 	// Filter out non optical photons
 	if (track->GetDefinition() != G4OpticalPhoton::OpticalPhotonDefinition()) return false;
 
 	// Get the process that created the optical photon
-	G4String creatorProcess = "none";
-	if (track->GetCreatorProcess() != nullptr) {
-		creatorProcess = track->GetCreatorProcess()->GetProcessName();
+	// (replayed photons of the two-stage simulation report the process they stand for)
+	const OpticalPhotonOrigin origin = GetOpticalPhotonOrigin(track);
+	if (origin != OpticalPhotonOrigin::None) {
 	
 		// Just to check if something weird is happening
-		if (creatorProcess != "Scintillation" && creatorProcess != "Cerenkov") {
+		if (origin == OpticalPhotonOrigin::Other) {
 			G4cout << "----------------------------------" << G4endl;
 			G4cout << "----------------------------------" << G4endl;
-			G4cout << "WARNING - unrecognized process: " << creatorProcess << G4endl;
+			G4cout << "WARNING - unrecognized process: " << track->GetCreatorProcess()->GetProcessName() << G4endl;
 			G4cout << "----------------------------------" << G4endl;
 			G4cout << "----------------------------------" << G4endl;
 	
@@ -53,27 +84,46 @@ G4bool SiliconPMSD::ProcessHits(G4Step* step, G4TouchableHistory* history)
 		}
 	}
 
-	// Retrieve info (reflections) from the track user information
-	auto* trackInfo = static_cast<OpticalPhotonTrackInfo*>(track->GetUserInformation());
+	// Retrieve info (reflections) from the track user information or the side table
+	auto* trackInfo = OpticalPhotonTrackInfo::Get(track);
 	G4int nReflections = trackInfo ? trackInfo->nReflections : 0;
 	G4int nReflectionsAtCoating = trackInfo ? trackInfo->nReflectionsAtCoating : 0;
+	G4double pathLength = trackInfo ? trackInfo->scintPathLength : 0.;
 	G4int siPMID = step->GetPreStepPoint()->GetTouchable()->GetCopyNumber();
+	G4double edgePosition = -1.;
 
+	if (_stripSiPMsPerSide > 0)
+	{
+		// Same orientation as the rows in DetectorConstruction::BuildGeometry (top, right, bottom, left),
+		// the plate is placed in the origin without rotations
+		const G4ThreeVector position = step->GetPreStepPoint()->GetPosition();
+		const G4int edge = siPMID;
+		switch (edge)
+		{
+		case 0:  edgePosition = (position.x() + _halfX) / (2 * _halfX); break;
+		case 1:  edgePosition = (_halfY - position.y()) / (2 * _halfY); break;
+		case 2:  edgePosition = (_halfX - position.x()) / (2 * _halfX); break;
+		default: edgePosition = (position.y() + _halfY) / (2 * _halfY); break;
+		}
+		edgePosition = std::min(std::max(edgePosition, 0.), 1.);
+		siPMID = edge * _stripSiPMsPerSide + std::min((G4int)(edgePosition * _stripSiPMsPerSide), _stripSiPMsPerSide - 1);
+	}
 
-	OpticalPhotonHit* opHit = new OpticalPhotonHit();
-	opHit->SetEventID(eventID);
-	opHit->SetEdep(step->GetTotalEnergyDeposit());
-	opHit->SetProcess(creatorProcess);
-	opHit->SetTime(track->GetGlobalTime());
-	opHit->SetPosition(step->GetPreStepPoint()->GetPosition());
-	opHit->SetNReflections(nReflections);
-	opHit->SetNReflectionsAtCoating(nReflectionsAtCoating);
-	opHit->SetSiPMID(siPMID);
-
-	// add the number of reflections of the optical photon with the coating surface 
-
-	opHitsCollection->insert(opHit);
-
+	RecordPhoton(
+		_eventID,
+		siPMID,
+		origin,
+		step->GetTotalEnergyDeposit(),
+		track->GetGlobalTime(),
+		step->GetPreStepPoint()->GetPosition(),
+		track->GetVertexPosition(),
+		nReflections,
+		nReflectionsAtCoating,
+		pathLength,
+		track->GetWeight(),
+		edgePosition,
+		SpillAncestry::GetMuonIndex(track->GetParentID()) // -1 outside of the spill mode, nothing is registered
+	);
 
 	// kill the track setting G4TrackStatus=fStopAndKill
 	track->SetTrackStatus(fStopAndKill);
@@ -81,8 +131,139 @@ G4bool SiliconPMSD::ProcessHits(G4Step* step, G4TouchableHistory* history)
 	return true;
 }
 
+void SiliconPMSD::RecordPhoton(
+	G4int eventID,
+	G4int siPMID,
+	OpticalPhotonOrigin origin,
+	G4double edep,
+	G4double time,
+	const G4ThreeVector& position,
+	const G4ThreeVector& emissionPosition,
+	G4int nReflections,
+	G4int nReflectionsAtCoating,
+	G4double pathLength,
+	G4double weight,
+	G4double edgePosition,
+	G4int muonIndex
+)
+{
+	// When building the fast optics table, register where the detected photon was emitted
+	if (_lightResponseTableBuilder && origin == OpticalPhotonOrigin::Scintillation)
+	{
+		_lightResponseTableBuilder->RecordDetection(emissionPosition, siPMID, weight);
+	}
+
+	const G4bool isCerenkov = (origin == OpticalPhotonOrigin::Cerenkov);
+
+	// Per-SiPM counters, all the EventAction needs
+	if (siPMID >= 0 && siPMID < _nSiPMs)
+	{
+		SiPMCounts& counts = countersCollection->counts;
+		const G4bool storeEdge = (_stripSiPMsPerSide > 0);
+		const G4int edge = storeEdge ? siPMID / _stripSiPMsPerSide : -1;
+
+		if (isCerenkov)
+		{
+			counts.cerHits[siPMID]++;
+			if (storeEdge)
+			{
+				counts.cerEdge.push_back(edge);
+				counts.cerPosition.push_back(edgePosition);
+			}
+		}
+		else if (origin == OpticalPhotonOrigin::Scintillation)
+		{
+			counts.scintHits[siPMID] += weight;
+			counts.scintHitsW2[siPMID] += weight * weight;
+			if (storeEdge)
+			{
+				counts.scintEdge.push_back(edge);
+				counts.scintPosition.push_back(edgePosition);
+				counts.scintWeight.push_back(weight);
+			}
+
+			// The per-photon histograms are buffered here and binned at the end of the event
+			// (dont forget to remove the g4 units)
+			_photonHistograms->Add(edep / eV, time / ns, position.x() / mm, position.y() / mm, weight);
+		}
+
+		// Spill mode: the same counts split by muon
+		if (muonIndex >= 0)
+		{
+			counts.ResizeMuons(muonIndex + 1);
+			if (isCerenkov) counts.muonCerHits[muonIndex]++;
+			else if (origin == OpticalPhotonOrigin::Scintillation) counts.muonScintHits[muonIndex] += weight;
+		}
+
+		// Input of the SiPMDigitizer
+		if (_storeArrivalTimes)
+		{
+			counts.photonSiPM.push_back(siPMID);
+			counts.photonTime.push_back(time);
+			counts.photonWeight.push_back(weight);
+		}
+	}
+
+	// Debug mode only, a full hit per photon
+	if (opHitsCollection)
+	{
+		OpticalPhotonHit* opHit = new OpticalPhotonHit();
+		opHit->SetEventID(eventID);
+		opHit->SetEdep(edep);
+		opHit->SetProcess(GetOpticalPhotonOriginName(origin));
+		opHit->SetTime(time);
+		opHit->SetPosition(position);
+		opHit->SetNReflections(nReflections);
+		opHit->SetNReflectionsAtCoating(nReflectionsAtCoating);
+		opHit->SetSiPMID(siPMID);
+		opHit->SetWeight(weight);
+		opHit->SetEdgePosition(edgePosition);
+
+		opHitsCollection->insert(opHit);
+	}
+
+	if (_photonRecordWriter)
+	{
+		DetectedPhotonRecord record{};
+		record.eventID = eventID;
+		record.siPMID = (std::uint16_t)siPMID;
+		record.isCerenkov = isCerenkov ? 1 : 0;
+		record.nReflections = (std::uint16_t)std::min(nReflections, 0xFFFF);
+		record.nReflectionsAtCoating = (std::uint16_t)std::min(nReflectionsAtCoating, 0xFFFF);
+		record.pathLength = (float)(pathLength / mm);
+		record.energy = (float)(edep / eV);
+		record.time = (float)(time / ns);
+		record.weight = (float)weight;
+		photonRecords.push_back(record);
+	}
+}
+
+void SiliconPMSD::FlushPhotonRecords(G4bool write)
+{
+	if (!_photonRecordWriter) return;
+
+	// Every event is counted, also the ones without detected photons (the Reweight tool normalizes per event),
+	// except the ones vetoed by the trigger
+	if (write) _photonRecordWriter->WriteEvent(photonRecords);
+	photonRecords.clear();
+}
+
+void SiliconPMSD::SetStripMode(G4int sipmsPerSide, G4double halfX, G4double halfY)
+{
+	_stripSiPMsPerSide = sipmsPerSide;
+	_halfX = halfX;
+	_halfY = halfY;
+}
+
 void SiliconPMSD::EndOfEvent(G4HCofThisEvent* hce)
 {
+	// Photons still waiting in the analytic model batch must land in this event's collection
+	if (_boxOpticsModel) _boxOpticsModel->FlushBatch();
+
+	_photonHistograms->Flush();
+
+	// The photon records of the event are written by the EventAction once the trigger has decided (FlushPhotonRecords)
+
 	// G4int hcID = G4SDManager::GetSDMpointer()->GetCollectionID(collectionName[0]);
 	auto hc = static_cast<G4THitsCollection<OpticalPhotonHit>*>(hce->GetHC(hcID));
 
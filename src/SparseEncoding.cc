@@ -0,0 +1,75 @@
+#include "SparseEncoding.hh"
+#include "RunAction.hh"
+
+
+namespace
+{
+	// Lists the SiPMs with a hit (isHit(i)), or leaves the list empty when the event is better stored dense (returns false then)
+	template <typename IsHit>
+	G4bool SelectChannels(size_t nSiPMs, IsHit isHit, G4double maxOccupancy, std::vector<G4int>& channels)
+	{
+		channels.clear();
+		const size_t maxHits = (size_t)(maxOccupancy * nSiPMs);
+		for (size_t i = 0; i < nSiPMs; i++)
+		{
+			if (!isHit(i)) continue;
+			if (channels.size() == maxHits)
+			{
+				channels.clear();
+				return false;
+			}
+			channels.push_back((G4int)i);
+		}
+		return true;
+	}
+
+	template <typename T>
+	void GatherValues(const std::vector<T>& dense, G4bool sparse, const std::vector<G4int>& channels, std::vector<T>& values)
+	{
+		if (!sparse)
+		{
+			values = dense;
+			return;
+		}
+		values.resize(channels.size());
+		for (size_t k = 0; k < channels.size(); k++) values[k] = dense[channels[k]];
+	}
+}
+
+
+void EncodeSparseColumns(NtupleRow& row, G4double maxOccupancy, G4bool weightedYield, G4bool digitizer)
+{
+	auto& sparse = row.sparse;
+
+	if (weightedYield)
+	{
+		const auto& weighted = row.scintOPsWeighted;
+		const G4bool isSparse = SelectChannels(weighted.size(), [&](size_t i) { return weighted[i] > 0.f; }, maxOccupancy, sparse.scintChannels);
+		GatherValues(row.scintOPsWeighted, isSparse, sparse.scintChannels, sparse.scintValuesWeighted);
+		GatherValues(row.scintOPsVariance, isSparse, sparse.scintChannels, sparse.scintVariance);
+	}
+	else
+	{
+		const auto& counts = row.scintOPs;
+		const G4bool isSparse = SelectChannels(counts.size(), [&](size_t i) { return counts[i] != 0; }, maxOccupancy, sparse.scintChannels);
+		GatherValues(row.scintOPs, isSparse, sparse.scintChannels, sparse.scintValues);
+	}
+
+	const auto& cerCounts = row.cerOPs;
+	const G4bool cerSparse = SelectChannels(cerCounts.size(), [&](size_t i) { return cerCounts[i] != 0; }, maxOccupancy, sparse.cerChannels);
+	GatherValues(row.cerOPs, cerSparse, sparse.cerChannels, sparse.cerValues);
+
+	if (digitizer)
+	{
+		// The charge is not a hit criterion: the electronic noise makes about half of the empty SiPMs positive.
+		// A hit fired the discriminator or saw at least one photon, the noise-only charge of the other SiPMs is dropped
+		const auto& time = row.siPMTime;
+		const auto& firstPhotonTime = row.siPMFirstPhotonTime;
+		const G4bool isSparse = SelectChannels(time.size(), [&](size_t i) { return time[i] >= 0.f || firstPhotonTime[i] >= 0.f; },
+			maxOccupancy, sparse.siPMChannels);
+		GatherValues(row.siPMCharge, isSparse, sparse.siPMChannels, sparse.siPMCharge);
+		GatherValues(row.siPMTime, isSparse, sparse.siPMChannels, sparse.siPMTime);
+		GatherValues(row.siPMToT, isSparse, sparse.siPMChannels, sparse.siPMToT);
+		GatherValues(row.siPMFirstPhotonTime, isSparse, sparse.siPMChannels, sparse.siPMFirstPhotonTime);
+	}
+}
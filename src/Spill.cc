@@ -0,0 +1,32 @@
+#include "Spill.hh"
+
+
+std::vector<G4int>& SpillAncestry::Table()
+{
+	// Indexed by track ID, the value is the track ID of the primary (0 = not registered)
+	static thread_local std::vector<G4int> table;
+	return table;
+}
+
+void SpillAncestry::Reset()
+{
+	// clear() keeps the capacity, after the first spills there is no allocation at all
+	Table().clear();
+}
+
+void SpillAncestry::Register(G4int trackID, G4int parentID)
+{
+	auto& table = Table();
+	if (trackID <= 0) return;
+	if ((size_t)trackID >= table.size()) table.resize(trackID + 1, 0);
+
+	table[trackID] = (parentID == 0) ? trackID : GetMuonIndex(parentID) + 1;
+}
+
+G4int SpillAncestry::GetMuonIndex(G4int trackID)
+{
+	const auto& table = Table();
+	if (trackID <= 0 || (size_t)trackID >= table.size()) return -1;
+
+	return table[trackID] - 1;
+}
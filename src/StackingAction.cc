@@ -0,0 +1,86 @@
+#include "StackingAction.hh"
+
+#include "G4OpticalPhoton.hh"
+#include "G4VProcess.hh"
+#include "G4EventManager.hh"
+#include "G4RunManager.hh"
+
+#include "EventAction.hh"
+#include "HotPathDispatch.hh"
+#include "SubEventParallel.hh"
+#include "Randomize.hh"
+
+
+static inline G4bool isOpticalPhoton(const G4Track* track) {
+	return track->GetDefinition() == G4OpticalPhoton::Definition();
+}
+
+
+StackingAction::StackingAction(StackingActionParameters stackingActionParameters, EventAction* eventAction)
+{
+	_stackingActionParameters = stackingActionParameters;
+	_eventAction = eventAction;
+
+	if (_stackingActionParameters.enablePDEThinning)
+	{
+		// Linear interpolation, the curve is clamped to the edge values outside of its range
+		pde = new G4PhysicsFreeVector(_stackingActionParameters.pdeEnergies, _stackingActionParameters.pdeValues);
+	}
+
+	if (_stackingActionParameters.weightedYieldSettings.enabled)
+	{
+		scintPhotonWeight = 1. / _stackingActionParameters.weightedYieldSettings.fraction;
+	}
+
+	const TriggerSettings& triggerSettings = _stackingActionParameters.triggerSettings;
+	deferOptics = triggerSettings.enabled && triggerSettings.edepThreshold > 0;
+}
+
+StackingAction::~StackingAction()
+{
+	delete pde;
+}
+
+G4ClassificationOfNewTrack StackingAction::ClassifyNewTrack(const G4Track* track)
+{
+	if (!isOpticalPhoton(track)) return fUrgent;
+
+	// In sub-event mode the photons reach the other threads already weighted and thinned by the thread tracking the muon
+	const G4bool enableSubEvents = _stackingActionParameters.enableSubEvents;
+	if (enableSubEvents && G4EventManager::GetEventManager()->GetConstCurrentEvent()->IsSubEvent()) return fUrgent;
+
+	const G4ClassificationOfNewTrack accepted = enableSubEvents ? kOpticalPhotonSubEvent : (deferOptics ? fWaiting : fUrgent);
+
+	// Scintillation photons inherit the weight of their parent (1), I rescale it to account for the reduced yield.
+	// The thinning below doesn't touch the weights: it is the physical detection probability, not a bias.
+	if (scintPhotonWeight != 1.)
+	{
+		if (GetOpticalPhotonOrigin(track) == OpticalPhotonOrigin::Scintillation)
+		{
+			const_cast<G4Track*>(track)->SetWeight(track->GetWeight() * scintPhotonWeight);
+		}
+	}
+
+	if (!pde) return accepted;
+
+	// Each photon is detected with probability fillFactor * PDE(E) independently of its path,
+	// so the detection can be decided as soon as it is created (binomial thinning of the photon yield).
+	// Only the photons that will be detected if they reach a SiPM are tracked.
+	const G4double detectionProbability = _stackingActionParameters.fillFactor * pde->Value(track->GetKineticEnergy());
+
+	return (G4UniformRand() < detectionProbability) ? accepted : fKill;
+}
+
+
+void StackingAction::NewStage()
+{
+	if (!deferOptics) return;
+
+	// The charged particles are all tracked, only the optical photons are waiting:
+	// this is the trigger stage, the muon edep in the scintillator is final.
+	const G4double scintEdep = _eventAction->GetMuonScorer().GetScore().scintEdep;
+
+	// The waiting photons are dropped and the EventAction counts the veto.
+	// The run manager also flags the G4Event as aborted (the event manager alone doesn't), the EventAction relies on it.
+	if (scintEdep < _stackingActionParameters.triggerSettings.edepThreshold) G4RunManager::GetRunManager()->AbortEvent();
+}
\ No newline at end of file
@@ -1,9 +1,10 @@
 #include "SteppingAction.hh"
+#include "EventAction.hh"
+#include "RunAction.hh"
 
-#include "G4ProcessManager.hh"
-#include "G4OpBoundaryProcess.hh"
 #include "G4OpticalPhoton.hh"
 #include "G4MuonMinus.hh"
+#include "G4LogicalVolumeStore.hh"
 #include "G4SystemOfUnits.hh"
 
 #include "OpticalPhotonTrackInfo.hh"
@@ -19,9 +20,14 @@ static inline G4bool isPrimaryMuon(const G4Track* track) {
 }
 
 
-SteppingAction::SteppingAction(SteppingActionParameters steppingActionParameters) 
+SteppingAction::SteppingAction(SteppingActionParameters steppingActionParameters, EventAction* eventAction, RunAction* runAction) 
 {
 	_steppingActionParameters = steppingActionParameters;
+	_eventAction = eventAction;
+	_runAction = runAction;
+
+	const auto& limits = _steppingActionParameters.photonLimits;
+	enablePhotonLimits = limits.maxGlobalTime > 0 || limits.maxReflections > 0 || limits.maxPathLength > 0;
 };
 
 SteppingAction::~SteppingAction() {};
@@ -30,61 +36,70 @@ void SteppingAction::UserSteppingAction(const G4Step* step)
 {
 	const auto* track = step->GetTrack();
 
-	ProcessOPReflections(track, step);
+	if (_steppingActionParameters.enablePhotonRecords) ProcessOPPathLength(track, step);
+	if (enablePhotonLimits) ProcessOPLimits(step->GetTrack());
 	ProcessMuPosition(track, step);
+	ProcessMuScoring(track, step);
+
+	if (_steppingActionParameters.enableFastOptics || _steppingActionParameters.enableEdepRecording) ProcessScintDeposit(step);
 };
 
 
-void SteppingAction::ProcessOPReflections(const G4Track* track, const G4Step* step)
+// The volume is compared by pointer on every step, the name is only used for this lookup
+const G4LogicalVolume* SteppingAction::GetScintLV()
 {
-	// Filter out non optical photons 
-	// and for optical photons filter out steps that are not at a boundary
-	if (!isOpticalPhoton(track)) return;
-	
-	auto preStep = step->GetPreStepPoint();
-	
-	if (preStep->GetStepStatus() != fGeomBoundary) return;
-
-	static thread_local G4OpBoundaryProcess* boundary = nullptr;
-	if (!boundary)
+	if (!scintLV)
 	{
-		auto* processManager = track->GetDefinition()->GetProcessManager();
-
-		auto* processVector = processManager->GetPostStepProcessVector(typeDoIt);
-
-		for (size_t i = 0; i < processVector->size(); i++)
-		{
-			if (auto* b = dynamic_cast<G4OpBoundaryProcess*>((*processVector)[i]))
-			{
-				boundary = b;
-				break;
-			}
-		}
-		// This shouldnt happen but just in case...
-		if (!boundary) return;
+		scintLV = G4LogicalVolumeStore::GetInstance()->GetVolume(_steppingActionParameters.scintLVName);
 	}
+	return scintLV;
+}
+
+void SteppingAction::ProcessOPPathLength(const G4Track* track, const G4Step* step)
+{
+	if (!isOpticalPhoton(track)) return;
+
+	auto* prePV = step->GetPreStepPoint()->GetPhysicalVolume();
+	if (!prePV || prePV->GetLogicalVolume() != GetScintLV()) return;
+
+	auto* trackInfo = OpticalPhotonTrackInfo::Get(track);
+	if (trackInfo) trackInfo->scintPathLength += step->GetStepLength();
+}
 
-	const auto status = boundary->GetStatus();
+void SteppingAction::ProcessOPLimits(G4Track* track)
+{
+	if (!isOpticalPhoton(track)) return;
 
-	// To determine the enumerator i just checked the source code of Geant4
-	const bool isReflection =
-		(status == G4OpBoundaryProcessStatus::TotalInternalReflection) ||
-		(status == G4OpBoundaryProcessStatus::FresnelReflection) ||
-		(status == G4OpBoundaryProcessStatus::LobeReflection) ||
-		(status == G4OpBoundaryProcessStatus::SpikeReflection) ||
-		(status == G4OpBoundaryProcessStatus::LambertianReflection) ||
-		(status == G4OpBoundaryProcessStatus::BackScattering);
+	// Every tracked photon is counted once, the run summary reports the killed fraction of each limit
+	if (track->GetCurrentStepNumber() == 1) _runAction->CountOpticalPhoton();
 
-	if (!isReflection) return;
+	// Photons already stopped in this step (detected or absorbed) are left alone
+	if (track->GetTrackStatus() != fAlive) return;
 
-	auto trackInfo = static_cast<OpticalPhotonTrackInfo*>(track->GetUserInformation());
+	const auto& limits = _steppingActionParameters.photonLimits;
+	PhotonLimit limit;
 
-	if (!trackInfo) return;
+	if (limits.maxGlobalTime > 0 && track->GetGlobalTime() > limits.maxGlobalTime)
+	{
+		limit = PhotonLimit::GlobalTime;
+	}
+	else if (limits.maxPathLength > 0 && track->GetTrackLength() > limits.maxPathLength)
+	{
+		limit = PhotonLimit::PathLength;
+	}
+	else if (limits.maxReflections > 0)
+	{
+		auto* trackInfo = OpticalPhotonTrackInfo::Get(track);
+		if (!trackInfo || trackInfo->nReflections <= limits.maxReflections) return;
+		limit = PhotonLimit::Reflections;
+	}
+	else
+	{
+		return;
+	}
 
-	trackInfo->nReflections++;
-	// Some logic can be added to check the volumes and determine if the reflection happened at a coating
-	// but since the simulation setup is trivial (the result is the same), for now i'll just skip it
-	trackInfo->nReflectionsAtCoating++;
+	track->SetTrackStatus(fStopAndKill);
+	_runAction->CountKilledPhoton(limit);
 }
 
 void SteppingAction::ProcessMuPosition(const G4Track* track, const G4Step* step)
@@ -101,7 +116,7 @@ void SteppingAction::ProcessMuPosition(const G4Track* track, const G4Step* step)
 	auto* postPV = postStep->GetPhysicalVolume();
 	if (!postPV) return;
 
-	if (postPV->GetLogicalVolume()->GetName() != _steppingActionParameters.scintLVName) return;
+	if (postPV->GetLogicalVolume() != GetScintLV()) return;
 
 
 	auto* trackInfo = static_cast<MuTrackInfo*>(track->GetUserInformation());
@@ -121,4 +136,40 @@ void SteppingAction::ProcessMuPosition(const G4Track* track, const G4Step* step)
 	trackInfo->globalEntryPosition = globalPos;
 	trackInfo->localEntryPosition = localPos;
 	trackInfo->globalTime = globalTime;
-}
\ No newline at end of file
+}
+
+void SteppingAction::ProcessMuScoring(const G4Track* track, const G4Step* step)
+{
+	// Edep in the scintillator and in the coating, path length and exit state of the primary muon
+	if (!isPrimaryMuon(track)) return;
+
+	_eventAction->GetMuonScorer().ProcessStep(step);
+}
+
+void SteppingAction::ProcessScintDeposit(const G4Step* step)
+{
+	// In fast optics mode no scintillation photon is generated,
+	// every step depositing energy in the scintillator is handed to the event action
+	// which turns it into expected SiPM counts using the light response table.
+	// In the two-stage record the same steps (plus the charged ones that may emit Cerenkov light) are streamed to disk.
+	const G4double edep = step->GetTotalEnergyDeposit();
+	const G4bool isCharged = step->GetTrack()->GetDefinition()->GetPDGCharge() != 0.;
+	if (edep <= 0. && !(_steppingActionParameters.enableEdepRecording && isCharged)) return;
+
+	auto* prePV = step->GetPreStepPoint()->GetPhysicalVolume();
+	if (!prePV || prePV->GetLogicalVolume() != GetScintLV()) return;
+
+	if (_steppingActionParameters.enableEdepRecording)
+	{
+		_eventAction->RecordScintStep(step);
+	}
+
+	if (_steppingActionParameters.enableFastOptics && edep > 0.)
+	{
+		_eventAction->AddScintDeposit(
+			step->GetPreStepPoint()->GetPosition(),
+			step->GetPostStepPoint()->GetPosition(),
+			edep
+		);
+	}
+}
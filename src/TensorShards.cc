@@ -0,0 +1,130 @@
+#include "TensorShards.hh"
+#include "RunAction.hh"
+
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <string>
+
+
+namespace
+{
+	const char* kSplitNames[] = { "train", "val", "test" };
+
+	// The header is written with a fixed size, so it can be rewritten in place with the final number of rows
+	constexpr size_t kNpyHeaderSize = 128;
+
+	// .npy format 1.0: magic, version, header length, python dict describing a C-ordered little-endian float32 array
+	void WriteNpyHeader(std::ofstream& out, std::uint64_t rows, G4int cols)
+	{
+		char dict[kNpyHeaderSize];
+		const int length = std::snprintf(dict, sizeof(dict), "{'descr': '<f4', 'fortran_order': False, 'shape': (%llu, %d), }",
+			(unsigned long long)rows, cols);
+
+		std::string header = std::string("\x93NUMPY\x01\x00", 8);
+		const std::uint16_t headerLength = (std::uint16_t)(kNpyHeaderSize - 10);
+		header.push_back((char)(headerLength & 0xFF));
+		header.push_back((char)(headerLength >> 8));
+		header.append(dict, length);
+		header.append(kNpyHeaderSize - 1 - header.size(), ' ');
+		header.push_back('\n');
+
+		out.seekp(0);
+		out.write(header.data(), header.size());
+		out.seekp(0, std::ios::end);
+	}
+
+	// splitmix64 finalizer, consecutive event IDs end up uniformly spread
+	double HashToUnit(std::uint64_t value)
+	{
+		value += 0x9E3779B97F4A7C15ull;
+		value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ull;
+		value = (value ^ (value >> 27)) * 0x94D049BB133111EBull;
+		value ^= value >> 31;
+		return (value >> 11) * (1.0 / 9007199254740992.0);
+	}
+}
+
+
+TensorShardWriter::TensorShardWriter(const TensorShardSettings& settings, G4int nFeatures, G4bool weightedCounts, const G4String& directory, const G4String& prefix)
+{
+	_settings = settings;
+	_nFeatures = nFeatures;
+	_weightedCounts = weightedCounts;
+	_directory = directory;
+	_prefix = prefix;
+
+	features.resize(nFeatures);
+
+	std::error_code ec;
+	for (const char* split : kSplitNames) std::filesystem::create_directories(std::filesystem::path(_directory) / split, ec);
+}
+
+TensorShardWriter::~TensorShardWriter()
+{
+	for (G4int split = 0; split < nSplits; split++) CloseShard((Split)split);
+}
+
+TensorShardWriter::Split TensorShardWriter::GetSplit(G4int eventID) const
+{
+	const double u = HashToUnit((std::uint64_t)(std::uint32_t)eventID);
+	if (u < _settings.testFraction) return Test;
+	if (u < _settings.testFraction + _settings.valFraction) return Val;
+	return Train;
+}
+
+void TensorShardWriter::Add(const NtupleRow& row)
+{
+	const Split split = GetSplit(row.eventID);
+	Shard& shard = shards[split];
+
+	if (shard.nRows >= (std::uint64_t)_settings.eventsPerShard) CloseShard(split);
+	if (!shard.x.is_open()) OpenShard(split);
+
+	// Same preprocessing of the training (np.log1p of the counts)
+	for (G4int i = 0; i < _nFeatures; i++)
+	{
+		const G4double count = _weightedCounts
+			? (i < (G4int)row.scintOPsWeighted.size() ? row.scintOPsWeighted[i] : 0.f)
+			: (i < (G4int)row.scintOPs.size() ? row.scintOPs[i] : 0);
+		features[i] = (float)std::log1p(count);
+	}
+	const float truth[2] = { row.muonHitX, row.muonHitY };
+
+	shard.x.write(reinterpret_cast<const char*>(features.data()), features.size() * sizeof(float));
+	shard.y.write(reinterpret_cast<const char*>(truth), sizeof(truth));
+	shard.nRows++;
+}
+
+void TensorShardWriter::OpenShard(Split split)
+{
+	Shard& shard = shards[split];
+
+	char index[16];
+	std::snprintf(index, sizeof(index), "%04d", shard.index);
+	const std::filesystem::path base = std::filesystem::path(_directory) / kSplitNames[split] / (_prefix + "_" + index);
+
+	shard.x.open(base.string() + "_X.npy", std::ios::binary | std::ios::trunc);
+	shard.y.open(base.string() + "_Y.npy", std::ios::binary | std::ios::trunc);
+	if (!shard.x || !shard.y)
+	{
+		G4cerr << "[TensorShardWriter] Could not open the shard " << base.string() << G4endl;
+	}
+
+	// Placeholder headers, rewritten with the number of rows when the shard is closed
+	WriteNpyHeader(shard.x, 0, _nFeatures);
+	WriteNpyHeader(shard.y, 0, 2);
+	shard.nRows = 0;
+}
+
+void TensorShardWriter::CloseShard(Split split)
+{
+	Shard& shard = shards[split];
+	if (!shard.x.is_open()) return;
+
+	WriteNpyHeader(shard.x, shard.nRows, _nFeatures);
+	WriteNpyHeader(shard.y, shard.nRows, 2);
+	shard.x.close();
+	shard.y.close();
+	shard.index++;
+}
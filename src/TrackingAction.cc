@@ -2,10 +2,13 @@
 #include "EventAction.hh"
 #include "OpticalPhotonTrackInfo.hh"
 #include "MuTrackInfo.hh"
+#include "HotPathDispatch.hh"
+#include "Spill.hh"
 
 #include "G4Track.hh"
 #include "G4OpticalPhoton.hh"
 #include "G4MuonMinus.hh"
+#include "G4VProcess.hh"
 #include "G4SystemOfUnits.hh"
 
 
@@ -31,10 +34,27 @@ void TrackingAction::PreUserTrackingAction(const G4Track* track)
 	// I want to track optical photons to sample the number of reflections they undergo
 	if (isOpticalPhoton(track))
 	{
-		if (!track->GetUserInformation())
+		// In side table mode the counters are kept by the thread, no user information is created for the photon
+		if (_trackingActionParameters.photonTrackInfoMode == PhotonTrackInfoMode::SideTable)
+		{
+			OpticalPhotonTrackInfo::BeginSideTableTrack(track->GetTrackID());
+		}
+		else if (!track->GetUserInformation())
 		{
 			const_cast<G4Track*>(track)->SetUserInformation(new OpticalPhotonTrackInfo());
 		}
+
+		// When building the fast optics table, register where each scintillation photon is emitted
+		auto* builder = _trackingActionParameters.lightResponseTableBuilder;
+		if (builder && GetOpticalPhotonOrigin(track) == OpticalPhotonOrigin::Scintillation)
+		{
+			builder->RecordEmission(track->GetVertexPosition(), track->GetWeight());
+		}
+	}
+	// Spill mode: the photons are attributed to their muon through the ancestry of their parent
+	else if (_trackingActionParameters.enableSpill)
+	{
+		SpillAncestry::Register(track->GetTrackID(), track->GetParentID());
 	}
 	// I want to track primary muons to register their position in the scintillator
 	if (isPrimaryMuon(track))
@@ -59,6 +79,7 @@ void TrackingAction::PostUserTrackingAction(const G4Track* track)
 		// G4cout << "[Tracking Action] MuonXPos: " << trackInfo->globalEntryPosition.x() / cm << " cm" << G4endl;
 
 		_eventAction->RegisterMuonHit(
+			track->GetTrackID(),
 			trackInfo->localEntryPosition,
 			trackInfo->globalEntryPosition,
 			trackInfo->globalTime
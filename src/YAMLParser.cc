@@ -67,4 +67,12 @@ bool YAMLParser::as_bool(ryml::NodeRef node) {
 	else {
 		throw std::runtime_error(std::string("[YAMLParser] Invalid boolean value: ") + valStr);
 	}
-}
\ No newline at end of file
+}
+
+std::vector<double> YAMLParser::as_double_vector(ryml::NodeRef node) {
+	std::vector<double> values;
+	for (size_t i = 0; i < node.num_children(); i++) {
+		values.push_back(as_double(node[i]));
+	}
+	return values;
+}